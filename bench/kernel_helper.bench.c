@@ -0,0 +1,587 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_helper.bench.c                                                                        //
+//                                                                                                           //
+// Abstract:    Throughput benchmark for the kernel_helper library. Synthetic kernels are generated in       //
+//              memory and converted by every interface and output mode, measuring throughput, heap          //
+//              allocations and peak resident memory.                                                        //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       Build the kernel_helper_bench EXECUTABLE and run it from anywhere.                           //
+//              Use -h or --help to print help message for usage instructions.                               //
+//                                                                                                           //
+// Note:        Results are written as CSV, one row per interface, mode, corpus profile and size, so the     //
+//              results of two releases can be compared with diff or a spreadsheet.                          //
+//              Allocations are only counted on Linux, where the linker wraps the allocator for the library. //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../include/kernel_helper.h"
+#include "../include/kernel_scan.h"
+
+// Corpus sizes, from BENCH_MIN_SIZE up to the selected maximum in steps of BENCH_SIZE_STEP
+#define BENCH_MIN_SIZE 1024
+#define BENCH_SIZE_STEP 16
+#define BENCH_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+#define BENCH_MAX_SIZE (1024 * 1024 * 1024)
+
+// Every benchmark is repeated until it has run for BENCH_MIN_SECONDS, or BENCH_MAX_ITERATIONS times
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_ITERATIONS 1000
+
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+#define BENCH_NULL_DEVICE "/dev/null"
+#define BENCH_PAGE_SIZE 4096
+
+// Shape of the synthetic kernels of a corpus
+struct corpus_profile {
+    const char *name;
+    size_t min_line; // Line lengths are spread evenly between min_line and max_line
+    size_t max_line;
+    int blank_percent; // Share of lines that are blank
+    int escape_permille; // Share of characters that need to be escaped
+};
+
+static const struct corpus_profile profiles[] = {
+    { "typical", 4, 80, 15, 5 },
+    { "long_lines", 200, 4000, 2, 2 },
+    { "escape_heavy", 4, 80, 5, 150 },
+    { "blank_heavy", 0, 40, 50, 5 }
+};
+
+// Interface and output mode that a benchmark measures
+enum bench_api {
+    API_PROCESS_KERNEL,
+    API_KH_PROCESS_KERNEL,
+    API_KH_CONVERT_BUFFER,
+    API_PROCESS_KERNEL_BYTES,
+    API_LOAD_KERNEL,
+    API_KH_LOAD_KERNEL,
+    API_LOAD_KERNEL_FILE,
+    API_MAP_KERNEL,
+    API_MINIFY_KERNEL,
+    API_KH_PROCESS_KERNEL_COMPRESSED,
+    API_DECOMPRESS_KERNEL,
+    API_KH_PROCESS_KERNEL_RAW,
+    API_SPECIALIZE_KERNEL
+};
+
+struct benchmark {
+    const char *api_name;
+    const char *mode_name;
+    enum bench_api api;
+    int use_blank_lines;
+};
+
+static const struct benchmark benchmarks[] = {
+    { "process_kernel", "string", API_PROCESS_KERNEL, FALSE },
+    { "kh_process_kernel", "string", API_KH_PROCESS_KERNEL, FALSE },
+    { "kh_process_kernel", "string_blank_lines", API_KH_PROCESS_KERNEL, TRUE },
+    { "kh_convert_buffer", "string", API_KH_CONVERT_BUFFER, FALSE },
+    { "kh_convert_buffer", "string_blank_lines", API_KH_CONVERT_BUFFER, TRUE },
+    { "process_kernel_bytes", "bytes", API_PROCESS_KERNEL_BYTES, FALSE },
+    { "load_kernel", "load", API_LOAD_KERNEL, FALSE },
+    { "kh_load_kernel", "load", API_KH_LOAD_KERNEL, FALSE },
+    { "load_kernel", "file", API_LOAD_KERNEL_FILE, FALSE },
+    { "map_kernel", "file", API_MAP_KERNEL, FALSE },
+    { "minify_kernel", "minify", API_MINIFY_KERNEL, FALSE },
+    { "kh_process_kernel_compressed", "compressed", API_KH_PROCESS_KERNEL_COMPRESSED, FALSE },
+    { "decompress_kernel", "compressed", API_DECOMPRESS_KERNEL, FALSE },
+    { "kh_process_kernel_raw", "raw", API_KH_PROCESS_KERNEL_RAW, FALSE },
+    { "specialize_kernel", "specialize", API_SPECIALIZE_KERNEL, FALSE }
+};
+
+// Parameters of the specialize benchmark, typical of a tuned kernel
+static const struct kernel_parameter bench_parameters[] = { { "WG", "256" }, { "T", "float" }, { "VEC", "4" } };
+#define BENCH_PARAMETER_COUNT (sizeof(bench_parameters) / sizeof(bench_parameters[0]))
+
+// Result of one benchmark
+struct bench_result {
+    size_t iterations;
+    double seconds;
+    size_t allocations;
+    long peak_rss_kb;
+};
+
+#ifdef KERNEL_HELPER_BENCH_COUNT_ALLOCATIONS
+// The linker redirects the library's allocator calls here (see CMakeLists.txt)
+static size_t allocation_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocation_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocation_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocation_count++;
+    return __real_realloc(pointer, size);
+}
+#endif
+
+static void print_help();
+static size_t parse_size(const char *size_string);
+static char *generate_corpus(const struct corpus_profile *profile, size_t size);
+static uint64_t next_random(uint64_t *state);
+static int run_benchmark(const struct benchmark *benchmark, const char *corpus, size_t size,
+                         struct bench_result *result);
+static int run_iteration(const struct benchmark *benchmark, struct kh_context *context, const char *corpus,
+                         size_t size, char *output, size_t output_capacity, FILE *sink, FILE *kernel_file);
+static int touch_pages(const char *source, size_t size);
+static double get_seconds();
+static void reset_peak_rss();
+static long get_peak_rss_kb();
+
+////////////////////////////////////////////////  MAIN  ///////////////////////////////////////////////////////
+
+int main(int argc, char *argv[]) {
+    size_t max_size = BENCH_DEFAULT_MAX_SIZE;
+    const char *output_filename = NULL;
+    const char *api_filter = NULL;
+
+    /* Loop through command-line arguments, matching them to options and setting the corresponding argument */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == STRINGS_ARE_EQUAL || strcmp(argv[i], "--help") == STRINGS_ARE_EQUAL) {
+            print_help();
+            exit(0);
+        }
+        if (strcmp(argv[i], "-s") == STRINGS_ARE_EQUAL && i + 1 < argc) {
+            max_size = parse_size(argv[++i]);
+            if (max_size < BENCH_MIN_SIZE || max_size > BENCH_MAX_SIZE) {
+                printf("Fatal Error: Maximum size must be between 1K and 1G!\n");
+                return 1;
+            }
+        }
+        if (strcmp(argv[i], "-o") == STRINGS_ARE_EQUAL && i + 1 < argc) {
+            output_filename = argv[++i];
+        }
+        if (strcmp(argv[i], "-a") == STRINGS_ARE_EQUAL && i + 1 < argc) {
+            api_filter = argv[++i];
+        }
+    }
+
+    FILE *results = output_filename != NULL ? fopen(output_filename, "w") : stdout;
+    if (results == NULL) {
+        printf("Fatal Error: Results file was not created!\n");
+        return 1;
+    }
+    fprintf(results, "api,mode,profile,size,scanner,iterations,seconds,mb_per_s,allocations,peak_rss_kb\n");
+
+    int failures = 0;
+    for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+        for (size_t size = BENCH_MIN_SIZE; size <= max_size; size *= BENCH_SIZE_STEP) {
+            char *corpus = generate_corpus(&profiles[p], size);
+            if (corpus == NULL) {
+                printf("Fatal Error: Out of memory!\n");
+                return 1;
+            }
+
+            for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+                const struct benchmark *benchmark = &benchmarks[b];
+                if (api_filter != NULL && strcmp(api_filter, benchmark->api_name) != STRINGS_ARE_EQUAL) {
+                    continue;
+                }
+
+                struct bench_result result;
+                if (!run_benchmark(benchmark, corpus, size, &result)) {
+                    printf("Error: %s (%s) failed on %s, %zu bytes\n", benchmark->api_name, benchmark->mode_name,
+                           profiles[p].name, size);
+                    failures++;
+                    continue;
+                }
+
+                double megabytes = (double)size * result.iterations / (1024.0 * 1024.0);
+                fprintf(results, "%s,%s,%s,%zu,%s,%zu,%.6f,%.2f,%zu,%ld\n", benchmark->api_name,
+                        benchmark->mode_name, profiles[p].name, size, get_active_scanner()->name, result.iterations,
+                        result.seconds, megabytes / result.seconds, result.allocations, result.peak_rss_kb);
+                fflush(results);
+            }
+
+            free(corpus);
+            // Stop before the step would overflow, as the maximum size may not be a power of the step
+            if (size > max_size / BENCH_SIZE_STEP) {
+                break;
+            }
+        }
+    }
+
+    if (results != stdout) {
+        fclose(results);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Print a help message detailing usage, options, and flags.
+ */
+static void print_help() {
+    printf("Usage: kernel_helper_bench [options]\n"
+           "Options:\n"
+           "    -h, --help         Display this help message\n"
+           "    -s <size>          Largest kernel to generate, such as 64M or 1G (default: 64M)\n"
+           "    -o <file>          Write the CSV results to a file instead of the console\n"
+           "    -a <interface>     Only benchmark one interface, such as kh_convert_buffer\n"
+           "Columns:\n"
+           "    allocations        Heap allocations made by the library per iteration (Linux only)\n"
+           "    peak_rss_kb        Peak resident memory of the benchmark, including the kernel itself\n");
+}
+
+/*
+ * Parse a size in bytes, with an optional K, M or G suffix.
+ * Params:
+ *      size_string: string that will be parsed
+ * Returns:
+ *      size in bytes, or 0 if the string is not a size
+ */
+static size_t parse_size(const char *size_string) {
+    char *suffix;
+    unsigned long long size = strtoull(size_string, &suffix, 10);
+
+    switch (*suffix) {
+        case 'G': case 'g':
+            size *= 1024;
+            // Fall through
+        case 'M': case 'm':
+            size *= 1024;
+            // Fall through
+        case 'K': case 'k':
+            size *= 1024;
+            suffix++;
+            break;
+        default:
+            break;
+    }
+
+    return *suffix == '\0' ? (size_t)size : 0;
+}
+
+/*
+ * Generate a synthetic kernel with the shape of a corpus profile. The kernel only depends on the profile and size,
+ * so every run benchmarks the same input.
+ * Params:
+ *      profile: shape of the kernel
+ *      size: size of the kernel in bytes
+ * Returns:
+ *      pointer to the null-terminated kernel, to be freed by the caller, or NULL if out of memory
+ */
+static char *generate_corpus(const struct corpus_profile *profile, size_t size) {
+    // Lines are built from kernel tokens, so the corpus repeats itself like real kernels do
+    static const char *const tokens[] = {
+        "__kernel", "void", "__global", "const", "float", "int", "float4", "size_t", "get_global_id(0)", "i", "j",
+        "output", "input", "weights", "[i]", "=", "+", "*", "+=", "(", ")", "{", "}", ";", "for", "if", "return",
+        "0.5f", "1", "mad(", "//", "#define", "barrier(CLK_LOCAL_MEM_FENCE)", ","
+    };
+    uint64_t state = BENCH_SEED;
+
+    char *corpus = malloc(size + 1);
+    if (corpus == NULL) {
+        return NULL;
+    }
+
+    size_t length = 0;
+    while (length < size) {
+        size_t line_size = 0;
+        if ((int)(next_random(&state) % 100) >= profile->blank_percent) {
+            line_size = profile->min_line + next_random(&state) % (profile->max_line - profile->min_line + 1);
+        }
+
+        size_t line_end = length + line_size < size ? length + line_size : size;
+        while (length < line_end) {
+            if ((int)(next_random(&state) % 1000) < profile->escape_permille) {
+                corpus[length++] = next_random(&state) % 2 == 0 ? '"' : '\\';
+                continue;
+            }
+            const char *token = tokens[next_random(&state) % (sizeof(tokens) / sizeof(tokens[0]))];
+            while (*token != '\0' && length < line_end) {
+                corpus[length++] = *token++;
+            }
+            if (length < line_end) {
+                corpus[length++] = ' ';
+            }
+        }
+        if (length < size) {
+            corpus[length++] = '\n';
+        }
+    }
+
+    corpus[size] = '\0';
+    return corpus;
+}
+
+/*
+ * Get the next number of a xorshift64* generator, which is fast and identical on every platform.
+ * Params:
+ *      state: generator state, which is advanced
+ * Returns:
+ *      64-bit pseudo-random number
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Repeat one benchmark on a kernel until it has run for long enough to be timed reliably.
+ * Params:
+ *      benchmark: interface and mode that will be measured
+ *      corpus: kernel that will be converted
+ *      size: size of the kernel in bytes
+ *      result: set to the measurements
+ * Returns:
+ *      TRUE if every iteration succeeded, FALSE otherwise
+ */
+static int run_benchmark(const struct benchmark *benchmark, const char *corpus, size_t size,
+                         struct bench_result *result) {
+    struct kh_context context;
+    kh_init_context(&context);
+    context.use_blank_lines = benchmark->use_blank_lines;
+
+    FILE *sink = fopen(BENCH_NULL_DEVICE, "w");
+    if (sink == NULL) {
+        return FALSE;
+    }
+
+    // Buffers owned by the caller are set up outside of the timed loop, as a runtime would reuse them
+    size_t output_capacity = 0;
+    if (benchmark->api == API_KH_CONVERT_BUFFER) {
+        output_capacity = kh_converted_size(&context, corpus, size);
+    } else if (benchmark->api == API_MINIFY_KERNEL) {
+        output_capacity = size;
+    } else if (benchmark->api == API_DECOMPRESS_KERNEL) {
+        output_capacity = COMPRESS_BOUND(size) + size;
+    } else if (benchmark->api == API_SPECIALIZE_KERNEL) {
+        output_capacity = specialize_bound(bench_parameters, BENCH_PARAMETER_COUNT, size);
+    }
+    char *output = malloc(output_capacity + 1);
+    if (output == NULL) {
+        fclose(sink);
+        return FALSE;
+    }
+
+    // Decompression reads a kernel compressed up front, placed after the space for the decompressed kernel
+    if (benchmark->api == API_DECOMPRESS_KERNEL) {
+        size_t compressed_size = compress_kernel(corpus, size, (unsigned char *)output + size);
+        corpus = output + size;
+        output_capacity = compressed_size;
+    }
+
+    // The file interfaces load the kernel from a temporary file, which the page cache keeps in memory
+    FILE *kernel_file = NULL;
+    if (benchmark->api == API_LOAD_KERNEL_FILE || benchmark->api == API_MAP_KERNEL) {
+        kernel_file = tmpfile();
+        if (kernel_file == NULL || fwrite(corpus, sizeof(char), size, kernel_file) != size || fflush(kernel_file) != 0) {
+            if (kernel_file != NULL) {
+                fclose(kernel_file);
+            }
+            free(output);
+            fclose(sink);
+            return FALSE;
+        }
+    }
+
+    reset_peak_rss();
+#ifdef KERNEL_HELPER_BENCH_COUNT_ALLOCATIONS
+    allocation_count = 0;
+#endif
+
+    int succeeded = TRUE;
+    double start = get_seconds();
+    result->iterations = 0;
+    do {
+        succeeded = run_iteration(benchmark, &context, corpus, size, output, output_capacity, sink, kernel_file);
+        result->iterations++;
+        result->seconds = get_seconds() - start;
+    } while (succeeded && result->seconds < BENCH_MIN_SECONDS && result->iterations < BENCH_MAX_ITERATIONS);
+
+#ifdef KERNEL_HELPER_BENCH_COUNT_ALLOCATIONS
+    result->allocations = allocation_count / result->iterations;
+#else
+    result->allocations = 0;
+#endif
+    result->peak_rss_kb = get_peak_rss_kb();
+
+    kh_free_context(&context);
+    free(output);
+    fclose(sink);
+    if (kernel_file != NULL) {
+        fclose(kernel_file);
+    }
+    return succeeded;
+}
+
+/*
+ * Run one iteration of a benchmark.
+ * Params:
+ *      benchmark: interface and mode that will be measured
+ *      context: context reused by every iteration of the benchmark
+ *      corpus: kernel that will be converted
+ *      size: size of the kernel in bytes
+ *      output: buffer for the interfaces that write to memory
+ *      output_capacity: size of `output` in bytes
+ *      sink: file for the interfaces that write to a file, which discards everything written to it
+ *      kernel_file: file holding the kernel, for the interfaces that load a kernel from a file
+ * Returns:
+ *      TRUE if the iteration succeeded, FALSE otherwise
+ */
+static int run_iteration(const struct benchmark *benchmark, struct kh_context *context, const char *corpus,
+                         size_t size, char *output, size_t output_capacity, FILE *sink, FILE *kernel_file) {
+    size_t output_size;
+    int succeeded = TRUE;
+
+    // Kernels loaded from a file are read through once, as clCreateProgramWithSource() would
+    if (benchmark->api == API_LOAD_KERNEL_FILE) {
+        rewind(kernel_file);
+        char *kernel_string = load_kernel(kernel_file, size);
+        succeeded = kernel_string != NULL && touch_pages(kernel_string, size);
+        free(kernel_string);
+        return succeeded;
+    }
+    if (benchmark->api == API_MAP_KERNEL) {
+        struct kernel_view view;
+        rewind(kernel_file);
+        succeeded = map_kernel(kernel_file, &view) && view.size == size && touch_pages(view.source, view.size);
+        release_kernel(&view);
+        return succeeded;
+    }
+
+    if (benchmark->api == API_KH_CONVERT_BUFFER) {
+        return kh_convert_buffer(context, corpus, size, output, output_capacity, &output_size);
+    }
+    if (benchmark->api == API_MINIFY_KERNEL) {
+        minify_kernel(corpus, size, output);
+        return TRUE;
+    }
+    if (benchmark->api == API_SPECIALIZE_KERNEL) {
+        specialize_kernel(corpus, size, bench_parameters, BENCH_PARAMETER_COUNT, output);
+        return TRUE;
+    }
+    if (benchmark->api == API_DECOMPRESS_KERNEL) {
+        // `corpus` holds the compressed kernel here, and `output_capacity` its size
+        return decompress_kernel((const unsigned char *)corpus, output_capacity, output, size);
+    }
+
+    FILE *kernel = fmemopen((void *)corpus, size, "r");
+    if (kernel == NULL) {
+        return FALSE;
+    }
+
+    char *kernel_string;
+    switch (benchmark->api) {
+        case API_PROCESS_KERNEL:
+            process_kernel(kernel, sink);
+            break;
+        case API_KH_PROCESS_KERNEL:
+            succeeded = kh_process_kernel(context, kernel, sink);
+            break;
+        case API_PROCESS_KERNEL_BYTES:
+            process_kernel_bytes(kernel, sink, "bench_kernel");
+            break;
+        case API_KH_PROCESS_KERNEL_COMPRESSED:
+            succeeded = kh_process_kernel_compressed(context, kernel, sink, "bench_kernel");
+            break;
+        case API_KH_PROCESS_KERNEL_RAW:
+            succeeded = kh_process_kernel_raw(context, kernel, sink);
+            break;
+        case API_LOAD_KERNEL:
+            kernel_string = load_kernel(kernel, size);
+            succeeded = kernel_string != NULL;
+            free(kernel_string);
+            break;
+        case API_KH_LOAD_KERNEL:
+            succeeded = kh_load_kernel(context, kernel, &output_size) != NULL && output_size == size;
+            break;
+        default:
+            break;
+    }
+
+    fclose(kernel);
+    return succeeded;
+}
+
+/*
+ * Read one byte of every page of a loaded kernel, so mapped pages are faulted in and counted as resident.
+ * Returns:
+ *      TRUE, as the bytes are only read for their side effect
+ */
+static int touch_pages(const char *source, size_t size) {
+    volatile char byte = 0;
+    for (size_t i = 0; i < size; i += BENCH_PAGE_SIZE) {
+        byte ^= source[i];
+    }
+
+    (void)byte;
+    return TRUE;
+}
+
+/*
+ * Get the time of a monotonic clock.
+ * Returns:
+ *      time in seconds
+ */
+static double get_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/*
+ * Reset the peak resident memory of the process to its current resident memory, so each benchmark reports its
+ * own peak. Only Linux supports this; elsewhere the peak is that of the whole run so far.
+ */
+static void reset_peak_rss() {
+#ifdef __linux__
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs != NULL) {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+#endif
+}
+
+/*
+ * Get the peak resident memory of the process.
+ * Returns:
+ *      peak resident memory in kilobytes
+ */
+static long get_peak_rss_kb() {
+#ifdef __linux__
+    char line[256];
+    long peak_rss_kb = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        while (fgets(line, sizeof(line), status) != NULL) {
+            if (sscanf(line, "VmHWM: %ld kB", &peak_rss_kb) == 1) {
+                break;
+            }
+        }
+        fclose(status);
+    }
+    if (peak_rss_kb >= 0) {
+        return peak_rss_kb;
+    }
+#endif
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Reported in bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,47 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        build_cache.h                                                                                //
+//                                                                                                           //
+// Abstract:    Incremental build cache for the convert_kernel executable. A small manifest stored next to   //
+//              the outputs records the content hash of every converted kernel along with the options it was //
+//              converted with, so unchanged kernels can be skipped without touching their outputs.          //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       Load the cache for an output directory, look up one entry per output, and save it once the   //
+//              kernels have been converted. Outputs are replaced with replace_output() so they are only     //
+//              rewritten when their contents actually change.                                               //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef KERNEL_HELPER_BUILD_CACHE_H
+#define KERNEL_HELPER_BUILD_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CACHE_FILE_NAME ".kernel_helper_cache"
+#define CACHE_LINE_SIZE 4096
+
+// Hashes of the kernel and options one output was last converted from
+struct cache_entry {
+    char *output_path;
+    uint64_t input_hash;
+    uint64_t options_hash;
+};
+
+// Every cache entry stored in one manifest file
+struct build_cache {
+    char *path;
+    struct cache_entry *entries;
+    size_t entry_count;
+    size_t capacity;
+};
+
+int load_build_cache(struct build_cache *cache, const char *directory);
+size_t get_cache_entry(struct build_cache *cache, const char *output_path);
+int save_build_cache(const struct build_cache *cache);
+void free_build_cache(struct build_cache *cache);
+int replace_output(const char *temp_path, const char *output_path);
+
+#endif //KERNEL_HELPER_BUILD_CACHE_H
@@ -11,8 +11,6 @@
 // Usage:       Build the kernel_helper EXECUTABLE to preprocess OpenCL kernels.                             //
 //                                                                                                           //
 // Note:        Kernel *.cl file must be in the same directory/folder as the program executable.             //
-//              Expects a blank line at the end of file, else UNDEFINED BEHAVIOUR WILL OCCUR.                //
-//              The above is a known issue, which should be fixed in a future version.                       //
 //              Use -h or --help to print help message for usage instructions.                               //
 //                                                                                                           //
 // Example:     __kernel void example(                                                                       //
@@ -36,7 +34,219 @@
 #ifndef KERNEL_HELPER_CONVERT_KERNEL_H
 #define KERNEL_HELPER_CONVERT_KERNEL_H
 
+#include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "build_cache.h"
+#include "include_cache.h"
+
+// Batch mode
+#define MANIFEST_LINE_SIZE 4096
+
+// Output formats, selected with -F
+enum output_format {
+    FORMAT_STRING, // Quoted string literal lines, see process_kernel
+    FORMAT_BYTES, // C header holding a byte array, see process_kernel_bytes
+    FORMAT_INCBIN, // Assembly embedding the kernel with .incbin, see process_kernel_incbin
+    FORMAT_COMPRESSED, // C header holding a compressed byte array, see process_kernel_compressed
+    FORMAT_RAW, // One C++ raw string literal, see process_kernel_raw
+    FORMAT_COUNT
+};
+
+static const char *const output_format_names[FORMAT_COUNT] = { "string", "bytes", "incbin", "compressed", "raw" };
+static const char *const output_extensions[FORMAT_COUNT] = { ".txt", ".h", ".S", ".h", ".txt" };
+
+// Options that are followed by a value
+static const char *const value_options[] = { "-f", "-o", "-d", "-g", "-m", "-p", "-F", "-s", "-I", "-P", "-j" };
+
+// Reports of the work done, selected with --stats
+enum stats_mode {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON // One JSON object on the last line of the output
+};
+
+// Set output option defaults
+static int verbose = VERBOSE_DEFAULT;
+static int use_blank_lines = USE_BLANK_LINES_DEFAULT;
+static int use_immediate_directory = IMMEDIATE_DIRECTORY_DEFAULT;
+static enum output_format output_format = FORMAT_STRING;
+static const char *symbol_name = NULL;
+static int use_minify = FALSE;
+static int use_inline_includes = FALSE;
+static int write_depfiles = FALSE;
+static enum stats_mode stats_mode = STATS_NONE;
+
+// Parameter matrix, see -P
+#define MAX_PARAMETER_VALUES 64
+#define NO_VARIANT ((size_t)-1)
+#define VARIANT_TABLE_SUFFIX "_variants"
+
+// Every combination of parameter values is converted as its own variant, the last parameter varying fastest
+struct parameter_matrix {
+    char *names[SPECIALIZE_MAX_PARAMETERS];
+    char *values[SPECIALIZE_MAX_PARAMETERS][MAX_PARAMETER_VALUES];
+    size_t value_counts[SPECIALIZE_MAX_PARAMETERS];
+    size_t parameter_count;
+    size_t variant_count;
+};
+
+static struct parameter_matrix parameter_matrix;
+
+// Include inlining
+#define MAX_SEARCH_PATHS 64
+#define DEPFILE_EXTENSION ".d"
+
+static struct include_cache include_cache;
+
+// Kernel after the optional include inlining and minification stages
+struct prepared_source {
+    struct kernel_view view;
+    struct expanded_kernel expanded;
+    char *specialized;
+    char *minified;
+    const char *source;
+    size_t size;
+};
+
+// Incremental mode, bump the version whenever the converted output changes for the same options
+#define CACHE_FORMAT_VERSION 1
+
+// Outcome of a batch job
+enum job_status {
+    JOB_CONVERTED,
+    JOB_UNCHANGED, // Converted, but the output already held the same bytes
+    JOB_SKIPPED // Kernel and options unchanged since the last conversion
+};
+
+// One kernel of a batch, along with the result of converting it
+struct batch_job {
+    char *input_path;
+    char *output_path;
+    const char *error;
+    enum job_status status;
+    size_t cache_number; // Build cache of the output's directory, in `batch->caches`
+    size_t cache_index; // Entry of the output in its build cache
+    const char *symbol;
+    size_t original_size;
+    size_t minified_size;
+    size_t variant; // Index of the parameter values the kernel is specialized for, or NO_VARIANT
+    char *variant_symbol;
+    size_t unresolved_count; // Number of included headers that were not found, and are left to the OpenCL compiler
+    char *unresolved_name; // Name of the first header that was not found, or NULL
+};
+
+// Lookup table of the variants of one kernel, which are consecutive jobs of a batch
+struct variant_table {
+    char *path;
+    char *symbol;
+    size_t first_job;
+};
+
+// List of kernels converted together by a pool of worker threads
+struct batch {
+    struct batch_job *jobs;
+    size_t job_count;
+    size_t capacity;
+    size_t next_job;
+    pthread_mutex_t lock;
+    int incremental;
+    struct build_cache *caches; // One per output directory, each with its own manifest
+    size_t cache_count;
+    struct kh_stats stats; // Counters of every worker, added together as they finish
+    struct variant_table *tables;
+    size_t table_count;
+};
+
+// Chunked conversion, which splits one large kernel between threads in single kernel mode
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define CHUNK_MIN_KERNEL_SIZE (4 * CHUNK_SIZE) // Smaller kernels are converted faster by a single thread
+#define CHUNKS_PER_THREAD 2 // Chunks converted ahead of the one being written, for every thread
+
+static int chunk_thread_count = 1;
+
+// Part of a kernel that ends after a newline, or at the end of the kernel
+struct chunk {
+    const char *source;
+    size_t size;
+    size_t output_size;
+    int converted;
+};
+
+// Kernel converted chunk by chunk by a pool of worker threads, while the calling thread writes the chunks in order
+struct chunked_kernel {
+    struct chunk *chunks;
+    size_t chunk_count;
+    size_t next_chunk;
+    size_t next_write;
+    char **outputs; // Output of each chunk in flight, whose buffer is reused `window` chunks later
+    size_t *output_capacities;
+    size_t window;
+    int use_blank_lines; // Blank line mode of the calling thread's context, which every worker follows
+    const char *error;
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_converted;
+    pthread_cond_t chunk_written;
+    struct kh_stats stats; // Counters of every worker, added together as they finish
+};
+
 static void print_help();
 static char *get_file_path(char *file_name, int immediate_directory);
+static void init_context(struct kh_context *context);
+static const char *convert_file(struct kh_context *context, struct batch_job *job, const char *out_address);
+static const char *prepare_source(struct kh_context *context, struct batch_job *job,
+                                  struct prepared_source *prepared);
+static void release_source(struct prepared_source *prepared);
+static const char *write_converted(struct kh_context *context, const struct batch_job *job,
+                                   const struct prepared_source *prepared, const char *out_address);
+static const char *write_depfile(const struct batch_job *job, const struct prepared_source *prepared);
+static void write_depfile_path(FILE *depfile, const char *path);
+
+// Chunked conversion
+static int convert_chunked(struct kh_context *context, const struct prepared_source *prepared, FILE *kernel_out);
+static void *chunk_worker(void *argument);
+static int convert_chunk(struct kh_context *context, struct chunked_kernel *chunked, size_t index);
+static void print_minify_report(const struct batch_job *job);
+static void print_unresolved_report(const struct batch_job *job);
+static int set_output_format(const char *format_name);
+static int set_stats_mode(const char *option);
+static int takes_value(const char *option);
+static double get_seconds();
+static void print_stats(const struct kh_stats *stats, size_t kernel_count, double total_seconds);
+static char *get_symbol_name(const char *path);
+
+// Batch mode
+static int get_core_count();
+static void add_job(struct batch *batch, char *input_path, char *output_path, const char *output_directory);
+static char *get_output_path(const char *input_path, const char *output_directory);
+static int is_kernel_file(const char *file_name);
+static int collect_directory(struct batch *batch, char *directory, const char *output_directory);
+static int collect_pattern(struct batch *batch, char *pattern, const char *output_directory);
+static int collect_manifest(struct batch *batch, char *manifest, const char *output_directory);
+static void *batch_worker(void *argument);
+static int write_bundle(struct batch *batch, const char *bundle_path);
+static const char *get_file_name(const char *path);
+static int run_batch(struct batch *batch, int thread_count);
+static void free_batch(struct batch *batch);
+
+// Specialization
+static int add_parameters(const char *matrix);
+static void get_variant_parameters(size_t variant, struct kernel_parameter *parameters);
+static char *get_variant_suffix(size_t variant);
+static char *insert_suffix(const char *path, const char *suffix, const char *extension);
+static void expand_variants(struct batch *batch);
+static int write_variant_tables(const struct batch *batch);
+static const char *write_variant_table(const struct batch *batch, const struct variant_table *table);
+
+// Incremental mode
+static const char *convert_file_incremental(struct kh_context *context, struct batch_job *job,
+                                           struct cache_entry *entry);
+static uint64_t get_options_hash(const struct batch_job *job);
+static size_t get_build_cache(struct batch *batch, const char *output_path);
+static char *get_directory(const char *path);
 
 #endif //KERNEL_HELPER_CONVERT_KERNEL_H
@@ -0,0 +1,74 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        include_cache.h                                                                              //
+//                                                                                                           //
+// Abstract:    Include inlining for the convert_kernel executable. #include "..." directives are resolved   //
+//              against the including file's directory and a list of search paths, and replaced by the       //
+//              contents of the header, so the OpenCL runtime never has to resolve them itself.              //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       Create one cache per batch and share it between every kernel (and worker thread), so each    //
+//              header is only resolved and read once, however many kernels include it.                      //
+//                                                                                                           //
+// Note:        Headers with #pragma once, or whose contents are wrapped in an include guard, are only       //
+//              inlined the first time they are included by a kernel. #include <...> is left untouched, and  //
+//              every inlined header is wrapped in #line markers, so diagnostics point at the right file.    //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef KERNEL_HELPER_INCLUDE_CACHE_H
+#define KERNEL_HELPER_INCLUDE_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "kernel_helper.h"
+
+#define MAX_INCLUDE_DEPTH 64
+
+// Header read once and shared by every kernel of a batch
+struct cached_header {
+    char *path;
+    struct kernel_view view;
+    int include_once;
+};
+
+// Result of looking for a header at one path, remembered so that path is only tried once
+struct include_lookup {
+    char *candidate_path;
+    struct cached_header *header; // NULL if there is no file at the path
+};
+
+// Every header and lookup of a batch
+struct include_cache {
+    const char **search_paths;
+    size_t search_path_count;
+    struct cached_header **headers;
+    size_t header_count;
+    size_t header_capacity;
+    struct include_lookup *lookups;
+    size_t lookup_count;
+    size_t lookup_capacity;
+    pthread_mutex_t lock;
+};
+
+// Kernel with its includes inlined, along with every header it depends on
+struct expanded_kernel {
+    char *source;
+    size_t size;
+    size_t capacity;
+    const struct cached_header **dependencies;
+    size_t dependency_count;
+    size_t dependency_capacity;
+    size_t unresolved_count; // Number of #include "..." directives whose header was not found, which are kept
+    char *unresolved_name; // Name of the first header that was not found, or NULL
+};
+
+void init_include_cache(struct include_cache *cache, const char **search_paths, size_t search_path_count);
+void free_include_cache(struct include_cache *cache);
+const char *inline_includes(struct include_cache *cache, const char *kernel_path, const char *source, size_t size,
+                            struct expanded_kernel *expanded);
+void free_expanded_kernel(struct expanded_kernel *expanded);
+
+#endif //KERNEL_HELPER_INCLUDE_CACHE_H
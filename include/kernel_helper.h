@@ -12,9 +12,26 @@
 //                                                                                                           //
 // Interfaces:  load_kernel(FILE *kernel, size_t kernel_size) - load kernel as string at runtime             //
 //              process_kernel(FILE *kernel, FILE* kernel_out) - format kernel to paste-able format          //
-//                                                                                                           //
-// Note:        Expects a blank line at the end of file, else UNDEFINED BEHAVIOUR WILL OCCUR.                //
-//              The above is a known issue, which should be fixed in a future version.                       //
+//              map_kernel(FILE *kernel, struct kernel_view *view) - map kernel into memory without copying  //
+//              release_kernel(struct kernel_view *view) - release a kernel loaded with map_kernel           //
+//              process_kernel_bytes(FILE *, FILE *, const char *symbol) - format kernel to a C byte array   //
+//              process_kernel_incbin(const char *, FILE *, const char *symbol) - embed kernel with .incbin  //
+//              kh_process_kernel(struct kh_context *, FILE *, FILE *) - process_kernel with a context       //
+//              kh_load_kernel(struct kh_context *, FILE *, size_t *) - load_kernel with a context           //
+//              kh_convert_buffer(struct kh_context *, const char *, size_t, char *, size_t, size_t *)       //
+//                  - format a kernel from memory into a caller-provided buffer                              //
+//              kh_converted_size(const struct kh_context *, const char *, size_t) - exact output size       //
+//              hash_kernel(const char *source, size_t size) - hash a kernel to detect changes               //
+//              minify_kernel(const char *source, size_t size, char *minified) - strip comments and spaces   //
+//              specialize_kernel(const char *, size_t, const struct kernel_parameter *, size_t, char *)     //
+//                  - bake macro parameters into a kernel and resolve the #if branches they decide           //
+//              process_kernel_compressed(FILE *, FILE *, const char *symbol) - format kernel compressed     //
+//              process_kernel_raw(FILE *kernel, FILE *kernel_out) - format kernel as one C++ raw literal    //
+//              decompress_kernel(const unsigned char *, size_t, char *, size_t) - rebuild compressed kernel //
+//              open_kernel_bundle(FILE *, struct kernel_bundle *) - map a bundle of kernels                 //
+//              find_bundle_kernel(const struct kernel_bundle *, const char *name, struct kernel_view *)     //
+//                  - look a kernel up by name in a bundle without copying it                                //
+//              kh_get_stats(const struct kh_context *) - counters and stage times of a context              //
 //                                                                                                           //
 // Example:     __kernel void example(                                                                       //
 //                  __global float* output_buffer)                                                           //
@@ -37,10 +54,10 @@
 #ifndef KERNEL_HELPER_KERNEL_HELPER_H
 #define KERNEL_HELPER_KERNEL_HELPER_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 
 // Defines for readability
 #define TRUE 1
@@ -51,22 +68,99 @@
 #define DEFAULT_KERNEL_FILE "kernel.cl"
 #define DEFAULT_OUTPUT_FILE "example.txt"
 #define IO_DIRECTORY "data/"
-#define MAX_BUFFER_SIZE 128
+#define READ_BLOCK_SIZE 65536
+#define WRITE_BLOCK_SIZE 65536
+
+// Embedding
+#define KERNEL_ALIGNMENT 16
+#define BYTES_PER_LINE 32
+#define BYTE_STRING_SIZE 5
+
+// Raw string literals, closed by )kh" or by )khN" with the lowest free N below RAW_DELIMITER_COUNT
+#define RAW_DELIMITER_PREFIX "kh"
+#define RAW_DELIMITER_COUNT 64
+#define RAW_DELIMITER_SIZE 8
+
+// Specialization, see specialize_kernel()
+#define SPECIALIZE_MAX_PARAMETERS 16
+#define SPECIALIZE_MAX_DEPTH 64 // Conditional groups nested deeper are kept as they are
+#define SPECIALIZE_MAX_EXPANSION 8 // Parameters whose values refer to other parameters
+#define SPECIALIZE_LINE_RESET "#line 1\n"
+
+// Compression, the compressed kernel takes at most COMPRESS_BOUND(size) bytes
+#define COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Hashing
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
 // Default parameter values
 #define VERBOSE_DEFAULT FALSE
 #define USE_BLANK_LINES_DEFAULT FALSE
 #define IMMEDIATE_DIRECTORY_DEFAULT FALSE
 
-// Set global option defaults
-static int verbose = VERBOSE_DEFAULT;
-static int use_blank_lines = USE_BLANK_LINES_DEFAULT;
-static int use_immediate_directory = IMMEDIATE_DIRECTORY_DEFAULT;
-
 // Define global strings that will be used
 static const char string_prefix[] = { '"' };
+static const char escape_prefix[] = { '\\' };
 static const char string_suffix[] = {' ', '\\', 'n', '"', '\n', '\0' };
 static const char blank_line[] = { '"', ' ', '\\', 'n', '"', '\n', '\0' };
+static const char hex_digits[] = "0123456789abcdef";
+
+// Read-only view of a kernel loaded with map_kernel(), which is NOT null-terminated
+struct kernel_view {
+    const char *source;
+    size_t size;
+    int is_mapped;
+};
+
+// Macro that a kernel is specialized for, see specialize_kernel()
+struct kernel_parameter {
+    const char *name;
+    const char *value;
+};
+
+// Allocator that a context takes its buffers from, malloc() and free() are used while `allocate` is NULL
+struct kh_allocator {
+    void *(*allocate)(void *user_data, size_t size);
+    void (*release)(void *user_data, void *pointer, size_t size); // May be NULL, such as for arenas
+    void *user_data;
+};
+
+// Bundle of kernels mapped with open_kernel_bundle(), see kernel_bundle.c for its layout
+struct kernel_bundle {
+    struct kernel_view view;
+    size_t entry_count;
+    size_t slot_count;
+    const unsigned char *slots;
+    const unsigned char *entries;
+};
+
+// Counters of the work done with a context, accumulated until reset with kh_reset_stats()
+struct kh_stats {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t lines_processed;
+    uint64_t blank_lines_skipped;
+    uint64_t allocations; // Made through the context's allocator only, not by the caller or other library calls
+    double read_seconds; // Times are only measured while collect_timings is set
+    double scan_seconds; // Finding line boundaries
+    double transform_seconds; // Escaping and formatting, or encoding for the array formats
+    double write_seconds;
+};
+
+// Options, reusable buffers and error state of a series of conversions, used by one thread at a time
+struct kh_context {
+    int verbose;
+    int use_blank_lines;
+    int collect_timings;
+    struct kh_allocator allocator;
+    struct kh_stats stats;
+    char *read_buffer;
+    size_t read_capacity;
+    char *write_buffer;
+    size_t write_capacity;
+    const char *error;
+};
 
 // Functions
 size_t get_length(const char *string, size_t max_length);
@@ -74,7 +168,43 @@ int is_blank_line(const char *string, size_t buffer_size);
 char* process_line(const char* in_string_buffer, size_t in_string_size);
 
 // Interfaces
+void kh_init_context(struct kh_context *context);
+void kh_free_context(struct kh_context *context);
+struct kh_context *kh_create_context(void);
+void kh_destroy_context(struct kh_context *context);
+const char *kh_get_error(const struct kh_context *context);
+const struct kh_stats *kh_get_stats(const struct kh_context *context);
+void kh_reset_stats(struct kh_context *context);
+void kh_add_stats(struct kh_stats *total, const struct kh_stats *stats);
+int kh_process_kernel(struct kh_context *context, FILE *kernel, FILE *kernel_out);
+int kh_process_kernel_bytes(struct kh_context *context, FILE *kernel, FILE *kernel_out, const char *symbol);
+int kh_process_kernel_compressed(struct kh_context *context, FILE *kernel, FILE *kernel_out, const char *symbol);
+int kh_process_kernel_raw(struct kh_context *context, FILE *kernel, FILE *kernel_out);
+const char *kh_load_kernel(struct kh_context *context, FILE *kernel, size_t *kernel_size);
+size_t kh_converted_size(const struct kh_context *context, const char *source, size_t size);
+int kh_convert_buffer(struct kh_context *context, const char *source, size_t size, char *output,
+                      size_t output_capacity, size_t *output_size);
+char *kh_convert_alloc(struct kh_context *context, const char *source, size_t size, size_t *output_size);
 void process_kernel(FILE *kernel, FILE* kernel_out);
+void process_kernel_bytes(FILE *kernel, FILE *kernel_out, const char *symbol);
+void process_kernel_compressed(FILE *kernel, FILE *kernel_out, const char *symbol);
+void process_kernel_raw(FILE *kernel, FILE *kernel_out);
+void process_kernel_incbin(const char *kernel_path, FILE *kernel_out, const char *symbol);
 char* load_kernel(FILE *kernel, size_t kernel_size);
+int map_kernel(FILE *kernel, struct kernel_view *view);
+void release_kernel(struct kernel_view *view);
+uint64_t hash_kernel(const char *source, size_t size);
+size_t minify_kernel(const char *source, size_t size, char *minified);
+size_t specialize_bound(const struct kernel_parameter *parameters, size_t parameter_count, size_t size);
+size_t specialize_kernel(const char *source, size_t size, const struct kernel_parameter *parameters,
+                         size_t parameter_count, char *specialized);
+size_t compress_kernel(const char *source, size_t size, unsigned char *compressed);
+int decompress_kernel(const unsigned char *compressed, size_t compressed_size, char *kernel, size_t kernel_size);
+int write_kernel_bundle(FILE *bundle_out, const char *const *names, const struct kernel_view *kernels,
+                        size_t kernel_count);
+int open_kernel_bundle(FILE *bundle_file, struct kernel_bundle *bundle);
+void close_kernel_bundle(struct kernel_bundle *bundle);
+int find_bundle_kernel(const struct kernel_bundle *bundle, const char *name, struct kernel_view *view);
+int check_kernel_bundle(const struct kernel_bundle *bundle);
 
 #endif //KERNEL_HELPER_KERNEL_HELPER_H
@@ -0,0 +1,45 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_scan.h                                                                                //
+//                                                                                                           //
+// Abstract:    Vectorized scanning routines used by kernel_helper to split lines, detect blank lines        //
+//              and find characters that must be escaped inside a string literal.                            //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       Call the scan functions directly; the fastest instruction set available on the running CPU   //
+//              (AVX2, SSE2 or portable scalar code) is selected the first time one is called.               //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef KERNEL_HELPER_KERNEL_SCAN_H
+#define KERNEL_HELPER_KERNEL_SCAN_H
+
+#include <stddef.h>
+
+// Instruction sets that a scanner can be implemented with
+enum scan_isa {
+    SCAN_ISA_SCALAR,
+    SCAN_ISA_SSE2,
+    SCAN_ISA_AVX2
+};
+
+// Table of scan functions implemented with one instruction set
+struct scanner {
+    enum scan_isa isa;
+    const char *name;
+    size_t (*find_newline)(const char *string, size_t size);
+    size_t (*find_escape)(const char *string, size_t size);
+    int (*is_blank)(const char *string, size_t size);
+};
+
+// Scanner selection
+const struct scanner *get_scanner(enum scan_isa isa);
+const struct scanner *get_active_scanner(void);
+
+// Scanning with the active scanner
+size_t scan_newline(const char *string, size_t size);
+size_t scan_escape(const char *string, size_t size);
+int scan_blank(const char *string, size_t size);
+
+#endif //KERNEL_HELPER_KERNEL_SCAN_H
@@ -0,0 +1,195 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        build_cache.c                                                                                //
+//                                                                                                           //
+// Abstract:    Incremental build cache for the convert_kernel executable. A small manifest stored next to   //
+//              the outputs records the content hash of every converted kernel along with the options it was //
+//              converted with, so unchanged kernels can be skipped without touching their outputs.          //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Format:      One entry per line: "<input hash> <options hash> <output path>", hashes in hexadecimal.      //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "../include/build_cache.h"
+#include "../include/kernel_helper.h"
+
+static int files_are_equal(const char *first_path, const char *second_path);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Load the build cache stored in a directory. A missing or unreadable manifest results in an empty cache.
+ * Params:
+ *      cache: cache that will be filled
+ *      directory: directory holding the manifest, or an empty string for the working directory
+ * Returns:
+ *      TRUE if a manifest was read, FALSE if the cache starts empty
+ */
+int load_build_cache(struct build_cache *cache, const char *directory) {
+    cache->entries = NULL;
+    cache->entry_count = 0;
+    cache->capacity = 0;
+
+    cache->path = malloc(strlen(directory) + 1 + strlen(CACHE_FILE_NAME) + 1);
+    sprintf(cache->path, "%s%s%s", directory, directory[0] != '\0' ? "/" : "", CACHE_FILE_NAME);
+
+    FILE *manifest = fopen(cache->path, "r");
+    if (manifest == NULL) {
+        return FALSE;
+    }
+
+    char line[CACHE_LINE_SIZE];
+    while (fgets(line, CACHE_LINE_SIZE, manifest)) {
+        uint64_t input_hash;
+        uint64_t options_hash;
+        int path_offset;
+
+        if (sscanf(line, "%" SCNx64 " %" SCNx64 " %n", &input_hash, &options_hash, &path_offset) != 2) {
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        size_t index = get_cache_entry(cache, line + path_offset);
+        struct cache_entry *entry = &cache->entries[index];
+        entry->input_hash = input_hash;
+        entry->options_hash = options_hash;
+    }
+
+    fclose(manifest);
+    return TRUE;
+}
+
+/*
+ * Find the entry of an output, adding an empty entry if the output is not in the cache yet.
+ * Entries are referred to by index, since adding entries may move them.
+ * Params:
+ *      cache: cache that will be searched
+ *      output_path: path of the output
+ * Returns:
+ *      index of the entry in `cache->entries`
+ */
+size_t get_cache_entry(struct build_cache *cache, const char *output_path) {
+    for (size_t i = 0; i < cache->entry_count; i++) {
+        if (strcmp(cache->entries[i].output_path, output_path) == STRINGS_ARE_EQUAL) {
+            return i;
+        }
+    }
+
+    if (cache->entry_count == cache->capacity) {
+        cache->capacity = cache->capacity > 0 ? cache->capacity * 2 : 16;
+        cache->entries = realloc(cache->entries, sizeof(struct cache_entry) * cache->capacity);
+    }
+
+    struct cache_entry *entry = &cache->entries[cache->entry_count];
+    entry->output_path = strdup(output_path);
+    entry->input_hash = 0;
+    entry->options_hash = 0;
+    return cache->entry_count++;
+}
+
+/*
+ * Write the cache back to its manifest, replacing the previous manifest atomically.
+ * Params:
+ *      cache: cache that will be saved
+ * Returns:
+ *      TRUE if the manifest was written, FALSE otherwise
+ */
+int save_build_cache(const struct build_cache *cache) {
+    // Temporary files are named after the process, so concurrent runs never write to the same one
+    char *temp_path = malloc(strlen(cache->path) + 32);
+    sprintf(temp_path, "%s.%ld.tmp", cache->path, (long)getpid());
+
+    FILE *manifest = fopen(temp_path, "w");
+    if (manifest == NULL) {
+        free(temp_path);
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < cache->entry_count; i++) {
+        const struct cache_entry *entry = &cache->entries[i];
+        fprintf(manifest, "%016" PRIx64 " %016" PRIx64 " %s\n", entry->input_hash, entry->options_hash, entry->output_path);
+    }
+
+    int written = !ferror(manifest);
+    written &= fclose(manifest) == 0;
+    written = written && rename(temp_path, cache->path) == 0;
+    if (!written) {
+        remove(temp_path);
+    }
+
+    free(temp_path);
+    return written;
+}
+
+/*
+ * Free every entry of a cache.
+ */
+void free_build_cache(struct build_cache *cache) {
+    for (size_t i = 0; i < cache->entry_count; i++) {
+        free(cache->entries[i].output_path);
+    }
+    free(cache->entries);
+    free(cache->path);
+}
+
+/*
+ * Move a freshly written temporary file over an output, unless the output already has the same contents, in
+ * which case the temporary file is removed and the output (and its modification time) is left untouched.
+ * Params:
+ *      temp_path: path of the temporary file holding the new output
+ *      output_path: path of the output
+ * Returns:
+ *      TRUE if the output was replaced, FALSE if it was already up to date, or -1 if it could not be replaced
+ */
+int replace_output(const char *temp_path, const char *output_path) {
+    if (files_are_equal(temp_path, output_path)) {
+        remove(temp_path);
+        return FALSE;
+    }
+
+    if (rename(temp_path, output_path) != 0) {
+        remove(temp_path);
+        return -1;
+    }
+    return TRUE;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Compare the contents of two files.
+ * Returns:
+ *      TRUE if both files exist and hold the same bytes, FALSE otherwise
+ */
+static int files_are_equal(const char *first_path, const char *second_path) {
+    FILE *first = fopen(first_path, "r");
+    FILE *second = fopen(second_path, "r");
+    int are_equal = FALSE;
+
+    if (first != NULL && second != NULL) {
+        struct kernel_view first_view;
+        struct kernel_view second_view;
+
+        if (map_kernel(first, &first_view)) {
+            if (map_kernel(second, &second_view)) {
+                are_equal = first_view.size == second_view.size &&
+                            memcmp(first_view.source, second_view.source, first_view.size) == 0;
+                release_kernel(&second_view);
+            }
+            release_kernel(&first_view);
+        }
+    }
+
+    if (first != NULL) {
+        fclose(first);
+    }
+    if (second != NULL) {
+        fclose(second);
+    }
+    return are_equal;
+}
@@ -11,8 +11,6 @@
 // Usage:       Build the kernel_helper EXECUTABLE to preprocess OpenCL kernels.                             //
 //                                                                                                           //
 // Note:        Kernel *.cl file must be in the same directory/folder as the program executable.             //
-//              Expects a blank line at the end of file, else UNDEFINED BEHAVIOUR WILL OCCUR.                //
-//              The above is a known issue, which should be fixed in a future version.                       //
 //              Use -h or --help to print help message for usage instructions.                               //
 //                                                                                                           //
 // Example:     __kernel void example(                                                                       //
@@ -39,61 +37,242 @@
 ////////////////////////////////////////////////  MAIN  ///////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
-    // Input and Output Files
-    FILE *kernel_in;
-    FILE *kernel_out;
-
     // File addresses
     char *kernel_filename = NULL;
     char *output_filename = NULL;
 
+    // Batch sources
+    char *batch_directory = NULL;
+    char *batch_pattern = NULL;
+    char *batch_manifest = NULL;
+    char *bundle_filename = NULL;
+    int thread_count = 0;
+    int incremental = FALSE;
+
+    // Include search paths
+    const char *search_paths[MAX_SEARCH_PATHS];
+    size_t search_path_count = 0;
+
     /* Loop through command-line arguments, matching them to options and setting the corresponding argument */
-    for (int i = 0; i < argc; i++) {
+    for (int i = 1; i < argc; i++) {
+        // Options that take a value must be followed by one
+        if (takes_value(argv[i]) && i + 1 >= argc) {
+            printf("Fatal Error: Option %s is missing its value!\n", argv[i]);
+            return 1;
+        }
+
         if (strcmp(argv[i], "-h") == STRINGS_ARE_EQUAL || strcmp(argv[i], "--help") == STRINGS_ARE_EQUAL) {
             print_help();
             exit(0); // No need to continue program execution when help message is printed
         }
         if (strcmp(argv[i], "-b") == STRINGS_ARE_EQUAL) {
             use_blank_lines = TRUE;
+            continue;
         }
         if (strcmp(argv[i], "-v") == STRINGS_ARE_EQUAL) {
             verbose = TRUE;
+            continue;
         }
         if (strcmp(argv[i], "-a") == STRINGS_ARE_EQUAL) {
             use_immediate_directory = TRUE;
+            continue;
         }
         if (strcmp(argv[i], "-f") == STRINGS_ARE_EQUAL) {
             kernel_filename = argv[i + 1];
             i++; //We've already processed the next argument, so increment again
+            continue;
         }
         if (strcmp(argv[i], "-o") == STRINGS_ARE_EQUAL) {
             output_filename = argv[i + 1];
             i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-d") == STRINGS_ARE_EQUAL) {
+            batch_directory = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-g") == STRINGS_ARE_EQUAL) {
+            batch_pattern = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-m") == STRINGS_ARE_EQUAL) {
+            batch_manifest = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-p") == STRINGS_ARE_EQUAL) {
+            bundle_filename = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-F") == STRINGS_ARE_EQUAL) {
+            if (!set_output_format(argv[i + 1])) {
+                printf("Fatal Error: Unknown output format!\n");
+                return 1;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == STRINGS_ARE_EQUAL) {
+            symbol_name = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-M") == STRINGS_ARE_EQUAL) {
+            use_minify = TRUE;
+            continue;
+        }
+        if (strcmp(argv[i], "-x") == STRINGS_ARE_EQUAL) {
+            use_inline_includes = TRUE;
+            continue;
+        }
+        if (strcmp(argv[i], "-I") == STRINGS_ARE_EQUAL) {
+            use_inline_includes = TRUE;
+            if (search_path_count < MAX_SEARCH_PATHS) {
+                search_paths[search_path_count++] = argv[i + 1];
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-MD") == STRINGS_ARE_EQUAL) {
+            write_depfiles = TRUE;
+            continue;
+        }
+        if (strcmp(argv[i], "-i") == STRINGS_ARE_EQUAL) {
+            incremental = TRUE;
+            continue;
+        }
+        if (strcmp(argv[i], "-P") == STRINGS_ARE_EQUAL) {
+            if (!add_parameters(argv[i + 1])) {
+                printf("Fatal Error: Invalid parameter matrix!\n");
+                return 1;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "-j") == STRINGS_ARE_EQUAL) {
+            thread_count = atoi(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "--stats", 7) == STRINGS_ARE_EQUAL && !set_stats_mode(argv[i])) {
+            printf("Fatal Error: Unknown stats format!\n");
+            return 1;
         }
     }
+    double start_seconds = get_seconds();
 
-    // Open files
-    char *in_address = get_file_path(kernel_filename != NULL ? kernel_filename : DEFAULT_KERNEL_FILE,
-                                     use_immediate_directory);
-    kernel_in = fopen(in_address, "r");
-    if (kernel_in == NULL) {
-        printf("Fatal Error: Kernel was not found!\n");
+    // The incbin format embeds the kernel file itself, so there is nothing to minify or inline
+    if ((use_minify || use_inline_includes) && output_format == FORMAT_INCBIN) {
+        printf("Fatal Error: Minification and include inlining are not supported by the incbin format!\n");
+        return 1;
+    }
+
+    // Variant tables refer to kernel text, which incbin outputs, compressed outputs and bundles do not expose
+    if (parameter_matrix.parameter_count > 0 &&
+        (output_format == FORMAT_INCBIN || output_format == FORMAT_COMPRESSED || bundle_filename != NULL)) {
+        printf("Fatal Error: Parameter matrices are only supported by the string, raw and bytes formats!\n");
         return 1;
     }
 
+    // Every kernel, and every worker thread, shares one include cache so each header is only read once
+    init_include_cache(&include_cache, search_paths, search_path_count);
+
+    /* Batch mode converts every kernel from a directory, glob pattern or manifest */
+    if (batch_directory != NULL || batch_pattern != NULL || batch_manifest != NULL) {
+        struct batch batch = { 0 };
+        batch.incremental = incremental;
+        int collected = TRUE;
+
+        if (batch_directory != NULL) {
+            collected &= collect_directory(&batch, batch_directory, output_filename);
+        }
+        if (batch_pattern != NULL) {
+            collected &= collect_pattern(&batch, batch_pattern, output_filename);
+        }
+        if (batch_manifest != NULL) {
+            collected &= collect_manifest(&batch, batch_manifest, output_filename);
+        }
+
+        int failures = 1;
+        if (collected && parameter_matrix.parameter_count > 0) {
+            expand_variants(&batch);
+        }
+        if (collected && bundle_filename != NULL) {
+            failures = write_bundle(&batch, get_file_path(bundle_filename, use_immediate_directory));
+        } else if (collected) {
+            failures = run_batch(&batch, thread_count > 0 ? thread_count : get_core_count());
+            failures += write_variant_tables(&batch);
+        }
+        if (collected && stats_mode != STATS_NONE) {
+            print_stats(&batch.stats, batch.job_count, get_seconds() - start_seconds);
+        }
+        free_batch(&batch);
+        free_include_cache(&include_cache);
+        return failures == 0 ? 0 : 1;
+    }
+
+    // Open files and convert a single kernel
+    char *in_address = get_file_path(kernel_filename != NULL ? kernel_filename : DEFAULT_KERNEL_FILE,
+                                     use_immediate_directory);
     char *out_address = get_file_path(output_filename != NULL ? output_filename : DEFAULT_OUTPUT_FILE,
                                       use_immediate_directory);
-    kernel_out = fopen(out_address, "w");
-    if (kernel_out == NULL) {
-        fclose(kernel_in); // kernel_in will be open if we get to here, so just make sure to close it
-        printf("Fatal Error: Output file was not found or created!\n");
-        return 1;
+
+    // Incremental mode goes through the build cache, and a parameter matrix expands into variants, as a batch
+    if (incremental || parameter_matrix.parameter_count > 0) {
+        struct batch batch = { 0 };
+        batch.incremental = incremental;
+        add_job(&batch, strdup(in_address), strdup(out_address), NULL);
+        batch.jobs[0].symbol = symbol_name;
+
+        int failures = 0;
+        if (parameter_matrix.parameter_count > 0) {
+            expand_variants(&batch);
+            failures = run_batch(&batch, thread_count > 0 ? thread_count : get_core_count());
+            failures += write_variant_tables(&batch);
+        } else {
+            failures = run_batch(&batch, 1);
+        }
+        if (stats_mode != STATS_NONE) {
+            print_stats(&batch.stats, batch.job_count, get_seconds() - start_seconds);
+        }
+        free_batch(&batch);
+        free_include_cache(&include_cache);
+        return failures == 0 ? 0 : 1;
     }
 
-    process_kernel(kernel_in, kernel_out);
+    struct kh_context context;
+    init_context(&context);
 
-    fclose(kernel_in);
-    fclose(kernel_out);
+    chunk_thread_count = thread_count > 0 ? thread_count : get_core_count();
+
+    struct batch_job job = { 0 };
+    job.input_path = in_address;
+    job.output_path = out_address;
+    job.symbol = symbol_name;
+    job.variant = NO_VARIANT;
+    const char *error = convert_file(&context, &job, out_address);
+    if (error != NULL) {
+        kh_free_context(&context);
+        free_include_cache(&include_cache);
+        free(job.unresolved_name);
+        printf("Fatal Error: %s\n", error);
+        return 1;
+    }
+    if (use_minify) {
+        print_minify_report(&job);
+    }
+    if (job.unresolved_count > 0) {
+        print_unresolved_report(&job);
+    }
+    if (stats_mode != STATS_NONE) {
+        print_stats(kh_get_stats(&context), 1, get_seconds() - start_seconds);
+    }
+    kh_free_context(&context);
+    free_include_cache(&include_cache);
+    free(job.unresolved_name);
 }
 
 //////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
@@ -112,6 +291,26 @@ static void print_help() {
             "    -f [kernel_file]   Indicate kernel file for the program to process\n"
             "    -o [output_file]   Indicate an output file for the program\n"
             "    -a                 Search executable's immediate directory (instead of looking for data/)\n"
+            "    -F [format]        Output format: string (default), bytes (C byte array header), incbin (assembly),\n"
+            "                       compressed (compressed C byte array header, see decompress_kernel)\n"
+            "                       or raw (the whole kernel as one C++ raw string literal)\n"
+            "    -s [symbol]        Indicate the symbol name for the array and assembly formats (default: kernel name)\n"
+            "    -M                 Minify the kernel (strip comments, whitespace and blank lines) before converting it\n"
+            "    -x                 Inline #include \"...\" directives, searching the including file's directory\n"
+            "    -I [directory]     Also search a directory for included headers (implies -x, may be repeated)\n"
+            "    -MD                Write a Make/Ninja depfile next to each output, named after it with a .d extension\n"
+            "    -i                 Incremental mode: skip kernels that have not changed since the last conversion\n"
+            "    -P [matrix]        Convert one variant per combination of macro parameters, such as\n"
+            "                       \"WG=64,128,256 x T=float,half\", along with a lookup table header (may be repeated)\n"
+            "    --stats[=json]     Report bytes, lines, context allocations and the time spent in each stage once done\n"
+            "  batch options:\n"
+            "    -d [directory]     Convert every *.cl kernel in a directory\n"
+            "    -g [pattern]       Convert every kernel matching a glob pattern, such as \"kernels/*.cl\"\n"
+            "    -m [manifest]      Convert every kernel listed in a manifest, one \"input [output]\" per line\n"
+            "    -o [directory]     Indicate the directory for batch outputs (default: next to each kernel)\n"
+            "    -j [jobs]          Number of kernels converted in parallel, or of threads splitting a single large\n"
+            "                       kernel in the string format (default: number of cores)\n"
+            "    -p [bundle_file]   Pack every kernel into one bundle file instead, looked up by file name at runtime\n"
     };
 
     printf("%s", help);
@@ -132,10 +331,1450 @@ static char *get_file_path(char *file_name, int immediate_directory) {
     }
 
     // Create the buffer and fill it with "../data/file_name"
-    char *file_address = malloc(sizeof(char) * (strlen(file_name) + strlen(IO_DIRECTORY)));
+    char *file_address = malloc(sizeof(char) * (strlen(file_name) + strlen(IO_DIRECTORY) + 1));
 
     strcpy(file_address, IO_DIRECTORY);
     strcat(file_address, file_name);
 
     return file_address;
 }
+
+/*
+ * Initialize a library context with the options given on the command line.
+ * Params:
+ *      context: context that will be initialized, to be freed with kh_free_context()
+ */
+static void init_context(struct kh_context *context) {
+    kh_init_context(context);
+    context->verbose = verbose;
+    context->use_blank_lines = use_blank_lines;
+    context->collect_timings = stats_mode != STATS_NONE;
+}
+
+/*
+ * Convert the kernel of a job into one output file, in the selected output format.
+ * Params:
+ *      context: library context of the calling thread
+ *      job: job whose kernel will be converted
+ *      out_address: path to the output file that will be written
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *convert_file(struct kh_context *context, struct batch_job *job, const char *out_address) {
+    struct prepared_source prepared;
+
+    const char *error = prepare_source(context, job, &prepared);
+    if (error != NULL) {
+        return error;
+    }
+
+    error = write_converted(context, job, &prepared, out_address);
+    if (error == NULL && write_depfiles) {
+        error = write_depfile(job, &prepared);
+    }
+
+    release_source(&prepared);
+    return error;
+}
+
+/*
+ * Load the kernel of a job and run it through the enabled stages: include inlining, then minification.
+ * Params:
+ *      context: library context of the calling thread, whose read and transform times include these stages
+ *      job: job whose kernel will be loaded, where the minified sizes are recorded in minify mode
+ *      prepared: set to the prepared kernel, to be released with release_source()
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *prepare_source(struct kh_context *context, struct batch_job *job,
+                                  struct prepared_source *prepared) {
+    prepared->expanded.source = NULL;
+    prepared->expanded.dependencies = NULL;
+    prepared->expanded.dependency_count = 0;
+    prepared->expanded.unresolved_count = 0;
+    prepared->expanded.unresolved_name = NULL;
+    prepared->specialized = NULL;
+    prepared->minified = NULL;
+
+    FILE *kernel_in = fopen(job->input_path, "r");
+    if (kernel_in == NULL) {
+        return "Kernel was not found!";
+    }
+
+    double start = context->collect_timings ? get_seconds() : 0.0;
+    int loaded = map_kernel(kernel_in, &prepared->view);
+    fclose(kernel_in);
+    if (context->collect_timings) {
+        context->stats.read_seconds += get_seconds() - start;
+        start = get_seconds();
+    }
+    if (!loaded) {
+        return "Kernel could not be read!";
+    }
+    prepared->source = prepared->view.source;
+    prepared->size = prepared->view.size;
+
+    if (use_inline_includes) {
+        const char *error = inline_includes(&include_cache, job->input_path, prepared->source, prepared->size,
+                                            &prepared->expanded);
+        if (error != NULL) {
+            release_kernel(&prepared->view);
+            return error;
+        }
+        prepared->source = prepared->expanded.source;
+        prepared->size = prepared->expanded.size;
+
+        // Jobs are reported once every worker is done, so the name outlives the expanded kernel
+        job->unresolved_count = prepared->expanded.unresolved_count;
+        if (job->unresolved_count > 0 && job->unresolved_name == NULL) {
+            job->unresolved_name = strdup(prepared->expanded.unresolved_name);
+            if (job->unresolved_name == NULL) {
+                release_source(prepared);
+                return "Out of memory!";
+            }
+        }
+    }
+
+    // Specializing after inlining resolves the parameters' #if branches in included headers as well
+    if (job->variant != NO_VARIANT) {
+        struct kernel_parameter parameters[SPECIALIZE_MAX_PARAMETERS];
+        get_variant_parameters(job->variant, parameters);
+        size_t parameter_count = parameter_matrix.parameter_count;
+        prepared->specialized = malloc(specialize_bound(parameters, parameter_count, prepared->size));
+        if (prepared->specialized == NULL) {
+            release_source(prepared);
+            return "Out of memory!";
+        }
+        prepared->size = specialize_kernel(prepared->source, prepared->size, parameters, parameter_count,
+                                           prepared->specialized);
+        prepared->source = prepared->specialized;
+    }
+
+    if (use_minify) {
+        prepared->minified = malloc(prepared->size + 1);
+        if (prepared->minified == NULL) {
+            release_source(prepared);
+            return "Out of memory!";
+        }
+        job->original_size = prepared->size;
+        job->minified_size = minify_kernel(prepared->source, prepared->size, prepared->minified);
+        prepared->source = prepared->minified;
+        prepared->size = job->minified_size;
+    }
+
+    if (context->collect_timings) {
+        context->stats.transform_seconds += get_seconds() - start;
+    }
+    return NULL;
+}
+
+/*
+ * Release a kernel loaded with prepare_source().
+ */
+static void release_source(struct prepared_source *prepared) {
+    release_kernel(&prepared->view);
+    free_expanded_kernel(&prepared->expanded);
+    free(prepared->specialized);
+    free(prepared->minified);
+}
+
+/*
+ * Write a prepared kernel to an output file, in the selected output format.
+ * Params:
+ *      context: library context of the calling thread
+ *      job: job the kernel belongs to, with its symbol name for the array and assembly formats (or NULL to derive it
+ *           from the kernel's file name)
+ *      prepared: kernel that will be converted
+ *      out_address: path to the output file that will be written
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *write_converted(struct kh_context *context, const struct batch_job *job,
+                                   const struct prepared_source *prepared, const char *out_address) {
+    // An empty buffer cannot be opened as a file, so an empty kernel is read from a one byte buffer at its end
+    FILE *kernel_in = fmemopen((void *)(prepared->size > 0 ? prepared->source : "\n"),
+                               prepared->size > 0 ? prepared->size : 1, "r");
+    if (kernel_in == NULL) {
+        return "Kernel could not be read!";
+    }
+    if (prepared->size == 0) {
+        fseek(kernel_in, 0, SEEK_END);
+    }
+
+    FILE *kernel_out = fopen(out_address, "w");
+    if (kernel_out == NULL) {
+        fclose(kernel_in); // kernel_in will be open if we get to here, so just make sure to close it
+        return "Output file was not found or created!";
+    }
+
+    // The #line markers around inlined headers, and the blanked lines of specialized kernels, only keep line numbers
+    // in build logs right if every line is kept
+    int use_blank_lines = context->use_blank_lines;
+    context->use_blank_lines |= prepared->expanded.dependency_count > 0 || job->variant != NO_VARIANT;
+
+    const char *symbol = job->symbol;
+    char *derived_symbol = symbol == NULL ? get_symbol_name(job->input_path) : NULL;
+    char *kernel_path;
+    FILE *raw_in;
+    int converted = TRUE;
+    switch (output_format) {
+        case FORMAT_BYTES:
+            converted = kh_process_kernel_bytes(context, kernel_in, kernel_out,
+                                                symbol != NULL ? symbol : derived_symbol);
+            break;
+        case FORMAT_COMPRESSED:
+            converted = kh_process_kernel_compressed(context, kernel_in, kernel_out,
+                                                     symbol != NULL ? symbol : derived_symbol);
+            break;
+        case FORMAT_RAW:
+            // An untouched kernel is converted from its own file, whose contents can be copied inside the kernel
+            raw_in = prepared->source == prepared->view.source ? fopen(job->input_path, "r") : NULL;
+            converted = kh_process_kernel_raw(context, raw_in != NULL ? raw_in : kernel_in, kernel_out);
+            if (raw_in != NULL) {
+                fclose(raw_in);
+            }
+            break;
+        case FORMAT_INCBIN:
+            // The assembler runs from another directory, so the kernel must be referred to by its absolute path
+            kernel_path = realpath(job->input_path, NULL);
+            process_kernel_incbin(kernel_path != NULL ? kernel_path : job->input_path, kernel_out,
+                                  symbol != NULL ? symbol : derived_symbol);
+            free(kernel_path);
+            break;
+        default:
+            // Large kernels are split at newlines between threads, which gives the same output as a single thread
+            if (chunk_thread_count > 1 && !context->verbose && prepared->size >= CHUNK_MIN_KERNEL_SIZE) {
+                converted = convert_chunked(context, prepared, kernel_out);
+            } else {
+                converted = kh_process_kernel(context, kernel_in, kernel_out);
+            }
+            break;
+    }
+    free(derived_symbol);
+    context->use_blank_lines = use_blank_lines;
+
+    int write_failed = ferror(kernel_out);
+    fclose(kernel_in);
+    if (fclose(kernel_out) != 0 || write_failed) {
+        return "Output file could not be written!";
+    }
+    return converted ? NULL : kh_get_error(context);
+}
+
+/*
+ * Write a Make/Ninja depfile next to the output of a job (named after the output, with a .d extension), listing
+ * the kernel and every header it includes, so the build system knows when to convert the kernel again.
+ * Params:
+ *      job: job whose output the depfile describes
+ *      prepared: kernel that was converted
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *write_depfile(const struct batch_job *job, const struct prepared_source *prepared) {
+    char *depfile_path = malloc(strlen(job->output_path) + strlen(DEPFILE_EXTENSION) + 1);
+    if (depfile_path == NULL) {
+        return "Out of memory!";
+    }
+    sprintf(depfile_path, "%s%s", job->output_path, DEPFILE_EXTENSION);
+
+    FILE *depfile = fopen(depfile_path, "w");
+    free(depfile_path);
+    if (depfile == NULL) {
+        return "Depfile could not be created!";
+    }
+
+    write_depfile_path(depfile, job->output_path);
+    fputc(':', depfile);
+    fputc(' ', depfile);
+    write_depfile_path(depfile, job->input_path);
+    for (size_t i = 0; i < prepared->expanded.dependency_count; i++) {
+        fputs(" \\\n  ", depfile);
+        write_depfile_path(depfile, prepared->expanded.dependencies[i]->path);
+    }
+    fputc('\n', depfile);
+
+    int write_failed = ferror(depfile);
+    if (fclose(depfile) != 0 || write_failed) {
+        return "Depfile could not be written!";
+    }
+    return NULL;
+}
+
+/*
+ * Write a path to a depfile, escaping the characters Make treats specially.
+ */
+static void write_depfile_path(FILE *depfile, const char *path) {
+    for (; *path != '\0'; path++) {
+        if (*path == ' ' || *path == '#') {
+            fputc('\\', depfile);
+        } else if (*path == '$') {
+            fputc('$', depfile);
+        }
+        fputc(*path, depfile);
+    }
+}
+
+/*
+ * Convert a kernel in the string format on chunk_thread_count threads. The kernel is split into chunks of about
+ * CHUNK_SIZE bytes that end after a newline, so every line is formatted whole by one thread, and the output is the
+ * same as kh_process_kernel()'s. Workers only convert up to `window` chunks ahead of the one being written, so the
+ * memory used does not grow with the kernel.
+ * Params:
+ *      context: library context of the calling thread, where the counters of every worker are added
+ *      prepared: kernel that will be converted
+ *      kernel_out: opened and writable file where the chunks are written in order
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+static int convert_chunked(struct kh_context *context, const struct prepared_source *prepared, FILE *kernel_out) {
+    struct chunked_kernel chunked;
+    chunked.chunks = malloc(sizeof(struct chunk) * (prepared->size / CHUNK_SIZE + 1));
+    chunked.chunk_count = 0;
+    chunked.next_chunk = 0;
+    chunked.next_write = 0;
+    chunked.use_blank_lines = context->use_blank_lines;
+    chunked.error = NULL;
+    memset(&chunked.stats, 0, sizeof(chunked.stats));
+
+    // Every chunk but the last is at least CHUNK_SIZE bytes long, and goes on until the end of its last line
+    const char *source = prepared->source;
+    const char *end = prepared->source + prepared->size;
+    while (source < end) {
+        size_t chunk_size = end - source;
+        if (chunk_size > CHUNK_SIZE) {
+            const char *newline = memchr(source + CHUNK_SIZE - 1, '\n', chunk_size - CHUNK_SIZE + 1);
+            chunk_size = newline != NULL ? (size_t)(newline + 1 - source) : chunk_size;
+        }
+
+        struct chunk *chunk = &chunked.chunks[chunked.chunk_count++];
+        chunk->source = source;
+        chunk->size = chunk_size;
+        chunk->output_size = 0;
+        chunk->converted = FALSE;
+        source += chunk_size;
+    }
+
+    int thread_count = (size_t)chunk_thread_count < chunked.chunk_count ? chunk_thread_count : (int)chunked.chunk_count;
+    chunked.window = (size_t)thread_count * CHUNKS_PER_THREAD;
+    chunked.outputs = calloc(chunked.window, sizeof(char *));
+    chunked.output_capacities = calloc(chunked.window, sizeof(size_t));
+    pthread_mutex_init(&chunked.lock, NULL);
+    pthread_cond_init(&chunked.chunk_converted, NULL);
+    pthread_cond_init(&chunked.chunk_written, NULL);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    int started = 0;
+    while (started < thread_count && pthread_create(&threads[started], NULL, chunk_worker, &chunked) == 0) {
+        started++;
+    }
+
+    for (size_t i = 0; i < chunked.chunk_count; i++) {
+        // Without any worker, the calling thread converts every chunk itself
+        if (started == 0) {
+            chunked.chunks[i].converted = TRUE;
+            chunked.error = convert_chunk(context, &chunked, i) ? NULL : context->error;
+        }
+
+        pthread_mutex_lock(&chunked.lock);
+        while (!chunked.chunks[i].converted && chunked.error == NULL) {
+            pthread_cond_wait(&chunked.chunk_converted, &chunked.lock);
+        }
+        int failed = chunked.error != NULL;
+        pthread_mutex_unlock(&chunked.lock);
+        if (failed) {
+            break;
+        }
+
+        double start = context->collect_timings ? get_seconds() : 0.0;
+        size_t output_size = chunked.chunks[i].output_size;
+        size_t written_size = fwrite(chunked.outputs[i % chunked.window], sizeof(char), output_size, kernel_out);
+        if (context->collect_timings) {
+            context->stats.write_seconds += get_seconds() - start;
+        }
+
+        // Writing the chunk frees its buffer for the chunk `window` chunks later
+        pthread_mutex_lock(&chunked.lock);
+        chunked.next_write++;
+        if (written_size != output_size) {
+            chunked.error = "Output file could not be written!";
+        }
+        pthread_cond_broadcast(&chunked.chunk_written);
+        pthread_mutex_unlock(&chunked.lock);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    kh_add_stats(&context->stats, &chunked.stats);
+
+    pthread_cond_destroy(&chunked.chunk_written);
+    pthread_cond_destroy(&chunked.chunk_converted);
+    pthread_mutex_destroy(&chunked.lock);
+    for (size_t i = 0; i < chunked.window; i++) {
+        free(chunked.outputs[i]);
+    }
+    free(chunked.outputs);
+    free(chunked.output_capacities);
+    free(chunked.chunks);
+    free(threads);
+
+    context->error = chunked.error;
+    return chunked.error == NULL;
+}
+
+/*
+ * Convert chunks of a kernel until every chunk is taken, or until the conversion fails. Each worker has its own
+ * library context, so its counters are kept apart from the other workers' until it is done.
+ * Params:
+ *      argument: the chunked kernel being converted
+ */
+static void *chunk_worker(void *argument) {
+    struct chunked_kernel *chunked = argument;
+    struct kh_context context;
+    init_context(&context);
+    context.use_blank_lines = chunked->use_blank_lines;
+
+    pthread_mutex_lock(&chunked->lock);
+    for (;;) {
+        // The buffer of the next chunk is only free once the chunk `window` chunks before it has been written
+        while (chunked->next_chunk < chunked->chunk_count && chunked->error == NULL &&
+               chunked->next_chunk >= chunked->next_write + chunked->window) {
+            pthread_cond_wait(&chunked->chunk_written, &chunked->lock);
+        }
+        if (chunked->next_chunk == chunked->chunk_count || chunked->error != NULL) {
+            break;
+        }
+        size_t index = chunked->next_chunk++;
+        pthread_mutex_unlock(&chunked->lock);
+
+        int converted = convert_chunk(&context, chunked, index);
+
+        pthread_mutex_lock(&chunked->lock);
+        if (!converted && chunked->error == NULL) {
+            chunked->error = context.error;
+        }
+        chunked->chunks[index].converted = TRUE;
+        pthread_cond_broadcast(&chunked->chunk_converted);
+    }
+
+    kh_add_stats(&chunked->stats, kh_get_stats(&context));
+    pthread_mutex_unlock(&chunked->lock);
+    kh_free_context(&context);
+    return NULL;
+}
+
+/*
+ * Convert one chunk of a kernel into the buffer of its place in the window, growing the buffer when needed.
+ * Params:
+ *      context: library context of the calling thread
+ *      chunked: kernel the chunk belongs to
+ *      index: index of the chunk
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+static int convert_chunk(struct kh_context *context, struct chunked_kernel *chunked, size_t index) {
+    struct chunk *chunk = &chunked->chunks[index];
+    char **output = &chunked->outputs[index % chunked->window];
+    size_t *capacity = &chunked->output_capacities[index % chunked->window];
+    struct kh_stats stats = context->stats;
+
+    // Quotes and escapes rarely grow a kernel by more than a quarter, and a chunk that does not fit is converted
+    // again into a buffer of the exact size reported by the first attempt
+    size_t needed_size = chunk->size + chunk->size / 4;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (*capacity < needed_size) {
+            char *grown = realloc(*output, needed_size);
+            if (grown == NULL) {
+                context->error = "Out of memory!";
+                return FALSE;
+            }
+            *output = grown;
+            *capacity = needed_size;
+        }
+
+        if (kh_convert_buffer(context, chunk->source, chunk->size, *output, *capacity, &chunk->output_size)) {
+            return TRUE;
+        }
+        context->stats = stats; // The failed attempt is not counted
+        needed_size = chunk->output_size;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Get the number of processor cores available, which is the default size of the batch worker pool.
+ * Returns:
+ *      number of online cores, at least 1
+ */
+static int get_core_count() {
+    long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return core_count > 0 ? (int)core_count : 1;
+}
+
+/*
+ * Add a job to a batch. The batch takes ownership of both paths.
+ * Params:
+ *      batch: batch the job is added to
+ *      input_path: path to the kernel that will be converted
+ *      output_path: path to the output file, or NULL to derive it from `input_path` and `output_directory`
+ *      output_directory: directory for derived output paths, or NULL to place them next to the kernel
+ */
+static void add_job(struct batch *batch, char *input_path, char *output_path, const char *output_directory) {
+    if (batch->job_count == batch->capacity) {
+        batch->capacity = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        batch->jobs = realloc(batch->jobs, sizeof(struct batch_job) * batch->capacity);
+    }
+
+    if (output_path == NULL) {
+        output_path = get_output_path(input_path, output_directory);
+    }
+
+    struct batch_job *job = &batch->jobs[batch->job_count++];
+    job->input_path = input_path;
+    job->output_path = output_path;
+    job->error = NULL;
+    job->status = JOB_CONVERTED;
+    job->cache_number = 0;
+    job->cache_index = 0;
+    job->symbol = NULL;
+    job->original_size = 0;
+    job->minified_size = 0;
+    job->variant = NO_VARIANT;
+    job->variant_symbol = NULL;
+    job->unresolved_count = 0;
+    job->unresolved_name = NULL;
+}
+
+/*
+ * Derive an output path from a kernel path by replacing its extension with the one of the output format.
+ * Params:
+ *      input_path: path to the kernel
+ *      output_directory: directory the output is placed in, or NULL to place it next to the kernel
+ * Returns:
+ *      a pointer to a newly allocated output path
+ */
+static char *get_output_path(const char *input_path, const char *output_directory) {
+    const char *file_name = strrchr(input_path, '/');
+    file_name = file_name != NULL ? file_name + 1 : input_path;
+
+    const char *directory = output_directory != NULL ? output_directory : input_path;
+    size_t directory_length = output_directory != NULL ? strlen(output_directory) : (size_t)(file_name - input_path);
+
+    const char *extension = strrchr(file_name, '.');
+    size_t name_length = extension != NULL ? (size_t)(extension - file_name) : strlen(file_name);
+
+    const char *output_extension = output_extensions[output_format];
+    char *output_path = malloc(directory_length + 1 + name_length + strlen(output_extension) + 1);
+    memcpy(output_path, directory, directory_length);
+    size_t length = directory_length;
+    if (output_directory != NULL && directory_length > 0 && directory[directory_length - 1] != '/') {
+        output_path[length++] = '/';
+    }
+    memcpy(output_path + length, file_name, name_length);
+    strcpy(output_path + length + name_length, output_extension);
+
+    return output_path;
+}
+
+/*
+ * Check whether a file name has the *.cl kernel extension.
+ */
+static int is_kernel_file(const char *file_name) {
+    size_t length = strlen(file_name);
+    return length > 3 && strcmp(file_name + length - 3, ".cl") == STRINGS_ARE_EQUAL;
+}
+
+/*
+ * Add every *.cl kernel in a directory to a batch.
+ * Params:
+ *      batch: batch the kernels are added to
+ *      directory: directory that will be searched (inside the IO directory unless -a is set)
+ *      output_directory: directory for outputs, or NULL to place them next to each kernel
+ * Returns:
+ *      TRUE if the directory was read, FALSE otherwise
+ */
+static int collect_directory(struct batch *batch, char *directory, const char *output_directory) {
+    char *directory_path = get_file_path(directory, use_immediate_directory);
+    DIR *stream = opendir(directory_path);
+    if (stream == NULL) {
+        printf("Fatal Error: Directory %s was not found!\n", directory_path);
+        return FALSE;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        if (!is_kernel_file(entry->d_name)) {
+            continue;
+        }
+
+        char *input_path = malloc(strlen(directory_path) + 1 + strlen(entry->d_name) + 1);
+        sprintf(input_path, "%s/%s", directory_path, entry->d_name);
+        add_job(batch, input_path, NULL, output_directory);
+    }
+
+    closedir(stream);
+    return TRUE;
+}
+
+/*
+ * Add every file matching a glob pattern to a batch.
+ * Params:
+ *      batch: batch the kernels are added to
+ *      pattern: glob pattern that will be expanded (inside the IO directory unless -a is set)
+ *      output_directory: directory for outputs, or NULL to place them next to each kernel
+ * Returns:
+ *      TRUE if the pattern matched at least one file, FALSE otherwise
+ */
+static int collect_pattern(struct batch *batch, char *pattern, const char *output_directory) {
+    glob_t matches;
+    char *pattern_path = get_file_path(pattern, use_immediate_directory);
+
+    if (glob(pattern_path, 0, NULL, &matches) != 0) {
+        printf("Fatal Error: No kernels match %s!\n", pattern_path);
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        add_job(batch, strdup(matches.gl_pathv[i]), NULL, output_directory);
+    }
+
+    globfree(&matches);
+    return TRUE;
+}
+
+/*
+ * Add every kernel listed in a manifest to a batch. Each non-empty line of the manifest names a kernel,
+ * optionally followed by whitespace and the path of its output. Lines starting with '#' are ignored.
+ * Params:
+ *      batch: batch the kernels are added to
+ *      manifest: path to the manifest (inside the IO directory unless -a is set)
+ *      output_directory: directory for derived outputs, or NULL to place them next to each kernel
+ * Returns:
+ *      TRUE if the manifest was read, FALSE otherwise
+ */
+static int collect_manifest(struct batch *batch, char *manifest, const char *output_directory) {
+    char *manifest_path = get_file_path(manifest, use_immediate_directory);
+    FILE *stream = fopen(manifest_path, "r");
+    if (stream == NULL) {
+        printf("Fatal Error: Manifest %s was not found!\n", manifest_path);
+        if (!use_immediate_directory) {
+            free(manifest_path);
+        }
+        return FALSE;
+    }
+
+    char line[MANIFEST_LINE_SIZE];
+    while (fgets(line, MANIFEST_LINE_SIZE, stream)) {
+        char *input_name = strtok(line, " \t\r\n");
+        if (input_name == NULL || input_name[0] == '#') {
+            continue;
+        }
+        char *output_name = strtok(NULL, " \t\r\n");
+
+        // Names are only copied when get_file_path() returns them as they are, since `line` is reused
+        char *input_path = get_file_path(input_name, use_immediate_directory);
+        char *output_path = output_name != NULL ? get_file_path(output_name, use_immediate_directory) : NULL;
+        if (use_immediate_directory) {
+            input_path = strdup(input_path);
+            output_path = output_path != NULL ? strdup(output_path) : NULL;
+        }
+        add_job(batch, input_path, output_path, output_directory);
+    }
+
+    fclose(stream);
+    if (!use_immediate_directory) {
+        free(manifest_path);
+    }
+    return TRUE;
+}
+
+/*
+ * Batch worker thread, which keeps claiming the next unconverted job until none remain. Each worker has its own
+ * library context, so its buffers are reused across its jobs without being shared with other workers.
+ * Params:
+ *      argument: the batch being converted
+ */
+static void *batch_worker(void *argument) {
+    struct batch *batch = argument;
+    struct kh_context context;
+    init_context(&context);
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        size_t index = batch->next_job++;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (index >= batch->job_count) {
+            pthread_mutex_lock(&batch->lock);
+            kh_add_stats(&batch->stats, kh_get_stats(&context));
+            pthread_mutex_unlock(&batch->lock);
+            kh_free_context(&context);
+            return NULL;
+        }
+
+        struct batch_job *job = &batch->jobs[index];
+        if (batch->incremental) {
+            struct build_cache *cache = &batch->caches[job->cache_number];
+            job->error = convert_file_incremental(&context, job, &cache->entries[job->cache_index]);
+        } else {
+            job->error = convert_file(&context, job, job->output_path);
+        }
+    }
+}
+
+/*
+ * Pack every kernel of a batch into one bundle file, named by their file names, and report the result.
+ * Kernels go through the same include inlining and minification stages as converted kernels.
+ * Params:
+ *      batch: batch whose kernels will be packed
+ *      bundle_path: path to the bundle file that will be written
+ * Returns:
+ *      the number of kernels that failed, or 1 if the bundle could not be written
+ */
+static int write_bundle(struct batch *batch, const char *bundle_path) {
+    struct prepared_source *prepared = malloc(sizeof(struct prepared_source) * (batch->job_count + 1));
+    struct kernel_view *kernels = malloc(sizeof(struct kernel_view) * (batch->job_count + 1));
+    const char **names = malloc(sizeof(char *) * (batch->job_count + 1));
+    size_t prepared_count = 0;
+    int failures = 0;
+    struct kh_context context;
+    init_context(&context);
+
+    for (size_t i = 0; i < batch->job_count; i++) {
+        struct batch_job *job = &batch->jobs[i];
+        job->error = prepare_source(&context, job, &prepared[prepared_count]);
+        if (job->error != NULL) {
+            printf("Error: %s: %s\n", job->input_path, job->error);
+            failures++;
+            continue;
+        }
+
+        kernels[prepared_count].source = prepared[prepared_count].source;
+        kernels[prepared_count].size = prepared[prepared_count].size;
+        kernels[prepared_count].is_mapped = FALSE;
+        names[prepared_count] = get_file_name(job->input_path);
+        context.stats.bytes_read += kernels[prepared_count].size;
+        prepared_count++;
+        if (job->unresolved_count > 0) {
+            print_unresolved_report(job);
+        }
+    }
+
+    if (failures == 0) {
+        double start = context.collect_timings ? get_seconds() : 0.0;
+        FILE *bundle_out = fopen(bundle_path, "wb");
+        int written = bundle_out != NULL && write_kernel_bundle(bundle_out, names, kernels, prepared_count);
+        if (written) {
+            long bundle_size = ftell(bundle_out);
+            context.stats.bytes_written += bundle_size > 0 ? (uint64_t)bundle_size : 0;
+        }
+        if (bundle_out != NULL && fclose(bundle_out) != 0) {
+            written = FALSE;
+        }
+        if (context.collect_timings) {
+            context.stats.write_seconds += get_seconds() - start;
+        }
+
+        if (written) {
+            printf("Bundled %zu kernels into %s\n", prepared_count, bundle_path);
+        } else {
+            printf("Error: Bundle %s could not be written, or two kernels share a file name!\n", bundle_path);
+            remove(bundle_path);
+            failures = 1;
+        }
+    }
+
+    for (size_t i = 0; i < prepared_count; i++) {
+        release_source(&prepared[i]);
+    }
+    kh_add_stats(&batch->stats, kh_get_stats(&context));
+    kh_free_context(&context);
+    free(prepared);
+    free(kernels);
+    free(names);
+    return failures;
+}
+
+/*
+ * Get the file name of a path, without its directories.
+ */
+static const char *get_file_name(const char *path) {
+    const char *file_name = strrchr(path, '/');
+    return file_name != NULL ? file_name + 1 : path;
+}
+
+/*
+ * Convert every job of a batch on a pool of worker threads, then report the result of each job.
+ * Params:
+ *      batch: batch that will be converted
+ *      thread_count: number of worker threads
+ * Returns:
+ *      the number of jobs that failed
+ */
+static int run_batch(struct batch *batch, int thread_count) {
+    if ((size_t)thread_count > batch->job_count) {
+        thread_count = batch->job_count > 0 ? (int)batch->job_count : 1;
+    }
+
+    // Every cache entry is looked up before the workers start, so each worker only touches its own entry
+    if (batch->incremental) {
+        for (size_t i = 0; i < batch->job_count; i++) {
+            struct batch_job *job = &batch->jobs[i];
+            job->cache_number = get_build_cache(batch, job->output_path);
+            job->cache_index = get_cache_entry(&batch->caches[job->cache_number], job->output_path);
+        }
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->next_job = 0;
+
+    // The calling thread works as well, so one fewer thread is started
+    int started = 0;
+    while (started < thread_count - 1 && pthread_create(&threads[started], NULL, batch_worker, batch) == 0) {
+        started++;
+    }
+    batch_worker(batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&batch->lock);
+    free(threads);
+
+    if (batch->incremental) {
+        for (size_t i = 0; i < batch->cache_count; i++) {
+            if (!save_build_cache(&batch->caches[i])) {
+                printf("Error: Build cache %s could not be written!\n", batch->caches[i].path);
+            }
+            free_build_cache(&batch->caches[i]);
+        }
+        free(batch->caches);
+        batch->caches = NULL;
+        batch->cache_count = 0;
+    }
+
+    // Report results in job order so the output is deterministic
+    int failures = 0;
+    int skipped = 0;
+    for (size_t i = 0; i < batch->job_count; i++) {
+        struct batch_job *job = &batch->jobs[i];
+        if (job->error != NULL) {
+            printf("Error: %s: %s\n", job->input_path, job->error);
+            failures++;
+        } else if (job->status != JOB_CONVERTED) {
+            printf("Up to date %s -> %s\n", job->input_path, job->output_path);
+            skipped++;
+        } else {
+            printf("Converted %s -> %s\n", job->input_path, job->output_path);
+        }
+        if (job->error == NULL && job->status != JOB_SKIPPED && use_minify) {
+            print_minify_report(job);
+        }
+        if (job->error == NULL && job->unresolved_count > 0) {
+            print_unresolved_report(job);
+        }
+    }
+    printf("%zu kernels converted, %d up to date, %d failed\n", batch->job_count - failures - skipped, skipped, failures);
+
+    return failures;
+}
+
+/*
+ * Free every job of a batch.
+ */
+static void free_batch(struct batch *batch) {
+    for (size_t i = 0; i < batch->job_count; i++) {
+        free(batch->jobs[i].input_path);
+        free(batch->jobs[i].output_path);
+        free(batch->jobs[i].variant_symbol);
+        free(batch->jobs[i].unresolved_name);
+    }
+    free(batch->jobs);
+    for (size_t i = 0; i < batch->table_count; i++) {
+        free(batch->tables[i].path);
+        free(batch->tables[i].symbol);
+    }
+    free(batch->tables);
+}
+
+/*
+ * Add the parameters of a matrix, such as "WG=64,128,256 x T=float,half". Parameters are separated by whitespace
+ * and an optional 'x', and their values by commas.
+ * Params:
+ *      matrix: the parameters, as given to -P
+ * Returns:
+ *      TRUE if every parameter was added, FALSE if the matrix is malformed or too large
+ */
+static int add_parameters(const char *matrix) {
+    if (matrix == NULL) {
+        return FALSE;
+    }
+
+    char *parameters = strdup(matrix); // Kept until exit, as the matrix points into it
+    char *save_parameter;
+    for (char *parameter = strtok_r(parameters, " \t", &save_parameter); parameter != NULL;
+         parameter = strtok_r(NULL, " \t", &save_parameter)) {
+        if (strcmp(parameter, "x") == STRINGS_ARE_EQUAL) {
+            continue;
+        }
+
+        char *values = strchr(parameter, '=');
+        size_t index = parameter_matrix.parameter_count;
+        if (values == NULL || index == SPECIALIZE_MAX_PARAMETERS) {
+            return FALSE;
+        }
+        *values++ = '\0';
+
+        // Names must be identifiers, and each one may only be given once
+        if (parameter[0] == '\0' || isdigit((unsigned char)parameter[0])) {
+            return FALSE;
+        }
+        for (const char *character = parameter; *character != '\0'; character++) {
+            if (!isalnum((unsigned char)*character) && *character != '_') {
+                return FALSE;
+            }
+        }
+        for (size_t i = 0; i < index; i++) {
+            if (strcmp(parameter_matrix.names[i], parameter) == STRINGS_ARE_EQUAL) {
+                return FALSE;
+            }
+        }
+
+        size_t value_count = 0;
+        char *save_value;
+        for (char *value = strtok_r(values, ",", &save_value); value != NULL;
+             value = strtok_r(NULL, ",", &save_value)) {
+            if (value_count == MAX_PARAMETER_VALUES) {
+                return FALSE;
+            }
+            parameter_matrix.values[index][value_count++] = value;
+        }
+        if (value_count == 0) {
+            return FALSE;
+        }
+
+        parameter_matrix.names[index] = parameter;
+        parameter_matrix.value_counts[index] = value_count;
+        parameter_matrix.parameter_count++;
+        parameter_matrix.variant_count = (index == 0 ? 1 : parameter_matrix.variant_count) * value_count;
+    }
+
+    return parameter_matrix.parameter_count > 0;
+}
+
+/*
+ * Get the parameter values of a variant.
+ * Params:
+ *      variant: index of the variant, below the matrix's variant_count
+ *      parameters: set to one name and value per parameter of the matrix
+ */
+static void get_variant_parameters(size_t variant, struct kernel_parameter *parameters) {
+    for (size_t i = parameter_matrix.parameter_count; i-- > 0;) {
+        parameters[i].name = parameter_matrix.names[i];
+        parameters[i].value = parameter_matrix.values[i][variant % parameter_matrix.value_counts[i]];
+        variant /= parameter_matrix.value_counts[i];
+    }
+}
+
+/*
+ * Get the suffix that names the outputs and symbols of a variant, such as "_WG_64_T_float", where every character
+ * that is not valid in an identifier is replaced with '_'.
+ * Returns:
+ *      a pointer to a newly allocated suffix
+ */
+static char *get_variant_suffix(size_t variant) {
+    struct kernel_parameter parameters[SPECIALIZE_MAX_PARAMETERS];
+    get_variant_parameters(variant, parameters);
+
+    size_t suffix_size = 1;
+    for (size_t i = 0; i < parameter_matrix.parameter_count; i++) {
+        suffix_size += strlen(parameters[i].name) + strlen(parameters[i].value) + 2;
+    }
+
+    char *suffix = malloc(suffix_size);
+    size_t length = 0;
+    for (size_t i = 0; i < parameter_matrix.parameter_count; i++) {
+        length += sprintf(suffix + length, "_%s_%s", parameters[i].name, parameters[i].value);
+    }
+    for (size_t i = 0; i < length; i++) {
+        suffix[i] = isalnum((unsigned char)suffix[i]) ? suffix[i] : '_';
+    }
+
+    return suffix;
+}
+
+/*
+ * Insert a suffix into the file name of a path, before its extension.
+ * Params:
+ *      path: the path
+ *      suffix: text inserted after the file name
+ *      extension: extension that replaces the path's own, or NULL to keep it
+ * Returns:
+ *      a pointer to a newly allocated path
+ */
+static char *insert_suffix(const char *path, const char *suffix, const char *extension) {
+    const char *file_name = get_file_name(path);
+    const char *path_extension = strrchr(file_name, '.');
+    size_t name_length = path_extension != NULL && path_extension != file_name ? (size_t)(path_extension - path)
+                                                                                : strlen(path);
+    if (extension == NULL) {
+        extension = path + name_length;
+    }
+
+    char *suffixed_path = malloc(name_length + strlen(suffix) + strlen(extension) + 1);
+    memcpy(suffixed_path, path, name_length);
+    strcpy(suffixed_path + name_length, suffix);
+    strcat(suffixed_path, extension);
+    return suffixed_path;
+}
+
+/*
+ * Replace every job of a batch with one job per variant of the parameter matrix, and add a lookup table for each
+ * kernel. Variant outputs and symbols are named after the kernel's, followed by the variant's suffix.
+ * Params:
+ *      batch: batch whose jobs are expanded
+ */
+static void expand_variants(struct batch *batch) {
+    size_t variant_count = parameter_matrix.variant_count;
+    struct batch_job *jobs = batch->jobs;
+    size_t job_count = batch->job_count;
+
+    batch->jobs = NULL;
+    batch->job_count = 0;
+    batch->capacity = 0;
+    batch->tables = malloc(sizeof(struct variant_table) * (job_count + 1));
+    batch->table_count = 0;
+
+    for (size_t i = 0; i < job_count; i++) {
+        char *symbol = jobs[i].symbol != NULL ? strdup(jobs[i].symbol) : get_symbol_name(jobs[i].input_path);
+
+        struct variant_table *table = &batch->tables[batch->table_count++];
+        table->path = insert_suffix(jobs[i].output_path, VARIANT_TABLE_SUFFIX, ".h");
+        table->symbol = symbol;
+        table->first_job = batch->job_count;
+
+        for (size_t variant = 0; variant < variant_count; variant++) {
+            char *suffix = get_variant_suffix(variant);
+            add_job(batch, strdup(jobs[i].input_path), insert_suffix(jobs[i].output_path, suffix, NULL), NULL);
+
+            struct batch_job *job = &batch->jobs[batch->job_count - 1];
+            job->variant = variant;
+            job->variant_symbol = malloc(strlen(symbol) + strlen(suffix) + 1);
+            sprintf(job->variant_symbol, "%s%s", symbol, suffix);
+            job->symbol = job->variant_symbol;
+            free(suffix);
+        }
+
+        free(jobs[i].input_path);
+        free(jobs[i].output_path);
+    }
+    free(jobs);
+}
+
+/*
+ * Write the lookup table of every kernel whose variants were all converted, and report the result.
+ * Params:
+ *      batch: batch whose variants were converted
+ * Returns:
+ *      the number of tables that could not be written
+ */
+static int write_variant_tables(const struct batch *batch) {
+    int failures = 0;
+
+    for (size_t i = 0; i < batch->table_count; i++) {
+        const struct variant_table *table = &batch->tables[i];
+        int converted = TRUE;
+        for (size_t j = 0; j < parameter_matrix.variant_count; j++) {
+            converted &= batch->jobs[table->first_job + j].error == NULL;
+        }
+        if (!converted) {
+            continue;
+        }
+
+        const char *error = write_variant_table(batch, table);
+        if (error != NULL) {
+            printf("Error: %s: %s\n", table->path, error);
+            failures++;
+        } else {
+            printf("Wrote %zu variants into %s\n", parameter_matrix.variant_count, table->path);
+        }
+    }
+
+    return failures;
+}
+
+/*
+ * Write the lookup table header of a kernel's variants, which embeds every variant and finds one by its parameter
+ * values. The table is written through a temporary file, so it is only replaced when it changes.
+ * Params:
+ *      batch: batch holding the kernel's variant jobs
+ *      table: table that will be written
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *write_variant_table(const struct batch *batch, const struct variant_table *table) {
+    char *temp_path = malloc(strlen(table->path) + 32);
+    sprintf(temp_path, "%s.%ld.tmp", table->path, (long)getpid());
+    FILE *table_out = fopen(temp_path, "w");
+    if (table_out == NULL) {
+        free(temp_path);
+        return "Variant table could not be created!";
+    }
+
+    const char *symbol = table->symbol;
+    fprintf(table_out, "// Generated by kernel_helper, do not edit\n"
+                       "#include <stddef.h>\n"
+                       "#include <string.h>\n\n");
+
+    // The array formats define their own symbols, while literals are wrapped into one here
+    for (size_t i = 0; i < parameter_matrix.variant_count; i++) {
+        const struct batch_job *job = &batch->jobs[table->first_job + i];
+        if (output_format == FORMAT_BYTES) {
+            fprintf(table_out, "#include \"%s\"\n", get_file_name(job->output_path));
+        } else {
+            fprintf(table_out, "static const char %s[] = \"\"\n#include \"%s\"\n;\n", job->symbol,
+                    get_file_name(job->output_path));
+        }
+    }
+
+    fprintf(table_out, "\n#ifndef KERNEL_HELPER_KERNEL_VARIANT\n"
+                       "#define KERNEL_HELPER_KERNEL_VARIANT\n"
+                       "// Kernel specialized for one combination of parameter values\n"
+                       "struct kernel_variant {\n"
+                       "    const char *const *values; // In the order of the table's parameter names\n"
+                       "    const char *source;\n"
+                       "    size_t size;\n"
+                       "};\n"
+                       "#endif\n\n");
+
+    fprintf(table_out, "static const char *const %s_parameter_names[] = {", symbol);
+    for (size_t i = 0; i < parameter_matrix.parameter_count; i++) {
+        fprintf(table_out, "%s \"%s\"", i > 0 ? "," : "", parameter_matrix.names[i]);
+    }
+    fprintf(table_out, " };\n"
+                       "static const size_t %s_parameter_count = %zu;\n", symbol, parameter_matrix.parameter_count);
+
+    for (size_t i = 0; i < parameter_matrix.variant_count; i++) {
+        struct kernel_parameter parameters[SPECIALIZE_MAX_PARAMETERS];
+        get_variant_parameters(i, parameters);
+        fprintf(table_out, "static const char *const %s_values[] = {", batch->jobs[table->first_job + i].symbol);
+        for (size_t j = 0; j < parameter_matrix.parameter_count; j++) {
+            fprintf(table_out, "%s \"%s\"", j > 0 ? "," : "", parameters[j].value);
+        }
+        fprintf(table_out, " };\n");
+    }
+
+    fprintf(table_out, "\nstatic const struct kernel_variant %s_variants[] = {\n", symbol);
+    for (size_t i = 0; i < parameter_matrix.variant_count; i++) {
+        const char *variant_symbol = batch->jobs[table->first_job + i].symbol;
+        if (output_format == FORMAT_BYTES) {
+            fprintf(table_out, "    { %s_values, (const char *)%s, %s_size },\n", variant_symbol, variant_symbol,
+                    variant_symbol);
+        } else {
+            fprintf(table_out, "    { %s_values, %s, sizeof(%s) - 1 },\n", variant_symbol, variant_symbol,
+                    variant_symbol);
+        }
+    }
+    fprintf(table_out, "};\n"
+                       "static const size_t %s_variant_count = %zu;\n\n", symbol, parameter_matrix.variant_count);
+
+    fprintf(table_out, "// Find the variant specialized for a set of values, given in the order of %s_parameter_names\n"
+                       "static inline const struct kernel_variant *find_%s_variant(const char *const *values) {\n"
+                       "    for (size_t i = 0; i < %s_variant_count; i++) {\n"
+                       "        size_t j = 0;\n"
+                       "        while (j < %s_parameter_count && strcmp(%s_variants[i].values[j], values[j]) == 0) {\n"
+                       "            j++;\n"
+                       "        }\n"
+                       "        if (j == %s_parameter_count) {\n"
+                       "            return &%s_variants[i];\n"
+                       "        }\n"
+                       "    }\n"
+                       "    return NULL;\n"
+                       "}\n", symbol, symbol, symbol, symbol, symbol, symbol, symbol);
+
+    int write_failed = ferror(table_out);
+    if (fclose(table_out) != 0 || write_failed || replace_output(temp_path, table->path) < 0) {
+        remove(temp_path);
+        free(temp_path);
+        return "Variant table could not be written!";
+    }
+    free(temp_path);
+    return NULL;
+}
+
+/*
+ * Convert one kernel of an incremental batch. The kernel is skipped when its contents and the conversion options
+ * match its cache entry, and its output is only replaced when the converted bytes differ from the existing output.
+ * Params:
+ *      context: library context of the calling thread
+ *      job: job that will be converted, whose status is set to the outcome
+ *      entry: cache entry of the job's output, which is updated after a successful conversion
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+static const char *convert_file_incremental(struct kh_context *context, struct batch_job *job,
+                                           struct cache_entry *entry) {
+    struct prepared_source prepared;
+
+    // The prepared kernel is hashed, so a change to any included header is detected as well
+    const char *error = prepare_source(context, job, &prepared);
+    if (error != NULL) {
+        return error;
+    }
+    uint64_t input_hash = hash_kernel(prepared.source, prepared.size);
+    uint64_t options_hash = get_options_hash(job);
+
+    if (entry->input_hash == input_hash && entry->options_hash == options_hash && access(job->output_path, F_OK) == 0) {
+        job->status = JOB_SKIPPED;
+        release_source(&prepared);
+        return NULL;
+    }
+
+    // Convert into a temporary file beside the output, so the output is replaced atomically
+    char *temp_path = malloc(strlen(job->output_path) + 32);
+    if (temp_path == NULL) {
+        release_source(&prepared);
+        return "Out of memory!";
+    }
+    sprintf(temp_path, "%s.%ld.tmp", job->output_path, (long)getpid());
+
+    error = write_converted(context, job, &prepared, temp_path);
+    if (error == NULL) {
+        int replaced = replace_output(temp_path, job->output_path);
+        if (replaced < 0) {
+            error = "Output file could not be replaced!";
+        } else {
+            job->status = replaced ? JOB_CONVERTED : JOB_UNCHANGED;
+            entry->input_hash = input_hash;
+            entry->options_hash = options_hash;
+        }
+    } else {
+        remove(temp_path);
+    }
+    if (error == NULL && write_depfiles) {
+        error = write_depfile(job, &prepared);
+    }
+
+    release_source(&prepared);
+    free(temp_path);
+    return error;
+}
+
+/*
+ * Hash every option that affects the converted output of a job, so outputs are reconverted when the options
+ * change. The kernel's path is included, as it is embedded in incbin outputs and names derived symbols.
+ * Params:
+ *      job: job whose options will be hashed
+ * Returns:
+ *      64-bit hash of the conversion options
+ */
+static uint64_t get_options_hash(const struct batch_job *job) {
+    char options[CACHE_LINE_SIZE];
+    int length = snprintf(options, sizeof(options), "version=%d;blank_lines=%d;minify=%d;inline=%d;depfile=%d;format=%d;symbol=%s;input=%s",
+                          CACHE_FORMAT_VERSION, use_blank_lines, use_minify, use_inline_includes, write_depfiles, (int)output_format,
+                          job->symbol != NULL ? job->symbol : "", job->input_path);
+
+    uint64_t options_hash = hash_kernel(options, length < (int)sizeof(options) ? (size_t)length : sizeof(options) - 1);
+
+    // Variant symbols replace the characters of values that are not valid in identifiers, so values are hashed too
+    if (job->variant != NO_VARIANT) {
+        struct kernel_parameter parameters[SPECIALIZE_MAX_PARAMETERS];
+        get_variant_parameters(job->variant, parameters);
+        for (size_t i = 0; i < parameter_matrix.parameter_count; i++) {
+            options_hash = options_hash * 31 + hash_kernel(parameters[i].value, strlen(parameters[i].value) + 1);
+        }
+    }
+    return options_hash;
+}
+
+/*
+ * Find the build cache of the directory an output is written to, loading it the first time the directory is seen.
+ * Each output directory keeps its own manifest, so an output's entry does not depend on the other kernels of the
+ * batch, or on their order.
+ * Params:
+ *      batch: batch holding the build caches
+ *      output_path: path of the output
+ * Returns:
+ *      index of the build cache in `batch->caches`
+ */
+static size_t get_build_cache(struct batch *batch, const char *output_path) {
+    char *directory = get_directory(output_path);
+    char *manifest_path = malloc(strlen(directory) + 1 + strlen(CACHE_FILE_NAME) + 1);
+    sprintf(manifest_path, "%s%s%s", directory, directory[0] != '\0' ? "/" : "", CACHE_FILE_NAME);
+
+    size_t index = 0;
+    while (index < batch->cache_count && strcmp(batch->caches[index].path, manifest_path) != STRINGS_ARE_EQUAL) {
+        index++;
+    }
+    if (index == batch->cache_count) {
+        batch->caches = realloc(batch->caches, sizeof(struct build_cache) * (batch->cache_count + 1));
+        load_build_cache(&batch->caches[batch->cache_count++], directory);
+    }
+
+    free(manifest_path);
+    free(directory);
+    return index;
+}
+
+/*
+ * Get the directory part of a path.
+ * Returns:
+ *      a pointer to a newly allocated directory path, which is empty for the working directory
+ */
+static char *get_directory(const char *path) {
+    const char *separator = strrchr(path, '/');
+    size_t length = separator != NULL ? (size_t)(separator - path) : 0;
+
+    char *directory = malloc(length + 1);
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    return directory;
+}
+
+/*
+ * Select the output format from its name.
+ * Params:
+ *      format_name: name of the format, as given to -F
+ * Returns:
+ *      TRUE if the format is known, FALSE otherwise
+ */
+static int set_output_format(const char *format_name) {
+    for (int i = 0; i < FORMAT_COUNT; i++) {
+        if (format_name != NULL && strcmp(format_name, output_format_names[i]) == STRINGS_ARE_EQUAL) {
+            output_format = (enum output_format)i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Check whether a command-line option is followed by a value.
+ * Params:
+ *      option: the option, as given on the command line
+ * Returns:
+ *      TRUE if the option takes a value, FALSE otherwise
+ */
+static int takes_value(const char *option) {
+    for (size_t i = 0; i < sizeof(value_options) / sizeof(value_options[0]); i++) {
+        if (strcmp(option, value_options[i]) == STRINGS_ARE_EQUAL) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Select the stats report from a --stats option.
+ * Params:
+ *      option: the option, either --stats or --stats=[text|json]
+ * Returns:
+ *      TRUE if the report was selected, FALSE if its format is unknown
+ */
+static int set_stats_mode(const char *option) {
+    if (strcmp(option, "--stats") == STRINGS_ARE_EQUAL || strcmp(option, "--stats=text") == STRINGS_ARE_EQUAL) {
+        stats_mode = STATS_TEXT;
+        return TRUE;
+    }
+    if (strcmp(option, "--stats=json") == STRINGS_ARE_EQUAL) {
+        stats_mode = STATS_JSON;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Get the time of a monotonic clock, to measure durations.
+ * Returns:
+ *      the current time in seconds
+ */
+static double get_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/*
+ * Print the counters of a run, in the format selected with --stats. Stage times of parallel workers are added
+ * together, so in batch mode they may exceed the total time. Allocations are only those made through the library
+ * contexts' allocators, not the CLI's own buffers.
+ * Params:
+ *      stats: counters of every context used by the run
+ *      kernel_count: number of kernels in the run
+ *      total_seconds: time since the options were parsed
+ */
+static void print_stats(const struct kh_stats *stats, size_t kernel_count, double total_seconds) {
+    if (stats_mode == STATS_JSON) {
+        printf("{\"kernels\": %zu, \"bytes_read\": %llu, \"bytes_written\": %llu, \"lines_processed\": %llu, "
+               "\"blank_lines_skipped\": %llu, \"context_allocations\": %llu, \"read_seconds\": %.6f, "
+               "\"scan_seconds\": %.6f, \"transform_seconds\": %.6f, \"write_seconds\": %.6f, "
+               "\"total_seconds\": %.6f}\n",
+               kernel_count, (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+               (unsigned long long)stats->lines_processed, (unsigned long long)stats->blank_lines_skipped,
+               (unsigned long long)stats->allocations, stats->read_seconds, stats->scan_seconds,
+               stats->transform_seconds, stats->write_seconds, total_seconds);
+        return;
+    }
+
+    printf("Stats: %zu kernels, %llu bytes read, %llu bytes written, %llu lines (%llu blank lines skipped), "
+           "%llu context allocator allocations\n",
+           kernel_count, (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+           (unsigned long long)stats->lines_processed, (unsigned long long)stats->blank_lines_skipped,
+           (unsigned long long)stats->allocations);
+    printf("Times: read %.6f s, scan %.6f s, transform %.6f s, write %.6f s, total %.6f s\n",
+           stats->read_seconds, stats->scan_seconds, stats->transform_seconds, stats->write_seconds, total_seconds);
+}
+
+/*
+ * Derive a C identifier from a kernel's file name, dropping its directory and extension and replacing every
+ * character that is not valid in an identifier with '_'.
+ * Params:
+ *      path: path to the kernel
+ * Returns:
+ *      a pointer to a newly allocated symbol name
+ */
+static char *get_symbol_name(const char *path) {
+    const char *file_name = get_file_name(path);
+
+    const char *extension = strrchr(file_name, '.');
+    size_t name_length = extension != NULL && extension != file_name ? (size_t)(extension - file_name) : strlen(file_name);
+
+    // One extra character for a leading '_' in front of names that start with a digit
+    char *symbol = malloc(name_length + 2);
+    size_t length = 0;
+    if (name_length == 0 || isdigit((unsigned char)file_name[0])) {
+        symbol[length++] = '_';
+    }
+    for (size_t i = 0; i < name_length; i++) {
+        symbol[length++] = isalnum((unsigned char)file_name[i]) ? file_name[i] : '_';
+    }
+    symbol[length] = '\0';
+
+    return symbol;
+}
+
+/*
+ * Print the size of a kernel before and after minification.
+ */
+static void print_minify_report(const struct batch_job *job) {
+    double saved = job->original_size > 0 ? 100.0 * (double)(job->original_size - job->minified_size) / (double)job->original_size : 0.0;
+    printf("Minified %s: %zu -> %zu bytes (%.1f%% smaller)\n", job->input_path, job->original_size, job->minified_size, saved);
+}
+
+/*
+ * Print the included headers of a kernel that were not found, whose #include directives were kept.
+ */
+static void print_unresolved_report(const struct batch_job *job) {
+    if (job->unresolved_count > 1) {
+        printf("Warning: %s: header \"%s\" and %zu others were not found, and are left to the OpenCL compiler\n",
+               job->input_path, job->unresolved_name, job->unresolved_count - 1);
+    } else {
+        printf("Warning: %s: header \"%s\" was not found, and is left to the OpenCL compiler\n", job->input_path,
+               job->unresolved_name);
+    }
+}
@@ -0,0 +1,611 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        include_cache.c                                                                              //
+//                                                                                                           //
+// Abstract:    Include inlining for the convert_kernel executable. #include "..." directives are resolved   //
+//              against the including file's directory and a list of search paths, and replaced by the       //
+//              contents of the header, so the OpenCL runtime never has to resolve them itself.              //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Note:        Directives are recognized line by line. Includes inside block comments and #if 0 blocks are  //
+//              left as they are, as are headers that cannot be found, which are counted as unresolved.      //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <ctype.h>
+
+#include "../include/include_cache.h"
+#include "../include/kernel_scan.h"
+
+// Header being inlined, and how far it has been copied
+struct include_frame {
+    const char *source;
+    size_t size;
+    size_t position;
+    char *directory;
+    const char *name; // Name given to #line markers, as written in the #include (or the kernel's path)
+    size_t name_size;
+    size_t line; // Number of lines copied so far
+    int in_comment; // TRUE if the next line starts inside a block comment
+    int skip_nesting; // Depth of #if blocks inside an #if 0 block, or 0 outside of one
+};
+
+static const struct cached_header *find_header(struct include_cache *cache, const char *directory,
+                                               const char *name, size_t name_size);
+static struct cached_header *load_header(struct include_cache *cache, const char *candidate_path);
+static const char *match_directive(const char *line, size_t line_size, const char *directive, size_t *rest_size);
+static int parse_include(const char *line, size_t line_size, const char **name, size_t *name_size);
+static int is_include_once(const char *source, size_t size);
+static int update_skip_nesting(const char *line, size_t line_size, int skip_nesting);
+static int scan_comment(const char *line, size_t line_size, int in_comment);
+static void append_line_marker(struct expanded_kernel *expanded, size_t line, const char *name, size_t name_size);
+static void append_source(struct expanded_kernel *expanded, const char *data, size_t data_size);
+static int add_dependency(struct expanded_kernel *expanded, const struct cached_header *header);
+static char *get_parent_directory(const char *path);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Create an empty include cache.
+ * Params:
+ *      cache: cache that will be initialized
+ *      search_paths: directories searched for headers, after the including file's directory
+ *      search_path_count: number of search paths
+ */
+void init_include_cache(struct include_cache *cache, const char **search_paths, size_t search_path_count) {
+    cache->search_paths = search_paths;
+    cache->search_path_count = search_path_count;
+    cache->headers = NULL;
+    cache->header_count = 0;
+    cache->header_capacity = 0;
+    cache->lookups = NULL;
+    cache->lookup_count = 0;
+    cache->lookup_capacity = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/*
+ * Free every header and lookup of an include cache.
+ */
+void free_include_cache(struct include_cache *cache) {
+    for (size_t i = 0; i < cache->header_count; i++) {
+        release_kernel(&cache->headers[i]->view);
+        free(cache->headers[i]->path);
+        free(cache->headers[i]);
+    }
+    for (size_t i = 0; i < cache->lookup_count; i++) {
+        free(cache->lookups[i].candidate_path);
+    }
+
+    free(cache->headers);
+    free(cache->lookups);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * Inline every #include "..." of a kernel, recursively. Safe to call from several threads sharing one cache.
+ * Params:
+ *      cache: cache the headers are read through
+ *      kernel_path: path to the kernel, whose directory is searched first
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      expanded: set to the expanded kernel and its dependencies, to be freed with free_expanded_kernel()
+ * Returns:
+ *      NULL on success, or a message describing the error
+ */
+const char *inline_includes(struct include_cache *cache, const char *kernel_path, const char *source, size_t size,
+                            struct expanded_kernel *expanded) {
+    struct include_frame frames[MAX_INCLUDE_DEPTH];
+    size_t depth = 1;
+    const char *error = NULL;
+
+    expanded->capacity = size + 1;
+    expanded->source = malloc(expanded->capacity);
+    expanded->size = 0;
+    expanded->dependencies = NULL;
+    expanded->dependency_count = 0;
+    expanded->dependency_capacity = 0;
+    expanded->unresolved_count = 0;
+    expanded->unresolved_name = NULL;
+
+    frames[0].source = source;
+    frames[0].size = size;
+    frames[0].position = 0;
+    frames[0].directory = get_parent_directory(kernel_path);
+    frames[0].name = kernel_path;
+    frames[0].name_size = strlen(kernel_path);
+    frames[0].line = 0;
+    frames[0].in_comment = FALSE;
+    frames[0].skip_nesting = 0;
+
+    while (depth > 0 && error == NULL) {
+        struct include_frame *frame = &frames[depth - 1];
+        if (frame->position >= frame->size) {
+            free(frame->directory);
+            depth--;
+
+            // Lines after the #include keep their own numbers in diagnostics
+            if (depth > 0) {
+                append_line_marker(expanded, frames[depth - 1].line + 1, frames[depth - 1].name,
+                                   frames[depth - 1].name_size);
+            }
+            continue;
+        }
+
+        const char *line = frame->source + frame->position;
+        size_t remaining = frame->size - frame->position;
+        size_t line_size = scan_newline(line, remaining);
+        int has_newline = line_size < remaining;
+        frame->position += line_size + has_newline;
+        frame->line++;
+
+        // Directives are only recognized on lines that start outside of block comments and #if 0 blocks
+        int is_active = !frame->in_comment && frame->skip_nesting == 0;
+        if (!frame->in_comment) {
+            frame->skip_nesting = update_skip_nesting(line, line_size, frame->skip_nesting);
+        }
+        frame->in_comment = scan_comment(line, line_size, frame->in_comment);
+
+        const char *name;
+        size_t name_size;
+        if (is_active && parse_include(line, line_size, &name, &name_size)) {
+            const struct cached_header *header = find_header(cache, frame->directory, name, name_size);
+            if (header == NULL) {
+                // The OpenCL compiler may still find the header (or never reach the #include), so it is kept
+                if (expanded->unresolved_count++ == 0) {
+                    expanded->unresolved_name = strndup(name, name_size);
+                }
+            } else if (add_dependency(expanded, header) || !header->include_once) {
+                if (depth == MAX_INCLUDE_DEPTH) {
+                    error = "Includes are nested too deeply!";
+                    continue;
+                }
+
+                struct include_frame *included = &frames[depth++];
+                included->source = header->view.source;
+                included->size = header->view.size;
+                included->position = 0;
+                included->directory = get_parent_directory(header->path);
+                included->name = name;
+                included->name_size = name_size;
+                included->line = 0;
+                included->in_comment = FALSE;
+                included->skip_nesting = 0;
+                append_line_marker(expanded, 1, name, name_size);
+                continue;
+            } else {
+                // A header that is only included once is left out, and its #include becomes a blank line
+                append_source(expanded, "\n", 1);
+                continue;
+            }
+        }
+
+        // #pragma once would apply to the kernel itself once inlined, so it becomes a blank line
+        size_t rest_size;
+        const char *rest = depth > 1 && is_active ? match_directive(line, line_size, "pragma", &rest_size) : NULL;
+        if (rest != NULL && rest_size >= 4 && strncmp(rest, "once", 4) == STRINGS_ARE_EQUAL) {
+            append_source(expanded, "\n", 1);
+            continue;
+        }
+
+        append_source(expanded, line, line_size);
+        // Headers always end their last line, so it does not run into the line after the #include
+        if (has_newline || depth > 1) {
+            append_source(expanded, "\n", 1);
+        }
+    }
+
+    // An error leaves frames open, which still own their directories
+    while (depth > 0) {
+        free(frames[--depth].directory);
+    }
+    if (error != NULL) {
+        free_expanded_kernel(expanded);
+    }
+    return error;
+}
+
+/*
+ * Free an expanded kernel. The dependencies belong to the cache, so only the list is freed.
+ */
+void free_expanded_kernel(struct expanded_kernel *expanded) {
+    free(expanded->source);
+    free(expanded->dependencies);
+    free(expanded->unresolved_name);
+    expanded->source = NULL;
+    expanded->dependencies = NULL;
+    expanded->unresolved_name = NULL;
+    expanded->size = 0;
+    expanded->dependency_count = 0;
+    expanded->unresolved_count = 0;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Find an included header, first in the including file's directory and then in every search path.
+ * Params:
+ *      cache: cache the header is read through
+ *      directory: directory of the including file, or an empty string for the working directory
+ *      name: name of the header, as written between the quotes
+ *      name_size: length of `name`
+ * Returns:
+ *      pointer to the header, or NULL if it was not found
+ */
+static const struct cached_header *find_header(struct include_cache *cache, const char *directory,
+                                               const char *name, size_t name_size) {
+    const struct cached_header *header = NULL;
+    char *candidate_path = NULL;
+
+    for (size_t i = 0; i <= cache->search_path_count && header == NULL; i++) {
+        // Absolute names are not searched for
+        const char *search_path = name[0] == '/' ? "" : i == 0 ? directory : cache->search_paths[i - 1];
+        size_t search_path_size = strlen(search_path);
+
+        candidate_path = realloc(candidate_path, search_path_size + 1 + name_size + 1);
+        memcpy(candidate_path, search_path, search_path_size);
+        if (search_path_size > 0 && search_path[search_path_size - 1] != '/') {
+            candidate_path[search_path_size++] = '/';
+        }
+        memcpy(candidate_path + search_path_size, name, name_size);
+        candidate_path[search_path_size + name_size] = '\0';
+
+        header = load_header(cache, candidate_path);
+        if (name[0] == '/') {
+            break;
+        }
+    }
+
+    free(candidate_path);
+    return header;
+}
+
+/*
+ * Get the header at a path, reading it only the first time the path (or another path to the same file) is tried.
+ * Params:
+ *      cache: cache the header is read through
+ *      candidate_path: path where the header may be
+ * Returns:
+ *      pointer to the header, or NULL if there is no readable file at the path
+ */
+static struct cached_header *load_header(struct include_cache *cache, const char *candidate_path) {
+    struct cached_header *header = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (size_t i = 0; i < cache->lookup_count; i++) {
+        if (strcmp(cache->lookups[i].candidate_path, candidate_path) == STRINGS_ARE_EQUAL) {
+            header = cache->lookups[i].header;
+            pthread_mutex_unlock(&cache->lock);
+            return header;
+        }
+    }
+
+    // Different paths to the same file share one header
+    char *path = realpath(candidate_path, NULL);
+    for (size_t i = 0; path != NULL && i < cache->header_count && header == NULL; i++) {
+        if (strcmp(cache->headers[i]->path, path) == STRINGS_ARE_EQUAL) {
+            header = cache->headers[i];
+        }
+    }
+
+    FILE *file = path != NULL && header == NULL ? fopen(path, "r") : NULL;
+    if (file != NULL) {
+        header = malloc(sizeof(struct cached_header));
+        if (map_kernel(file, &header->view)) {
+            header->path = path;
+            header->include_once = is_include_once(header->view.source, header->view.size);
+            path = NULL;
+
+            if (cache->header_count == cache->header_capacity) {
+                cache->header_capacity = cache->header_capacity > 0 ? cache->header_capacity * 2 : 16;
+                cache->headers = realloc(cache->headers, sizeof(struct cached_header *) * cache->header_capacity);
+            }
+            cache->headers[cache->header_count++] = header;
+        } else {
+            free(header);
+            header = NULL;
+        }
+        fclose(file);
+    }
+    free(path);
+
+    if (cache->lookup_count == cache->lookup_capacity) {
+        cache->lookup_capacity = cache->lookup_capacity > 0 ? cache->lookup_capacity * 2 : 16;
+        cache->lookups = realloc(cache->lookups, sizeof(struct include_lookup) * cache->lookup_capacity);
+    }
+    cache->lookups[cache->lookup_count].candidate_path = strdup(candidate_path);
+    cache->lookups[cache->lookup_count].header = header;
+    cache->lookup_count++;
+
+    pthread_mutex_unlock(&cache->lock);
+    return header;
+}
+
+/*
+ * Match a preprocessor directive, such as "  #  include", at the start of a line.
+ * Params:
+ *      line: line that will be matched
+ *      line_size: length of the line
+ *      directive: name of the directive, without the '#'
+ *      rest_size: set to the length of the rest of the line
+ * Returns:
+ *      pointer to the rest of the line after the directive and any whitespace, or NULL if the line does not match
+ */
+static const char *match_directive(const char *line, size_t line_size, const char *directive, size_t *rest_size) {
+    const char *end = line + line_size;
+    size_t directive_size = strlen(directive);
+
+    while (line < end && (*line == ' ' || *line == '\t')) {
+        line++;
+    }
+    if (line == end || *line++ != '#') {
+        return NULL;
+    }
+    while (line < end && (*line == ' ' || *line == '\t')) {
+        line++;
+    }
+    if ((size_t)(end - line) < directive_size || strncmp(line, directive, directive_size) != STRINGS_ARE_EQUAL) {
+        return NULL;
+    }
+    line += directive_size;
+
+    // The directive must end here, so #include_next or #ifndefX do not match
+    if (line < end && *line != ' ' && *line != '\t' && *line != '"' && *line != '(' && *line != '\r') {
+        return NULL;
+    }
+    while (line < end && (*line == ' ' || *line == '\t')) {
+        line++;
+    }
+
+    *rest_size = end - line;
+    return line;
+}
+
+/*
+ * Parse an #include "..." directive.
+ * Params:
+ *      line: line that will be parsed
+ *      line_size: length of the line
+ *      name: set to the name of the header, between the quotes
+ *      name_size: set to the length of the name
+ * Returns:
+ *      TRUE if the line is an #include "..." directive, FALSE otherwise
+ */
+static int parse_include(const char *line, size_t line_size, const char **name, size_t *name_size) {
+    size_t rest_size;
+    const char *rest = match_directive(line, line_size, "include", &rest_size);
+    if (rest == NULL || rest_size < 2 || rest[0] != '"') {
+        return FALSE;
+    }
+
+    const char *closing_quote = memchr(rest + 1, '"', rest_size - 1);
+    if (closing_quote == NULL || closing_quote == rest + 1) {
+        return FALSE;
+    }
+
+    *name = rest + 1;
+    *name_size = closing_quote - *name;
+    return TRUE;
+}
+
+/*
+ * Check whether a header only needs to be included once, because it has #pragma once or its contents are wrapped
+ * in an include guard: #ifndef X, #define X, ..., #endif with nothing but comments outside of it.
+ * Params:
+ *      source: contents of the header
+ *      size: size of the header in bytes
+ * Returns:
+ *      TRUE if including the header again would have no effect, FALSE otherwise
+ */
+static int is_include_once(const char *source, size_t size) {
+    const char *guard = NULL;
+    size_t guard_size = 0;
+    int has_define = FALSE;
+    int nesting = 0; // Depth of #if blocks inside the guard, which is closed once this returns to 0
+    size_t position = 0;
+
+    while (position < size) {
+        const char *line = source + position;
+        size_t line_size = scan_newline(line, size - position);
+        position += line_size + 1;
+
+        if (scan_blank(line, line_size)) {
+            continue;
+        }
+
+        size_t rest_size;
+        const char *rest;
+        if ((rest = match_directive(line, line_size, "pragma", &rest_size)) != NULL &&
+            rest_size >= 4 && strncmp(rest, "once", 4) == STRINGS_ARE_EQUAL) {
+            return TRUE;
+        }
+
+        // Comment lines outside of the guard do not matter
+        size_t indent = 0;
+        while (indent < line_size && (line[indent] == ' ' || line[indent] == '\t')) {
+            indent++;
+        }
+        if (indent + 1 < line_size && line[indent] == '/' && (line[indent + 1] == '/' || line[indent + 1] == '*')) {
+            continue;
+        }
+
+        if (guard == NULL) {
+            if ((rest = match_directive(line, line_size, "ifndef", &rest_size)) == NULL) {
+                return FALSE;
+            }
+            guard = rest;
+            while (guard_size < rest_size && (isalnum((unsigned char)guard[guard_size]) || guard[guard_size] == '_')) {
+                guard_size++;
+            }
+            nesting = 1;
+            continue;
+        }
+
+        if (!has_define) {
+            rest = match_directive(line, line_size, "define", &rest_size);
+            if (rest == NULL || rest_size < guard_size || strncmp(rest, guard, guard_size) != STRINGS_ARE_EQUAL) {
+                return FALSE;
+            }
+            has_define = TRUE;
+            continue;
+        }
+
+        // Anything after the guard has been closed is not protected by it
+        if (nesting == 0) {
+            return FALSE;
+        }
+        if (match_directive(line, line_size, "if", &rest_size) != NULL ||
+            match_directive(line, line_size, "ifdef", &rest_size) != NULL ||
+            match_directive(line, line_size, "ifndef", &rest_size) != NULL) {
+            nesting++;
+        } else if (match_directive(line, line_size, "endif", &rest_size) != NULL) {
+            nesting--;
+        } else if (nesting == 1 && (match_directive(line, line_size, "else", &rest_size) != NULL ||
+                                    match_directive(line, line_size, "elif", &rest_size) != NULL)) {
+            return FALSE;
+        }
+    }
+
+    return guard_size > 0 && has_define && nesting == 0;
+}
+
+/*
+ * Track #if 0 blocks, whose includes are never reached. Other conditions depend on macros that are only known to
+ * the OpenCL compiler, so their includes are inlined.
+ * Params:
+ *      line: line that starts outside of a block comment
+ *      line_size: length of the line
+ *      skip_nesting: depth of #if blocks inside the current #if 0 block, or 0 outside of one
+ * Returns:
+ *      the depth of #if blocks inside an #if 0 block after the line, or 0 outside of one
+ */
+static int update_skip_nesting(const char *line, size_t line_size, int skip_nesting) {
+    size_t rest_size;
+    const char *rest = match_directive(line, line_size, "if", &rest_size);
+
+    if (skip_nesting == 0) {
+        int is_zero = rest != NULL && rest_size > 0 && rest[0] == '0' &&
+                      (rest_size == 1 || !(isalnum((unsigned char)rest[1]) || rest[1] == '_' || rest[1] == '.'));
+        return is_zero ? 1 : 0;
+    }
+
+    if (rest != NULL || match_directive(line, line_size, "ifdef", &rest_size) != NULL ||
+        match_directive(line, line_size, "ifndef", &rest_size) != NULL) {
+        return skip_nesting + 1;
+    }
+    if (match_directive(line, line_size, "endif", &rest_size) != NULL) {
+        return skip_nesting - 1;
+    }
+    // The branch after #if 0 may be taken
+    if (skip_nesting == 1 && (match_directive(line, line_size, "else", &rest_size) != NULL ||
+                              match_directive(line, line_size, "elif", &rest_size) != NULL)) {
+        return 0;
+    }
+    return skip_nesting;
+}
+
+/*
+ * Find whether a line ends inside a block comment. String and character literals, and line comments, are skipped.
+ * Params:
+ *      line: line that will be scanned
+ *      line_size: length of the line
+ *      in_comment: TRUE if the line starts inside a block comment
+ * Returns:
+ *      TRUE if the next line starts inside a block comment, FALSE otherwise
+ */
+static int scan_comment(const char *line, size_t line_size, int in_comment) {
+    char quote = '\0';
+
+    for (size_t i = 0; i < line_size; i++) {
+        if (in_comment) {
+            if (line[i] == '*' && i + 1 < line_size && line[i + 1] == '/') {
+                in_comment = FALSE;
+                i++;
+            }
+        } else if (quote != '\0') {
+            if (line[i] == '\\') {
+                i++;
+            } else if (line[i] == quote) {
+                quote = '\0';
+            }
+        } else if (line[i] == '"' || line[i] == '\'') {
+            quote = line[i];
+        } else if (line[i] == '/' && i + 1 < line_size && line[i + 1] == '/') {
+            break;
+        } else if (line[i] == '/' && i + 1 < line_size && line[i + 1] == '*') {
+            in_comment = TRUE;
+            i++;
+        }
+    }
+
+    return in_comment;
+}
+
+/*
+ * Append a #line marker, so diagnostics in the lines that follow point at the file they came from.
+ * Params:
+ *      expanded: kernel the marker is appended to
+ *      line: number of the line after the marker
+ *      name: name of the file the line belongs to
+ *      name_size: length of `name`
+ */
+static void append_line_marker(struct expanded_kernel *expanded, size_t line, const char *name, size_t name_size) {
+    char marker[32];
+    int marker_size = snprintf(marker, sizeof(marker), "#line %zu \"", line);
+
+    append_source(expanded, marker, marker_size);
+    append_source(expanded, name, name_size);
+    append_source(expanded, "\"\n", 2);
+}
+
+/*
+ * Append data to an expanded kernel, growing it as needed.
+ */
+static void append_source(struct expanded_kernel *expanded, const char *data, size_t data_size) {
+    if (expanded->size + data_size > expanded->capacity) {
+        while (expanded->size + data_size > expanded->capacity) {
+            expanded->capacity *= 2;
+        }
+        expanded->source = realloc(expanded->source, expanded->capacity);
+    }
+
+    memcpy(expanded->source + expanded->size, data, data_size);
+    expanded->size += data_size;
+}
+
+/*
+ * Record that an expanded kernel depends on a header.
+ * Returns:
+ *      TRUE if this is the first time the header is included by the kernel, FALSE otherwise
+ */
+static int add_dependency(struct expanded_kernel *expanded, const struct cached_header *header) {
+    for (size_t i = 0; i < expanded->dependency_count; i++) {
+        if (expanded->dependencies[i] == header) {
+            return FALSE;
+        }
+    }
+
+    if (expanded->dependency_count == expanded->dependency_capacity) {
+        expanded->dependency_capacity = expanded->dependency_capacity > 0 ? expanded->dependency_capacity * 2 : 8;
+        expanded->dependencies = realloc(expanded->dependencies, sizeof(struct cached_header *) * expanded->dependency_capacity);
+    }
+    expanded->dependencies[expanded->dependency_count++] = header;
+    return TRUE;
+}
+
+/*
+ * Get the directory part of a path.
+ * Returns:
+ *      a pointer to a newly allocated directory path, which is empty for the working directory
+ */
+static char *get_parent_directory(const char *path) {
+    const char *separator = strrchr(path, '/');
+    size_t length = separator != NULL ? (size_t)(separator - path) + 1 : 0;
+
+    char *directory = malloc(length + 1);
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    return directory;
+}
@@ -0,0 +1,320 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_bundle.c                                                                              //
+//                                                                                                           //
+// Abstract:    Bundles pack many kernels into one file with a hashed name index, so a program maps one file //
+//              at startup and looks kernels up by name without any further system calls or copies.          //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       write_kernel_bundle(FILE *, const char *const *, const struct kernel_view *, size_t) - pack  //
+//              open_kernel_bundle(FILE *bundle_file, struct kernel_bundle *bundle) - map a bundle           //
+//              find_bundle_kernel(const struct kernel_bundle *, const char *, struct kernel_view *)         //
+//                  - look a kernel up by name without copying it                                            //
+//                                                                                                           //
+// Note:        Every field is little-endian. The bundle starts with a BUNDLE_HEADER_SIZE-byte header:       //
+//              the magic, the version, the entry count, the slot count, a reserved field and the bundle     //
+//              size. The index follows: a power of two of 4-byte slots, each either 0 or an entry number    //
+//              plus one, placed by the FNV-1a hash of the entry's name with linear probing. Then come the   //
+//              BUNDLE_ENTRY_SIZE-byte entries (name hash, kernel offset, kernel size, kernel checksum, name //
+//              offset and name size), the null-terminated names, and finally the kernels, each aligned to   //
+//              KERNEL_ALIGNMENT and followed by a terminator.                                               //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../include/kernel_helper.h"
+
+#define BUNDLE_MAGIC "KHBUNDLE"
+#define BUNDLE_MAGIC_SIZE 8
+#define BUNDLE_VERSION 1
+#define BUNDLE_HEADER_SIZE 32
+#define BUNDLE_SLOT_SIZE 4
+#define BUNDLE_ENTRY_SIZE 40
+
+static size_t get_slot_count(size_t entry_count);
+static size_t align_offset(size_t offset, size_t alignment);
+static int find_entry(const struct kernel_bundle *bundle, const char *name, size_t name_size, uint64_t name_hash,
+                      size_t *entry);
+static void write_u32(unsigned char *destination, uint32_t value);
+static void write_u64(unsigned char *destination, uint64_t value);
+static uint32_t read_u32(const unsigned char *source);
+static uint64_t read_u64(const unsigned char *source);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Pack kernels into a bundle file.
+ * Params:
+ *      bundle_out: Opened and writable file where the bundle will be written
+ *      names: name of each kernel, which it is looked up by
+ *      kernels: contents of each kernel
+ *      kernel_count: number of kernels
+ * Returns:
+ *      TRUE if the bundle was written, FALSE if two kernels share a name, memory ran out or writing failed
+ */
+int write_kernel_bundle(FILE *bundle_out, const char *const *names, const struct kernel_view *kernels,
+                        size_t kernel_count) {
+    static const char padding[KERNEL_ALIGNMENT] = { 0 };
+    size_t slot_count = get_slot_count(kernel_count);
+    size_t entries_offset = align_offset(BUNDLE_HEADER_SIZE + slot_count * BUNDLE_SLOT_SIZE, sizeof(uint64_t));
+    size_t names_offset = entries_offset + kernel_count * BUNDLE_ENTRY_SIZE;
+
+    size_t index_size = names_offset;
+    for (size_t i = 0; i < kernel_count; i++) {
+        index_size += strlen(names[i]) + 1;
+    }
+    if (kernel_count > UINT32_MAX - 1 || index_size > UINT32_MAX) {
+        return FALSE;
+    }
+
+    // Everything up to the kernels is built in memory, as the name index is filled in out of order
+    unsigned char *index = calloc(index_size, sizeof(unsigned char));
+    if (index == NULL) {
+        return FALSE;
+    }
+    struct kernel_bundle bundle = { { (const char *)index, index_size, FALSE }, 0, slot_count, index + BUNDLE_HEADER_SIZE,
+                                    index + entries_offset };
+
+    size_t name_offset = names_offset;
+    size_t kernel_offset = align_offset(index_size, KERNEL_ALIGNMENT);
+    for (size_t i = 0; i < kernel_count; i++) {
+        size_t name_size = strlen(names[i]);
+        uint64_t name_hash = hash_kernel(names[i], name_size);
+        size_t duplicate;
+        memcpy(index + name_offset, names[i], name_size + 1);
+
+        unsigned char *entry = index + entries_offset + i * BUNDLE_ENTRY_SIZE;
+        write_u64(entry, name_hash);
+        write_u64(entry + 8, kernel_offset);
+        write_u64(entry + 16, kernels[i].size);
+        write_u64(entry + 24, hash_kernel(kernels[i].source, kernels[i].size));
+        write_u32(entry + 32, (uint32_t)name_offset);
+        write_u32(entry + 36, (uint32_t)name_size);
+
+        if (find_entry(&bundle, names[i], name_size, name_hash, &duplicate)) {
+            free(index);
+            return FALSE;
+        }
+        size_t slot = name_hash & (slot_count - 1);
+        while (read_u32(index + BUNDLE_HEADER_SIZE + slot * BUNDLE_SLOT_SIZE) != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        write_u32(index + BUNDLE_HEADER_SIZE + slot * BUNDLE_SLOT_SIZE, (uint32_t)(i + 1));
+        bundle.entry_count++;
+
+        name_offset += name_size + 1;
+        kernel_offset = align_offset(kernel_offset + kernels[i].size + 1, KERNEL_ALIGNMENT);
+    }
+
+    memcpy(index, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE);
+    write_u32(index + 8, BUNDLE_VERSION);
+    write_u32(index + 12, (uint32_t)kernel_count);
+    write_u32(index + 16, (uint32_t)slot_count);
+    write_u64(index + 24, kernel_offset);
+
+    fwrite(index, sizeof(unsigned char), index_size, bundle_out);
+    fwrite(padding, sizeof(char), align_offset(index_size, KERNEL_ALIGNMENT) - index_size, bundle_out);
+    for (size_t i = 0; i < kernel_count; i++) {
+        fwrite(kernels[i].source, sizeof(char), kernels[i].size, bundle_out);
+        size_t end = kernels[i].size + 1;
+        fwrite(padding, sizeof(char), align_offset(end, KERNEL_ALIGNMENT) - end + 1, bundle_out);
+    }
+
+    free(index);
+    return !ferror(bundle_out);
+}
+
+/*
+ * Map a bundle file into memory and check that its index is intact, so lookups can trust it.
+ * Params:
+ *      bundle_file: opened, readable bundle file, positioned at its start
+ *      bundle: bundle that will be opened, to be closed with close_kernel_bundle()
+ * Returns:
+ *      TRUE if the bundle was opened, FALSE if it could not be read or is not a valid bundle
+ */
+int open_kernel_bundle(FILE *bundle_file, struct kernel_bundle *bundle) {
+    if (!map_kernel(bundle_file, &bundle->view)) {
+        return FALSE;
+    }
+
+    const unsigned char *data = (const unsigned char *)bundle->view.source;
+    size_t size = bundle->view.size;
+    if (size < BUNDLE_HEADER_SIZE || memcmp(data, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE) != STRINGS_ARE_EQUAL ||
+        read_u32(data + 8) != BUNDLE_VERSION || read_u64(data + 24) != size) {
+        release_kernel(&bundle->view);
+        return FALSE;
+    }
+
+    bundle->entry_count = read_u32(data + 12);
+    bundle->slot_count = read_u32(data + 16);
+    size_t entries_offset = align_offset(BUNDLE_HEADER_SIZE + bundle->slot_count * BUNDLE_SLOT_SIZE, sizeof(uint64_t));
+    int is_valid = bundle->slot_count == get_slot_count(bundle->entry_count) &&
+                   entries_offset + bundle->entry_count * BUNDLE_ENTRY_SIZE <= size;
+    bundle->slots = data + BUNDLE_HEADER_SIZE;
+    bundle->entries = data + entries_offset;
+
+    // Every entry must fill exactly one slot, which leaves empty slots for lookups to stop at
+    size_t filled_slots = 0;
+    for (size_t i = 0; is_valid && i < bundle->slot_count; i++) {
+        uint32_t value = read_u32(bundle->slots + i * BUNDLE_SLOT_SIZE);
+        is_valid = value <= bundle->entry_count;
+        filled_slots += value != 0;
+    }
+    is_valid = is_valid && filled_slots == bundle->entry_count;
+    for (size_t i = 0; is_valid && i < bundle->entry_count; i++) {
+        const unsigned char *entry = bundle->entries + i * BUNDLE_ENTRY_SIZE;
+        uint64_t kernel_offset = read_u64(entry + 8);
+        uint64_t kernel_size = read_u64(entry + 16);
+        size_t name_offset = read_u32(entry + 32);
+        size_t name_size = read_u32(entry + 36);
+
+        // Names and kernels must lie inside the bundle, along with their terminators
+        is_valid = name_offset + name_size < size && data[name_offset + name_size] == '\0' &&
+                   kernel_offset < size && kernel_size < size - kernel_offset &&
+                   data[kernel_offset + kernel_size] == '\0';
+    }
+
+    if (!is_valid) {
+        release_kernel(&bundle->view);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Close a bundle opened with open_kernel_bundle(). Views of its kernels are no longer valid afterwards.
+ * Params:
+ *      bundle: bundle that will be closed
+ */
+void close_kernel_bundle(struct kernel_bundle *bundle) {
+    release_kernel(&bundle->view);
+    bundle->entry_count = 0;
+    bundle->slot_count = 0;
+}
+
+/*
+ * Look a kernel up by name in a bundle, without copying it.
+ * Params:
+ *      bundle: opened bundle
+ *      name: name of the kernel
+ *      view: set to the kernel, which is null-terminated and KERNEL_ALIGNMENT-aligned in the bundle. It belongs to
+ *            the bundle and must NOT be released with release_kernel()
+ * Returns:
+ *      TRUE if the kernel was found, FALSE otherwise
+ */
+int find_bundle_kernel(const struct kernel_bundle *bundle, const char *name, struct kernel_view *view) {
+    size_t name_size = strlen(name);
+    size_t entry_number;
+
+    if (!find_entry(bundle, name, name_size, hash_kernel(name, name_size), &entry_number)) {
+        return FALSE;
+    }
+
+    const unsigned char *entry = bundle->entries + entry_number * BUNDLE_ENTRY_SIZE;
+    view->source = bundle->view.source + read_u64(entry + 8);
+    view->size = read_u64(entry + 16);
+    view->is_mapped = FALSE;
+    return TRUE;
+}
+
+/*
+ * Check the checksum of every kernel in a bundle. Lookups do not, as that would read each kernel in full.
+ * Params:
+ *      bundle: opened bundle
+ * Returns:
+ *      TRUE if every kernel is intact, FALSE otherwise
+ */
+int check_kernel_bundle(const struct kernel_bundle *bundle) {
+    for (size_t i = 0; i < bundle->entry_count; i++) {
+        const unsigned char *entry = bundle->entries + i * BUNDLE_ENTRY_SIZE;
+        const char *source = bundle->view.source + read_u64(entry + 8);
+        if (hash_kernel(source, read_u64(entry + 16)) != read_u64(entry + 24)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Get the number of index slots for a number of entries: a power of two at least twice as large, which keeps
+ * probe sequences short.
+ */
+static size_t get_slot_count(size_t entry_count) {
+    size_t slot_count = 2;
+    while (slot_count < entry_count * 2) {
+        slot_count *= 2;
+    }
+
+    return slot_count;
+}
+
+/*
+ * Round an offset up to a multiple of a power of two alignment.
+ */
+static size_t align_offset(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/*
+ * Find the entry of a name in the index of a bundle.
+ * Params:
+ *      bundle: bundle whose index is searched, which may still be incomplete while it is being written
+ *      name: name of the kernel
+ *      name_size: length of the name
+ *      name_hash: hash_kernel() of the name
+ *      entry: set to the number of the entry, if found
+ * Returns:
+ *      TRUE if the name was found, FALSE otherwise
+ */
+static int find_entry(const struct kernel_bundle *bundle, const char *name, size_t name_size, uint64_t name_hash,
+                      size_t *entry) {
+    const unsigned char *data = (const unsigned char *)bundle->view.source;
+    size_t slot = name_hash & (bundle->slot_count - 1);
+    uint32_t value;
+
+    // The index is never full, so probing always reaches an empty slot
+    while ((value = read_u32(bundle->slots + slot * BUNDLE_SLOT_SIZE)) != 0) {
+        const unsigned char *candidate = bundle->entries + (value - 1) * BUNDLE_ENTRY_SIZE;
+        if (read_u64(candidate) == name_hash && read_u32(candidate + 36) == name_size &&
+            memcmp(data + read_u32(candidate + 32), name, name_size) == STRINGS_ARE_EQUAL) {
+            *entry = value - 1;
+            return TRUE;
+        }
+        slot = (slot + 1) & (bundle->slot_count - 1);
+    }
+
+    return FALSE;
+}
+
+static void write_u32(unsigned char *destination, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        destination[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void write_u64(unsigned char *destination, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        destination[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t read_u32(const unsigned char *source) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = value << 8 | source[i];
+    }
+
+    return value;
+}
+
+static uint64_t read_u64(const unsigned char *source) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = value << 8 | source[i];
+    }
+
+    return value;
+}
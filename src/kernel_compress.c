@@ -0,0 +1,265 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_compress.c                                                                            //
+//                                                                                                           //
+// Abstract:    Small LZ77 codec for embedding kernels compressed, which shrinks the binary and the pages    //
+//              touched at startup. Decompression is mostly whole-block copies, fast enough to run just      //
+//              before clCreateProgramWithSource().                                                          //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       compress_kernel(const char *source, size_t size, unsigned char *compressed) - compress       //
+//              decompress_kernel(const unsigned char *, size_t, char *kernel, size_t) - decompress          //
+//                                                                                                           //
+// Note:        The compressed kernel is a series of sequences. Each one starts with a token byte whose high //
+//              nibble is the number of literals and whose low nibble is the match length minus              //
+//              COMPRESS_MIN_MATCH. A nibble of 15 is continued by bytes that are added to it, until a byte  //
+//              below 255. The literals follow, then the 2-byte little-endian offset of the match and the    //
+//              continuation of its length. The last sequence has literals only and ends at the end of the   //
+//              compressed kernel.                                                                           //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../include/kernel_helper.h"
+
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_OFFSET 65535
+#define COMPRESS_HASH_BITS 14
+#define COMPRESS_NIBBLE_MAX 15
+#define COMPRESS_SKIP_SHIFT 6 // Every 2^COMPRESS_SKIP_SHIFT misses in a row, the search steps one byte further
+#define COPY_BLOCK_SIZE 16
+
+static uint32_t hash_sequence(const unsigned char *sequence);
+static unsigned char *write_length(unsigned char *compressed, size_t length);
+static int read_length(const unsigned char **compressed, const unsigned char *end, size_t *length);
+static void copy_blocks(char *destination, const char *source, size_t length, size_t block_size);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Compress an OpenCL kernel. Matches are found greedily through a hash table of recent positions, which keeps
+ * compression fast and allocation-free.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      compressed: buffer of at least COMPRESS_BOUND(size) bytes where the compressed kernel is written
+ * Returns:
+ *      size of the compressed kernel in bytes
+ */
+size_t compress_kernel(const char *source, size_t size, unsigned char *compressed) {
+    uint32_t positions[1 << COMPRESS_HASH_BITS] = { 0 }; // Position + 1 of the last sequence with each hash
+    const unsigned char *input = (const unsigned char *)source;
+    unsigned char *output = compressed;
+    size_t literal_start = 0;
+    size_t position = 0;
+    size_t misses = 0;
+
+    // Positions are stored in 32 bits, so larger kernels only find matches in their first 4 GB
+    while (size >= COMPRESS_MIN_MATCH && position <= size - COMPRESS_MIN_MATCH) {
+        uint32_t hash = hash_sequence(input + position);
+        size_t candidate = positions[hash];
+        if (position < UINT32_MAX) {
+            positions[hash] = (uint32_t)(position + 1);
+        }
+
+        if (candidate == 0 || position - (candidate - 1) > COMPRESS_MAX_OFFSET ||
+            memcmp(input + candidate - 1, input + position, COMPRESS_MIN_MATCH) != 0) {
+            position += 1 + (misses++ >> COMPRESS_SKIP_SHIFT);
+            continue;
+        }
+        candidate--;
+        misses = 0;
+
+        size_t match_length = COMPRESS_MIN_MATCH;
+        while (position + match_length < size && input[candidate + match_length] == input[position + match_length]) {
+            match_length++;
+        }
+
+        size_t literal_length = position - literal_start;
+        size_t offset = position - candidate;
+        unsigned char *token = output++;
+        *token = (unsigned char)((literal_length < COMPRESS_NIBBLE_MAX ? literal_length : COMPRESS_NIBBLE_MAX) << 4);
+        if (literal_length >= COMPRESS_NIBBLE_MAX) {
+            output = write_length(output, literal_length - COMPRESS_NIBBLE_MAX);
+        }
+        memcpy(output, input + literal_start, literal_length);
+        output += literal_length;
+
+        *output++ = (unsigned char)(offset & 0xFF);
+        *output++ = (unsigned char)(offset >> 8);
+        size_t extra_length = match_length - COMPRESS_MIN_MATCH;
+        *token |= (unsigned char)(extra_length < COMPRESS_NIBBLE_MAX ? extra_length : COMPRESS_NIBBLE_MAX);
+        if (extra_length >= COMPRESS_NIBBLE_MAX) {
+            output = write_length(output, extra_length - COMPRESS_NIBBLE_MAX);
+        }
+
+        position += match_length;
+        literal_start = position;
+    }
+
+    // The remaining bytes are written as a final sequence of literals only
+    size_t literal_length = size - literal_start;
+    *output++ = (unsigned char)((literal_length < COMPRESS_NIBBLE_MAX ? literal_length : COMPRESS_NIBBLE_MAX) << 4);
+    if (literal_length >= COMPRESS_NIBBLE_MAX) {
+        output = write_length(output, literal_length - COMPRESS_NIBBLE_MAX);
+    }
+    memcpy(output, input + literal_start, literal_length);
+    output += literal_length;
+
+    return output - compressed;
+}
+
+/*
+ * Decompress a kernel compressed with compress_kernel() into a caller-provided buffer. Every length and offset is
+ * checked, so corrupted input fails instead of reading or writing out of bounds.
+ * Params:
+ *      compressed: the compressed kernel
+ *      compressed_size: size of the compressed kernel in bytes
+ *      kernel: buffer of `kernel_size` bytes where the kernel is written, which is NOT null-terminated
+ *      kernel_size: original size of the kernel in bytes
+ * Returns:
+ *      TRUE if the kernel was decompressed to exactly `kernel_size` bytes, FALSE otherwise
+ */
+int decompress_kernel(const unsigned char *compressed, size_t compressed_size, char *kernel, size_t kernel_size) {
+    const unsigned char *input = compressed;
+    const unsigned char *input_end = compressed + compressed_size;
+    char *output = kernel;
+    char *output_end = kernel + kernel_size;
+    int has_last_sequence = FALSE;
+
+    while (input < input_end) {
+        unsigned char token = *input++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == COMPRESS_NIBBLE_MAX && !read_length(&input, input_end, &literal_length)) {
+            return FALSE;
+        }
+        if (literal_length > (size_t)(input_end - input) || literal_length > (size_t)(output_end - output)) {
+            return FALSE;
+        }
+        // Away from the ends of the buffers, copies may run over by up to a block, which is overwritten later
+        if ((size_t)(input_end - input) >= literal_length + COPY_BLOCK_SIZE &&
+            (size_t)(output_end - output) >= literal_length + COPY_BLOCK_SIZE) {
+            copy_blocks(output, (const char *)input, literal_length, COPY_BLOCK_SIZE);
+        } else {
+            memcpy(output, input, literal_length);
+        }
+        input += literal_length;
+        output += literal_length;
+
+        // Only the last sequence ends after its literals
+        if (input == input_end) {
+            has_last_sequence = TRUE;
+            break;
+        }
+
+        if (input_end - input < 2) {
+            return FALSE;
+        }
+        size_t offset = input[0] | (size_t)input[1] << 8;
+        input += 2;
+        size_t match_length = token & COMPRESS_NIBBLE_MAX;
+        if (match_length == COMPRESS_NIBBLE_MAX && !read_length(&input, input_end, &match_length)) {
+            return FALSE;
+        }
+        match_length += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(output - kernel) || match_length > (size_t)(output_end - output)) {
+            return FALSE;
+        }
+
+        // Matches closer than their length repeat the bytes they are copying, so blocks may not be longer than
+        // the offset, and the closest matches are copied byte by byte
+        const char *match = output - offset;
+        size_t block_size = offset >= COPY_BLOCK_SIZE ? COPY_BLOCK_SIZE : offset >= 8 ? 8 : 0;
+        if (block_size > 0 && (size_t)(output_end - output) >= match_length + block_size) {
+            copy_blocks(output, match, match_length, block_size);
+        } else if (offset >= match_length) {
+            memcpy(output, match, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                output[i] = match[i];
+            }
+        }
+        output += match_length;
+    }
+
+    // A kernel cut right after a match would otherwise look complete
+    return has_last_sequence && output == output_end;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Hash the first COMPRESS_MIN_MATCH bytes of a sequence into a COMPRESS_HASH_BITS-bit index.
+ */
+static uint32_t hash_sequence(const unsigned char *sequence) {
+    uint32_t value;
+    memcpy(&value, sequence, sizeof(value));
+    return (value * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/*
+ * Copy whole blocks until at least `length` bytes are copied. The blocks must not overlap the source, and both
+ * buffers must have room for `length` + `block_size` bytes.
+ * Params:
+ *      destination: where the bytes are copied to
+ *      source: where the bytes are copied from
+ *      length: number of bytes that must be copied
+ *      block_size: size of each block, either COPY_BLOCK_SIZE or 8
+ */
+static void copy_blocks(char *destination, const char *source, size_t length, size_t block_size) {
+    char *end = destination + length;
+    if (block_size == COPY_BLOCK_SIZE) {
+        do {
+            memcpy(destination, source, COPY_BLOCK_SIZE);
+            destination += COPY_BLOCK_SIZE;
+            source += COPY_BLOCK_SIZE;
+        } while (destination < end);
+    } else {
+        do {
+            memcpy(destination, source, 8);
+            destination += 8;
+            source += 8;
+        } while (destination < end);
+    }
+}
+
+/*
+ * Write the continuation bytes of a length that did not fit in its nibble.
+ * Params:
+ *      compressed: where the bytes are written
+ *      length: remainder of the length, after the nibble
+ * Returns:
+ *      pointer past the written bytes
+ */
+static unsigned char *write_length(unsigned char *compressed, size_t length) {
+    while (length >= 255) {
+        *compressed++ = 255;
+        length -= 255;
+    }
+    *compressed++ = (unsigned char)length;
+
+    return compressed;
+}
+
+/*
+ * Read the continuation bytes of a length whose nibble was COMPRESS_NIBBLE_MAX.
+ * Params:
+ *      compressed: position of the bytes, advanced past them
+ *      end: end of the compressed kernel
+ *      length: length that the bytes are added to
+ * Returns:
+ *      TRUE if the length was read, FALSE if the compressed kernel ended first
+ */
+static int read_length(const unsigned char **compressed, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*compressed == end) {
+            return FALSE;
+        }
+        byte = *(*compressed)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return TRUE;
+}
@@ -12,9 +12,11 @@
 //                                                                                                           //
 // Interfaces:  load_kernel(FILE *kernel, size_t kernel_size) - load kernel as string at runtime             //
 //              process_kernel(FILE *kernel, FILE* kernel_out) - format kernel to paste-able format          //
-//                                                                                                           //
-// Note:        Expects a blank line at the end of file, else UNDEFINED BEHAVIOUR WILL OCCUR.                //
-//              The above is a known issue, which should be fixed in a future version.                       //
+//              map_kernel(FILE *kernel, struct kernel_view *view) - map kernel into memory without copying  //
+//              release_kernel(struct kernel_view *view) - release a kernel loaded with map_kernel           //
+//              process_kernel_bytes(FILE *, FILE *, const char *symbol) - format kernel to a C byte array   //
+//              process_kernel_incbin(const char *, FILE *, const char *symbol) - embed kernel with .incbin  //
+//              hash_kernel(const char *source, size_t size) - hash a kernel to detect changes               //
 //                                                                                                           //
 // Example:     __kernel void example(                                                                       //
 //                  __global float* output_buffer)                                                           //
@@ -34,10 +36,161 @@
 //                                                                                                           //
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range()
+#endif
+
 #include "../include/kernel_helper.h"
+#include <time.h>
+
+#include "../include/kernel_scan.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KERNEL_HELPER_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define KERNEL_HELPER_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+// Output buffer that formatted lines are gathered in before being written in large blocks
+struct output_buffer {
+    char *buffer;
+    size_t capacity;
+    size_t length;
+    FILE *file;
+    struct kh_context *context;
+};
+
+static int reserve_buffers(struct kh_context *context);
+static int check_streams(struct kh_context *context, FILE *kernel, FILE *kernel_out);
+static void *allocate_memory(struct kh_context *context, size_t size);
+static void release_memory(const struct kh_context *context, void *pointer, size_t size);
+static int grow_read_buffer(struct kh_context *context, size_t used_size);
+static size_t get_line_size(const struct kh_context *context, const char *line, size_t line_size);
+static size_t format_line(const struct kh_context *context, const char *line, size_t line_size, char *formatted);
+static void init_byte_strings(char byte_strings[256][BYTE_STRING_SIZE]);
+static void write_bytes(struct output_buffer *out, char byte_strings[256][BYTE_STRING_SIZE],
+                        const unsigned char *data, size_t data_size, size_t *written_count);
+static int read_kernel(FILE *kernel, struct kernel_view *view);
+static void write_line(struct output_buffer *out, const char *line, size_t line_size);
+static void write_output(struct output_buffer *out, const char *data, size_t data_size);
+static void flush_output(struct output_buffer *out);
+static char *grow_buffer(char *buffer, size_t new_size);
+static double start_timer(const struct kh_context *context);
+static void stop_timer(const struct kh_context *context, double *total_seconds, double start);
+static void count_written(struct kh_context *context, int written_size);
+static int find_raw_delimiter(const char *source, size_t size, char *delimiter);
+static size_t copy_kernel_file(FILE *kernel, size_t size, FILE *kernel_out);
 
 ////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
 
+/*
+ * Initialize a context with the default options. Contexts share no state, so each thread converting kernels
+ * should use its own. Buffers are only allocated when first needed, and then reused by every call.
+ * Params:
+ *      context: context that will be initialized
+ */
+void kh_init_context(struct kh_context *context) {
+    context->verbose = VERBOSE_DEFAULT;
+    context->use_blank_lines = USE_BLANK_LINES_DEFAULT;
+    context->collect_timings = FALSE;
+    context->allocator.allocate = NULL;
+    context->allocator.release = NULL;
+    context->allocator.user_data = NULL;
+    context->read_buffer = NULL;
+    context->read_capacity = 0;
+    context->write_buffer = NULL;
+    context->write_capacity = 0;
+    context->error = NULL;
+    kh_reset_stats(context);
+}
+
+/*
+ * Free the buffers of a context. The context can be used again afterwards.
+ */
+void kh_free_context(struct kh_context *context) {
+    release_memory(context, context->read_buffer, context->read_capacity);
+    release_memory(context, context->write_buffer, context->write_capacity);
+    context->read_buffer = NULL;
+    context->read_capacity = 0;
+    context->write_buffer = NULL;
+    context->write_capacity = 0;
+}
+
+/*
+ * Create a context on the heap with the default options. See kh_init_context().
+ * Returns:
+ *      pointer to the context, to be destroyed with kh_destroy_context(), or NULL if out of memory
+ */
+struct kh_context *kh_create_context(void) {
+    struct kh_context *context = malloc(sizeof(struct kh_context));
+    if (context != NULL) {
+        kh_init_context(context);
+    }
+
+    return context;
+}
+
+/*
+ * Destroy a context created with kh_create_context().
+ */
+void kh_destroy_context(struct kh_context *context) {
+    if (context != NULL) {
+        kh_free_context(context);
+        free(context);
+    }
+}
+
+/*
+ * Get the error of the last call that failed with a context.
+ * Returns:
+ *      a message describing the error, or NULL if no call has failed
+ */
+const char *kh_get_error(const struct kh_context *context) {
+    return context->error;
+}
+
+/*
+ * Get the counters of the work done with a context since it was initialized or its counters were reset.
+ * Set the context's collect_timings option to also measure the time spent in each stage, which costs a few clock
+ * reads per line.
+ * Returns:
+ *      pointer to the counters, owned by the context
+ */
+const struct kh_stats *kh_get_stats(const struct kh_context *context) {
+    return &context->stats;
+}
+
+/*
+ * Reset the counters of a context to zero.
+ */
+void kh_reset_stats(struct kh_context *context) {
+    memset(&context->stats, 0, sizeof(context->stats));
+}
+
+/*
+ * Add counters to a running total, such as to combine the contexts of several threads.
+ * Params:
+ *      total: counters that will be added to
+ *      stats: counters that will be added
+ */
+void kh_add_stats(struct kh_stats *total, const struct kh_stats *stats) {
+    total->bytes_read += stats->bytes_read;
+    total->bytes_written += stats->bytes_written;
+    total->lines_processed += stats->lines_processed;
+    total->blank_lines_skipped += stats->blank_lines_skipped;
+    total->allocations += stats->allocations;
+    total->read_seconds += stats->read_seconds;
+    total->scan_seconds += stats->scan_seconds;
+    total->transform_seconds += stats->transform_seconds;
+    total->write_seconds += stats->write_seconds;
+}
+
 /*
  * Load an OpenCL kernel from a *.cl file into a string that can then be built into an OpenCL
  * kernel inside a C++ program.
@@ -45,120 +198,1173 @@
  *      kernel_in: pointer to opened, readable file
  *      kernel_size: size of the kernel file in bytes
  * Returns:
- *      pointer to a string that contains the entire kernel
+ *      pointer to a string that contains the entire kernel, or NULL if out of memory
  */
 char* load_kernel(FILE *kernel, size_t kernel_size) {
-    char* kernelSource = malloc(kernel_size);
-    int character;
-    size_t i = 0;
-    while ((character = fgetc(kernel)) != EOF) {
-        kernelSource[i] = (char)character;
-        i++;
+    // One extra byte is needed for the terminator
+    char* kernelSource = malloc(kernel_size + 1);
+    if (kernelSource == NULL) {
+        return NULL;
     }
+    size_t i = fread(kernelSource, sizeof(char), kernel_size, kernel);
 
     kernelSource[i] = '\0';
     return kernelSource;
 }
 
 /*
- * Process an OpenCL kernel from a *.cl file into a format that can be pasted into a C++ program.
+ * Load an OpenCL kernel from a *.cl file into a string, reusing the context's buffer instead of allocating
+ * a new one for every kernel. The size of the kernel is detected automatically.
+ * Params:
+ *      context: context holding the buffer, used by one thread at a time
+ *      kernel: pointer to opened, readable file
+ *      kernel_size: set to the size of the kernel in bytes, if not NULL
+ * Returns:
+ *      pointer to a null-terminated string that contains the entire kernel, owned by the context and valid until
+ *      the next call with the same context, or NULL with the context's error set
+ */
+const char *kh_load_kernel(struct kh_context *context, FILE *kernel, size_t *kernel_size) {
+    size_t size = 0;
+    size_t bytes_read;
+
+    if (!reserve_buffers(context)) {
+        return NULL;
+    }
+
+    // Keep one byte free for the terminator, growing the buffer whenever a read fills it
+    double start = start_timer(context);
+    while ((bytes_read = fread(context->read_buffer + size, sizeof(char), context->read_capacity - size - 1, kernel)) > 0) {
+        size += bytes_read;
+        if (size == context->read_capacity - 1 && !grow_read_buffer(context, size)) {
+            return NULL;
+        }
+    }
+    stop_timer(context, &context->stats.read_seconds, start);
+    context->stats.bytes_read += size;
+
+    if (ferror(kernel)) {
+        context->error = "Kernel could not be read!";
+        return NULL;
+    }
+
+    context->read_buffer[size] = '\0';
+    if (kernel_size != NULL) {
+        *kernel_size = size;
+    }
+    return context->read_buffer;
+}
+
+/*
+ * Get the exact size of a kernel held in memory once formatted by kh_convert_buffer().
+ * Params:
+ *      context: context holding the options
+ *      source: contents of the kernel, which does not need to be null-terminated
+ *      size: size of the kernel in bytes
+ * Returns:
+ *      size of the formatted kernel in bytes, excluding any terminator
+ */
+size_t kh_converted_size(const struct kh_context *context, const char *source, size_t size) {
+    size_t converted_size = 0;
+
+    while (size > 0) {
+        size_t line_size = scan_newline(source, size);
+        converted_size += get_line_size(context, source, line_size);
+
+        // The final line may have no trailing newline
+        size_t consumed = line_size < size ? line_size + 1 : line_size;
+        source += consumed;
+        size -= consumed;
+    }
+
+    return converted_size;
+}
+
+/*
+ * Format a kernel held in memory into a caller-provided buffer, producing the same output as kh_process_kernel()
+ * without allocating memory or touching the file system. Verbose mode is ignored. Use kh_converted_size() to
+ * size the buffer up front.
+ * Params:
+ *      context: context holding the options, used by one thread at a time
+ *      source: contents of the kernel, which does not need to be null-terminated
+ *      size: size of the kernel in bytes
+ *      output: buffer the formatted kernel is written to, which is NOT null-terminated
+ *      output_capacity: size of `output` in bytes
+ *      output_size: set to the number of bytes written, or to the number of bytes needed if `output` is too small
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+int kh_convert_buffer(struct kh_context *context, const char *source, size_t size, char *output,
+                      size_t output_capacity, size_t *output_size) {
+    size_t length = 0;
+    context->error = NULL;
+
+    context->stats.bytes_read += size;
+    while (size > 0) {
+        double start = start_timer(context);
+        size_t line_size = scan_newline(source, size);
+        stop_timer(context, &context->stats.scan_seconds, start);
+
+        // Lines that fit even if every character is escaped skip the exact size check
+        size_t room = output_capacity - length;
+        if (room < line_size * 2 + sizeof(string_prefix) + sizeof(string_suffix) &&
+            room < get_line_size(context, source, line_size)) {
+            context->error = "Output buffer is too small!";
+            *output_size = length + kh_converted_size(context, source, size);
+            return FALSE;
+        }
+        start = start_timer(context);
+        size_t formatted_size = format_line(context, source, line_size, output + length);
+        stop_timer(context, &context->stats.transform_seconds, start);
+
+        // Only skipped blank lines format to nothing, as every other line is at least quoted
+        context->stats.lines_processed++;
+        context->stats.blank_lines_skipped += formatted_size == 0;
+        length += formatted_size;
+
+        size_t consumed = line_size < size ? line_size + 1 : line_size;
+        source += consumed;
+        size -= consumed;
+    }
+
+    *output_size = length;
+    context->stats.bytes_written += length;
+    return TRUE;
+}
+
+/*
+ * Format a kernel held in memory into a buffer taken from the context's allocator, sized exactly with
+ * kh_converted_size(). See kh_convert_buffer().
+ * Params:
+ *      context: context holding the options and allocator, used by one thread at a time
+ *      source: contents of the kernel, which does not need to be null-terminated
+ *      size: size of the kernel in bytes
+ *      output_size: set to the size of the formatted kernel, excluding the terminator, if not NULL
+ * Returns:
+ *      pointer to the null-terminated formatted kernel, to be released to the context's allocator (with free() if
+ *      none is set), or NULL with the context's error set
+ */
+char *kh_convert_alloc(struct kh_context *context, const char *source, size_t size, size_t *output_size) {
+    size_t converted_size = kh_converted_size(context, source, size);
+    size_t written_size;
+
+    char *output = allocate_memory(context, sizeof(char) * (converted_size + 1));
+    if (output == NULL) {
+        context->error = "Out of memory!";
+        return NULL;
+    }
+
+    kh_convert_buffer(context, source, size, output, converted_size, &written_size);
+    output[written_size] = '\0';
+    if (output_size != NULL) {
+        *output_size = written_size;
+    }
+    return output;
+}
+
+/*
+ * Map an OpenCL kernel from a *.cl file into memory without copying it. The size of the kernel is detected
+ * automatically. Inputs that cannot be mapped (such as pipes) are read into a buffer instead.
+ * The resulting view is read-only and NOT null-terminated, so pass its size explicitly as the lengths argument
+ * of clCreateProgramWithSource(). It must be released with release_kernel().
+ * Params:
+ *      kernel: opened, readable file, positioned at its start
+ *      view: view that will be set to the contents of the kernel
+ * Returns:
+ *      TRUE if the kernel was loaded, FALSE otherwise
+ */
+int map_kernel(FILE *kernel, struct kernel_view *view) {
+    view->source = NULL;
+    view->size = 0;
+    view->is_mapped = FALSE;
+
+#ifdef KERNEL_HELPER_HAVE_MMAP
+    struct stat file_status;
+    int descriptor = fileno(kernel);
+
+    if (fstat(descriptor, &file_status) == 0 && S_ISREG(file_status.st_mode) && file_status.st_size > 0) {
+        void *mapping = mmap(NULL, (size_t)file_status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+        if (mapping != MAP_FAILED) {
+            view->source = mapping;
+            view->size = (size_t)file_status.st_size;
+            view->is_mapped = TRUE;
+            return TRUE;
+        }
+    }
+#endif
+
+    return read_kernel(kernel, view);
+}
+
+/*
+ * Release a kernel loaded with map_kernel().
+ * Params:
+ *      view: view that will be released, and reset to an empty view
+ */
+void release_kernel(struct kernel_view *view) {
+#ifdef KERNEL_HELPER_HAVE_MMAP
+    if (view->is_mapped) {
+        munmap((void *)view->source, view->size);
+    } else {
+        free((void *)view->source);
+    }
+#else
+    free((void *)view->source);
+#endif
+
+    view->source = NULL;
+    view->size = 0;
+    view->is_mapped = FALSE;
+}
+
+/*
+ * Process an OpenCL kernel from a *.cl file into a format that can be pasted into a C++ program, with the
+ * default options. See kh_process_kernel().
  * Params:
  *      kernel: Opened and readable file that will be parsed and reformatted
  *      kernel_out: Opened and writable file where the output will be written
  */
 void process_kernel(FILE *kernel, FILE* kernel_out) {
-    // Create input buffer
-    char *in_string_buffer = malloc(sizeof(char) * MAX_BUFFER_SIZE);
-    size_t buffer_size;
-
-    /*  Process the input file, line by line, placing the line in the buffer  */
-    while (fgets(in_string_buffer, MAX_BUFFER_SIZE, kernel)) {
-        // Identify string length
-        buffer_size = get_length(in_string_buffer, MAX_BUFFER_SIZE);
-
-        // If the line is blank, then output the blank_line string if that mode is enabled, and continue
-        if (is_blank_line(in_string_buffer, buffer_size) == TRUE) {
-            if (use_blank_lines) {
-                if (verbose) {
-                    printf("%s", blank_line);
-                }
-                fputs(blank_line, kernel_out);
+    struct kh_context context;
+
+    kh_init_context(&context);
+    kh_process_kernel(&context, kernel, kernel_out);
+    kh_free_context(&context);
+}
+
+/*
+ * Process an OpenCL kernel from a *.cl file into a format that can be pasted into a C++ program.
+ * The input is read in large blocks and every complete line in a block is formatted straight into one
+ * reusable output buffer, so lines may be of any length and the last line does not need a newline.
+ * Params:
+ *      context: context holding the options and buffers, used by one thread at a time
+ *      kernel: Opened and readable file that will be parsed and reformatted
+ *      kernel_out: Opened and writable file where the output will be written
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+int kh_process_kernel(struct kh_context *context, FILE *kernel, FILE *kernel_out) {
+    struct output_buffer out;
+    size_t in_length = 0; // Bytes of an unfinished line carried over from the previous block
+    size_t bytes_read;
+
+    if (!reserve_buffers(context)) {
+        return FALSE;
+    }
+    out.buffer = context->write_buffer;
+    out.capacity = context->write_capacity;
+    out.length = 0;
+    out.file = kernel_out;
+    out.context = context;
+
+    /*  Read the input file block by block, processing every complete line inside the block  */
+    double start = start_timer(context);
+    while ((bytes_read = fread(context->read_buffer + in_length, sizeof(char), context->read_capacity - in_length, kernel)) > 0) {
+        const char *line = context->read_buffer;
+        const char *end = context->read_buffer + in_length + bytes_read;
+        stop_timer(context, &context->stats.read_seconds, start);
+        context->stats.bytes_read += bytes_read;
+
+        for (;;) {
+            start = start_timer(context);
+            size_t line_size = scan_newline(line, end - line);
+            stop_timer(context, &context->stats.scan_seconds, start);
+            if (line_size == (size_t)(end - line)) {
+                break;
             }
-            continue;
+
+            write_line(&out, line, line_size);
+            line += line_size + 1;
         }
 
-        char* out_string_buffer = process_line(in_string_buffer, buffer_size);
+        // Move the unfinished line to the front of the buffer so the next block is appended to it
+        in_length = end - line;
+        memmove(context->read_buffer, line, in_length);
 
-        // Verbose mode will print the resultant text to the screen
-        if (verbose) {
-            printf("%s", out_string_buffer);
+        // A single line fills the whole buffer, so it must be grown before reading any further
+        if (in_length == context->read_capacity && !grow_read_buffer(context, in_length)) {
+            return FALSE;
         }
+        start = start_timer(context);
+    }
+    stop_timer(context, &context->stats.read_seconds, start);
+
+    // The final line has no trailing newline, but is still part of the kernel
+    if (in_length > 0) {
+        write_line(&out, context->read_buffer, in_length);
+    }
+
+    flush_output(&out);
+    return check_streams(context, kernel, kernel_out);
+}
+
+/*
+ * Convert an OpenCL kernel into a C byte array header, with the default options. See kh_process_kernel_bytes().
+ * Params:
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the header will be written
+ *      symbol: name of the array, the size constant is named `symbol`_size
+ */
+void process_kernel_bytes(FILE *kernel, FILE *kernel_out, const char *symbol) {
+    struct kh_context context;
+
+    kh_init_context(&context);
+    kh_process_kernel_bytes(&context, kernel, kernel_out, symbol);
+    kh_free_context(&context);
+}
+
+/*
+ * Convert an OpenCL kernel into a C header holding the kernel as a byte array, which compilers parse much faster
+ * than long string literals and which has no literal length limit. The array is null-terminated, and the size
+ * constant excludes the terminator.
+ * Params:
+ *      context: context holding the options and buffers, used by one thread at a time
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the header will be written
+ *      symbol: name of the array, the size constant is named `symbol`_size
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+int kh_process_kernel_bytes(struct kh_context *context, FILE *kernel, FILE *kernel_out, const char *symbol) {
+    struct output_buffer out;
+    char byte_strings[256][BYTE_STRING_SIZE];
+    size_t kernel_size = 0;
+    size_t bytes_read;
+
+    if (!reserve_buffers(context)) {
+        return FALSE;
+    }
+    char *in_buffer = context->read_buffer;
+    out.buffer = context->write_buffer;
+    out.capacity = context->write_capacity;
+    out.length = 0;
+    out.file = kernel_out;
+    out.context = context;
+
+    count_written(context, fprintf(kernel_out, "// Generated by kernel_helper, do not edit\n"
+                                               "#include <stddef.h>\n"
+                                               "static const unsigned char %s[] = {\n", symbol));
+
+    init_byte_strings(byte_strings);
+    double start = start_timer(context);
+    while ((bytes_read = fread(in_buffer, sizeof(char), context->read_capacity, kernel)) > 0) {
+        stop_timer(context, &context->stats.read_seconds, start);
+        context->stats.bytes_read += bytes_read;
+
+        // Flushes in between are write time, not transform time
+        start = start_timer(context);
+        double write_seconds = context->stats.write_seconds;
+        write_bytes(&out, byte_strings, (const unsigned char *)in_buffer, bytes_read, &kernel_size);
+        stop_timer(context, &context->stats.transform_seconds, start + (context->stats.write_seconds - write_seconds));
+        start = start_timer(context);
+    }
+    stop_timer(context, &context->stats.read_seconds, start);
+
+    flush_output(&out);
+    count_written(context, fprintf(kernel_out, "0x00\n};\n"
+                                               "static const size_t %s_size = %zu;\n", symbol, kernel_size));
+
+    return check_streams(context, kernel, kernel_out);
+}
+
+/*
+ * Convert an OpenCL kernel into a compressed C byte array header, with the default options.
+ * See kh_process_kernel_compressed().
+ * Params:
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the header will be written
+ *      symbol: name of the array
+ */
+void process_kernel_compressed(FILE *kernel, FILE *kernel_out, const char *symbol) {
+    struct kh_context context;
+
+    kh_init_context(&context);
+    kh_process_kernel_compressed(&context, kernel, kernel_out, symbol);
+    kh_free_context(&context);
+}
+
+/*
+ * Convert an OpenCL kernel into a C header holding the kernel compressed with compress_kernel(), to be rebuilt
+ * at runtime with decompress_kernel(). The size of the array is named `symbol`_size and the size of the kernel
+ * is named `symbol`_original_size.
+ * Params:
+ *      context: context holding the options and buffers, used by one thread at a time
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the header will be written
+ *      symbol: name of the array
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+int kh_process_kernel_compressed(struct kh_context *context, FILE *kernel, FILE *kernel_out, const char *symbol) {
+    struct output_buffer out;
+    char byte_strings[256][BYTE_STRING_SIZE];
+    size_t kernel_size;
+    size_t written_size = 0;
 
-        // Write the output buffer into the output file, and free the output buffer.
-        fputs(out_string_buffer, kernel_out);
-        free(out_string_buffer);
+    // The whole kernel is needed at once, as matches may refer back to anywhere in the last 64 KB
+    const char *source = kh_load_kernel(context, kernel, &kernel_size);
+    if (source == NULL) {
+        return FALSE;
     }
+    unsigned char *compressed = allocate_memory(context, COMPRESS_BOUND(kernel_size));
+    if (compressed == NULL) {
+        context->error = "Out of memory!";
+        return FALSE;
+    }
+    double start = start_timer(context);
+    size_t compressed_size = compress_kernel(source, kernel_size, compressed);
+    stop_timer(context, &context->stats.transform_seconds, start);
+
+    out.buffer = context->write_buffer;
+    out.capacity = context->write_capacity;
+    out.length = 0;
+    out.file = kernel_out;
+    out.context = context;
+
+    count_written(context, fprintf(kernel_out, "// Generated by kernel_helper, do not edit\n"
+                                               "// Rebuild the kernel with decompress_kernel(%s, %s_size, buffer, %s_original_size)\n"
+                                               "#include <stddef.h>\n"
+                                               "static const unsigned char %s[] = {\n", symbol, symbol, symbol, symbol));
+
+    init_byte_strings(byte_strings);
+    double write_seconds = context->stats.write_seconds;
+    start = start_timer(context);
+    write_bytes(&out, byte_strings, compressed, compressed_size, &written_size);
+    stop_timer(context, &context->stats.transform_seconds, start + (context->stats.write_seconds - write_seconds));
+    flush_output(&out);
+    release_memory(context, compressed, COMPRESS_BOUND(kernel_size));
+
+    count_written(context, fprintf(kernel_out, "\n};\n"
+                                               "static const size_t %s_size = %zu;\n"
+                                               "static const size_t %s_original_size = %zu;\n",
+                                   symbol, compressed_size, symbol, kernel_size));
+
+    return check_streams(context, kernel, kernel_out);
+}
+
+/*
+ * Convert an OpenCL kernel into a single C++ raw string literal, with the default options.
+ * See kh_process_kernel_raw().
+ * Params:
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the literal will be written
+ */
+void process_kernel_raw(FILE *kernel, FILE *kernel_out) {
+    struct kh_context context;
 
-    // Clean up
-    free(in_string_buffer);
+    kh_init_context(&context);
+    kh_process_kernel_raw(&context, kernel, kernel_out);
+    kh_free_context(&context);
+}
+
+/*
+ * Convert an OpenCL kernel into a single C++ raw string literal, R"kh(...)kh", which holds the kernel verbatim.
+ * The delimiter is chosen so that the kernel never closes the literal early. As nothing is escaped, the kernel is
+ * copied in one piece: from file to file inside the kernel when both are files (on Linux), or with a single write
+ * otherwise. Blank lines are always kept.
+ * Kernels holding a carriage return are rejected: the compiler turns CR and CRLF line endings inside a raw literal
+ * into LF, so the literal would not hold the kernel byte for byte. Such kernels need the string format.
+ * Params:
+ *      context: context holding the options and buffers, used by one thread at a time
+ *      kernel: Opened and readable file that will be converted
+ *      kernel_out: Opened and writable file where the literal will be written
+ * Returns:
+ *      TRUE on success, or FALSE with the context's error set
+ */
+int kh_process_kernel_raw(struct kh_context *context, FILE *kernel, FILE *kernel_out) {
+    struct kernel_view view = { NULL, 0, FALSE };
+    const char *source;
+    size_t kernel_size;
+    char delimiter[RAW_DELIMITER_SIZE];
+    context->error = NULL;
+
+    // Regular files are mapped rather than read, so their pages can be handed straight to the output file
+    double start = start_timer(context);
+#ifdef KERNEL_HELPER_HAVE_MMAP
+    struct stat file_status;
+    if (fstat(fileno(kernel), &file_status) == 0 && S_ISREG(file_status.st_mode) && file_status.st_size > 0 &&
+        !map_kernel(kernel, &view)) {
+        context->error = "Kernel could not be read!";
+        return FALSE;
+    }
+#endif
+    if (view.source != NULL) {
+        source = view.source;
+        kernel_size = view.size;
+        stop_timer(context, &context->stats.read_seconds, start);
+        context->stats.bytes_read += kernel_size;
+    } else if ((source = kh_load_kernel(context, kernel, &kernel_size)) == NULL) {
+        return FALSE;
+    }
+
+    start = start_timer(context);
+    int has_carriage_return = kernel_size > 0 && memchr(source, '\r', kernel_size) != NULL;
+    int found = !has_carriage_return && find_raw_delimiter(source, kernel_size, delimiter);
+    stop_timer(context, &context->stats.scan_seconds, start);
+    if (has_carriage_return) {
+        release_kernel(&view);
+        context->error = "Raw string literals cannot hold carriage returns!";
+        return FALSE;
+    }
+    if (!found) {
+        release_kernel(&view);
+        context->error = "Every raw string delimiter occurs in the kernel!";
+        return FALSE;
+    }
+
+    start = start_timer(context);
+    count_written(context, fprintf(kernel_out, "R\"%s(", delimiter));
+    size_t copied_size = view.is_mapped && !context->verbose ? copy_kernel_file(kernel, kernel_size, kernel_out) : 0;
+    copied_size += fwrite(source + copied_size, sizeof(char), kernel_size - copied_size, kernel_out);
+    context->stats.bytes_written += copied_size;
+    count_written(context, fprintf(kernel_out, ")%s\"\n", delimiter));
+    stop_timer(context, &context->stats.write_seconds, start);
+
+    // Verbose mode will print the resultant text to the screen
+    if (context->verbose) {
+        printf("R\"%s(", delimiter);
+        fwrite(source, sizeof(char), kernel_size, stdout);
+        printf(")%s\"\n", delimiter);
+    }
+
+    release_kernel(&view);
+    return check_streams(context, kernel, kernel_out);
+}
+
+/*
+ * Write an assembly (*.S) file that embeds an OpenCL kernel with the .incbin directive, so the kernel is copied
+ * into the object file by the assembler without being parsed by a compiler at all. The kernel is exported as a
+ * null-terminated, KERNEL_ALIGNMENT-aligned symbol, along with a `symbol`_size symbol that excludes the terminator.
+ * Declare them in C as:
+ *      extern const char symbol[];
+ *      extern const size_t symbol_size;
+ * Params:
+ *      kernel_path: path to the kernel, which should be absolute as the assembler resolves it at build time
+ *      kernel_out: Opened and writable file where the assembly will be written
+ *      symbol: name of the exported kernel symbol
+ */
+void process_kernel_incbin(const char *kernel_path, FILE *kernel_out, const char *symbol) {
+    fprintf(kernel_out, "// Generated by kernel_helper, do not edit\n"
+                        "#if defined(__APPLE__)\n"
+                        "#define KERNEL_SYMBOL(name) _##name\n"
+                        "    .const\n"
+                        "#else\n"
+                        "#define KERNEL_SYMBOL(name) name\n"
+                        "    .section .rodata\n"
+                        "#endif\n"
+                        "#if __SIZEOF_POINTER__ == 8\n"
+                        "#define KERNEL_SIZE .quad\n"
+                        "#else\n"
+                        "#define KERNEL_SIZE .long\n"
+                        "#endif\n"
+                        "\n"
+                        "    .globl KERNEL_SYMBOL(%s)\n"
+                        "    .balign %d\n"
+                        "KERNEL_SYMBOL(%s):\n"
+                        "    .incbin \"", symbol, KERNEL_ALIGNMENT, symbol);
+
+    // The path is a string literal to the assembler, so it needs the same escaping as a kernel line
+    size_t path_size = strlen(kernel_path);
+    size_t span;
+    while ((span = scan_escape(kernel_path, path_size)) < path_size) {
+        fwrite(kernel_path, sizeof(char), span, kernel_out);
+        fputc(escape_prefix[0], kernel_out);
+        fputc(kernel_path[span], kernel_out);
+        kernel_path += span + 1;
+        path_size -= span + 1;
+    }
+    fwrite(kernel_path, sizeof(char), path_size, kernel_out);
+
+    fprintf(kernel_out, "\"\n"
+                        "KERNEL_SYMBOL(%s_end):\n"
+                        "    .byte 0\n"
+                        "\n"
+                        "    .globl KERNEL_SYMBOL(%s_size)\n"
+                        "    .balign __SIZEOF_POINTER__\n"
+                        "KERNEL_SYMBOL(%s_size):\n"
+                        "    KERNEL_SIZE KERNEL_SYMBOL(%s_end) - KERNEL_SYMBOL(%s)\n"
+                        "\n"
+                        "#if defined(__linux__) && defined(__ELF__)\n"
+                        "    .section .note.GNU-stack,\"\",%%progbits\n"
+                        "#endif\n", symbol, symbol, symbol, symbol, symbol);
+}
+
+/*
+ * Hash the contents of a kernel with 64-bit FNV-1a, to detect whether a kernel has changed.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ * Returns:
+ *      64-bit hash of the contents
+ */
+uint64_t hash_kernel(const char *source, size_t size) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)source[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
 }
 
 //////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
 
 /*
- * Process one line to the propre format by wrapping it in the necessary prefix and suffixes.
+ * Allocate the buffers of a context, unless they already are.
+ * Returns:
+ *      TRUE if the buffers are ready, or FALSE with the context's error set
+ */
+static int reserve_buffers(struct kh_context *context) {
+    context->error = NULL;
+
+    if (context->read_buffer == NULL) {
+        context->read_buffer = allocate_memory(context, sizeof(char) * READ_BLOCK_SIZE);
+        context->read_capacity = context->read_buffer != NULL ? READ_BLOCK_SIZE : 0;
+    }
+    if (context->write_buffer == NULL) {
+        context->write_buffer = allocate_memory(context, sizeof(char) * WRITE_BLOCK_SIZE);
+        context->write_capacity = context->write_buffer != NULL ? WRITE_BLOCK_SIZE : 0;
+    }
+
+    if (context->read_buffer == NULL || context->write_buffer == NULL) {
+        context->error = "Out of memory!";
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Check the input and output streams of a conversion for errors.
+ * Returns:
+ *      TRUE if neither stream failed, or FALSE with the context's error set
+ */
+static int check_streams(struct kh_context *context, FILE *kernel, FILE *kernel_out) {
+    if (ferror(kernel)) {
+        context->error = "Kernel could not be read!";
+        return FALSE;
+    }
+    if (ferror(kernel_out)) {
+        context->error = "Output file could not be written!";
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Allocate memory from the allocator of a context.
+ * Params:
+ *      context: context whose allocator is used
+ *      size: number of bytes to allocate
+ * Returns:
+ *      pointer to the memory, or NULL if out of memory
+ */
+static void *allocate_memory(struct kh_context *context, size_t size) {
+    context->stats.allocations++;
+    if (context->allocator.allocate == NULL) {
+        return malloc(size);
+    }
+    return context->allocator.allocate(context->allocator.user_data, size);
+}
+
+/*
+ * Return memory taken with allocate_memory() to the allocator of a context.
+ * Params:
+ *      context: context whose allocator is used
+ *      pointer: memory that will be released, or NULL
+ *      size: number of bytes that were allocated
+ */
+static void release_memory(const struct kh_context *context, void *pointer, size_t size) {
+    if (context->allocator.allocate == NULL) {
+        free(pointer);
+    } else if (context->allocator.release != NULL && pointer != NULL) {
+        context->allocator.release(context->allocator.user_data, pointer, size);
+    }
+}
+
+/*
+ * Double the read buffer of a context. Allocators have no resize operation, so the contents are copied.
+ * Params:
+ *      context: context whose read buffer will be grown
+ *      used_size: number of bytes at the start of the buffer that must be kept
+ * Returns:
+ *      TRUE if the buffer was grown, or FALSE with the context's error set
+ */
+static int grow_read_buffer(struct kh_context *context, size_t used_size) {
+    size_t new_capacity = context->read_capacity * 2;
+    char *new_buffer = allocate_memory(context, sizeof(char) * new_capacity);
+    if (new_buffer == NULL) {
+        context->error = "Out of memory!";
+        return FALSE;
+    }
+
+    memcpy(new_buffer, context->read_buffer, used_size);
+    release_memory(context, context->read_buffer, context->read_capacity);
+    context->read_buffer = new_buffer;
+    context->read_capacity = new_capacity;
+    return TRUE;
+}
+
+/*
+ * Get the size of one line (without its newline) once formatted, matching write_line().
+ * Params:
+ *      context: context holding the options
+ *      line: pointer to the first character of the line
+ *      line_size: length of the line, excluding the newline character
+ * Returns:
+ *      number of bytes the formatted line takes up
+ */
+static size_t get_line_size(const struct kh_context *context, const char *line, size_t line_size) {
+    if (is_blank_line(line, line_size) == TRUE) {
+        return context->use_blank_lines ? sizeof(blank_line) - 1 : 0;
+    }
+
+    // Each character that needs to be escaped grows the line by one character
+    size_t formatted_size = sizeof(string_prefix) + line_size + sizeof(string_suffix) - 1;
+    size_t span;
+    while ((span = scan_escape(line, line_size)) < line_size) {
+        formatted_size++;
+        line += span + 1;
+        line_size -= span + 1;
+    }
+
+    return formatted_size;
+}
+
+/*
+ * Format one line (without its newline) into memory, matching write_line(). The destination must have room
+ * for get_line_size() bytes.
+ * Params:
+ *      context: context holding the options
+ *      line: pointer to the first character of the line
+ *      line_size: length of the line, excluding the newline character
+ *      formatted: destination of the formatted line
+ * Returns:
+ *      number of bytes written to `formatted`
+ */
+static size_t format_line(const struct kh_context *context, const char *line, size_t line_size, char *formatted) {
+    if (is_blank_line(line, line_size) == TRUE) {
+        if (!context->use_blank_lines) {
+            return 0;
+        }
+        memcpy(formatted, blank_line, sizeof(blank_line) - 1);
+        return sizeof(blank_line) - 1;
+    }
+
+    char *start = formatted;
+    *formatted++ = string_prefix[0];
+
+    // Copy the line in spans between the characters that need to be escaped
+    size_t span;
+    while ((span = scan_escape(line, line_size)) < line_size) {
+        memcpy(formatted, line, span);
+        formatted += span;
+        *formatted++ = escape_prefix[0];
+        *formatted++ = line[span];
+        line += span + 1;
+        line_size -= span + 1;
+    }
+    memcpy(formatted, line, line_size);
+    formatted += line_size;
+
+    memcpy(formatted, string_suffix, sizeof(string_suffix) - 1);
+    return formatted + sizeof(string_suffix) - 1 - start;
+}
+
+/*
+ * Build the text of every byte value as "0xNN,", so the bytes of a byte array are looked up instead of formatted.
+ * Params:
+ *      byte_strings: table that will be filled
+ */
+static void init_byte_strings(char byte_strings[256][BYTE_STRING_SIZE]) {
+    for (int i = 0; i < 256; i++) {
+        byte_strings[i][0] = '0';
+        byte_strings[i][1] = 'x';
+        byte_strings[i][2] = hex_digits[i >> 4];
+        byte_strings[i][3] = hex_digits[i & 0xF];
+        byte_strings[i][4] = ',';
+    }
+}
+
+/*
+ * Append bytes to the output buffer as the values of a byte array.
+ * Params:
+ *      out: output buffer that will be appended to
+ *      byte_strings: table built by init_byte_strings()
+ *      data: bytes that will be written
+ *      data_size: number of bytes in `data`
+ *      written_count: number of values written to the array so far, which is advanced
+ */
+static void write_bytes(struct output_buffer *out, char byte_strings[256][BYTE_STRING_SIZE],
+                        const unsigned char *data, size_t data_size, size_t *written_count) {
+    for (size_t i = 0; i < data_size; i++) {
+        if (out->capacity - out->length < BYTE_STRING_SIZE + 1) {
+            flush_output(out);
+        }
+        memcpy(out->buffer + out->length, byte_strings[data[i]], BYTE_STRING_SIZE);
+        out->length += BYTE_STRING_SIZE;
+        // Each line holds BYTES_PER_LINE values, which keeps the line count low without overly long lines
+        if (++*written_count % BYTES_PER_LINE == 0) {
+            out->buffer[out->length++] = '\n';
+        }
+    }
+}
+
+/*
+ * Read the remainder of a file into a single buffer, for inputs that cannot be memory-mapped. Regular files
+ * are read with one bulk read, and inputs of unknown size are read in blocks into a growing buffer.
+ * Params:
+ *      kernel: opened, readable file
+ *      view: view that will be set to the buffer holding the kernel
+ * Returns:
+ *      TRUE if the kernel was read, FALSE otherwise
+ */
+static int read_kernel(FILE *kernel, struct kernel_view *view) {
+    size_t capacity = READ_BLOCK_SIZE;
+    size_t size = 0;
+    size_t bytes_read;
+
+#ifdef KERNEL_HELPER_HAVE_MMAP
+    struct stat file_status;
+    if (fstat(fileno(kernel), &file_status) == 0 && S_ISREG(file_status.st_mode)) {
+        // Leave room to detect that the file grew, so the loop below always ends with a short read
+        capacity = (size_t)file_status.st_size + 1;
+    }
+#endif
+
+    char *buffer = malloc(sizeof(char) * capacity);
+    if (buffer == NULL) {
+        return FALSE;
+    }
+
+    while ((bytes_read = fread(buffer + size, sizeof(char), capacity - size, kernel)) > 0) {
+        size += bytes_read;
+        if (size == capacity) {
+            capacity *= 2;
+            buffer = grow_buffer(buffer, capacity);
+            if (buffer == NULL) {
+                return FALSE;
+            }
+        }
+    }
+
+    if (ferror(kernel)) {
+        free(buffer);
+        return FALSE;
+    }
+
+    // There is always room left for a terminator, which makes the buffer usable as a plain string as well
+    buffer[size] = '\0';
+    view->source = buffer;
+    view->size = size;
+    return TRUE;
+}
+
+/*
+ * Format one line (without its newline) and append it to the output buffer, escaping any '"' or '\'
+ * characters. Blank lines are only written when blank line mode is enabled.
+ * Params:
+ *      out: output buffer the formatted line is appended to
+ *      line: pointer to the first character of the line
+ *      line_size: length of the line, excluding the newline character
+ */
+static void write_line(struct output_buffer *out, const char *line, size_t line_size) {
+    struct kh_context *context = out->context;
+    // Flushes in between are write time, not transform time
+    double write_seconds = context->stats.write_seconds;
+    double start = start_timer(context);
+
+    context->stats.lines_processed++;
+    if (is_blank_line(line, line_size) == TRUE) {
+        if (context->use_blank_lines) {
+            write_output(out, blank_line, sizeof(blank_line) - 1);
+        } else {
+            context->stats.blank_lines_skipped++;
+        }
+        stop_timer(context, &context->stats.transform_seconds, start + (context->stats.write_seconds - write_seconds));
+        return;
+    }
+
+    write_output(out, string_prefix, sizeof(string_prefix));
+
+    // Copy the line in spans between the characters that need to be escaped
+    size_t span;
+    while ((span = scan_escape(line, line_size)) < line_size) {
+        write_output(out, line, span);
+        write_output(out, escape_prefix, sizeof(escape_prefix));
+        write_output(out, line + span, 1);
+        line += span + 1;
+        line_size -= span + 1;
+    }
+    write_output(out, line, line_size);
+
+    write_output(out, string_suffix, sizeof(string_suffix) - 1);
+    stop_timer(context, &context->stats.transform_seconds, start + (context->stats.write_seconds - write_seconds));
+}
+
+/*
+ * Append bytes to the output buffer, flushing it to the output file when it is full. Data larger than
+ * the whole buffer bypasses it and is written directly.
+ * Params:
+ *      out: output buffer that will be appended to
+ *      data: bytes that will be written
+ *      data_size: number of bytes in `data`
+ */
+static void write_output(struct output_buffer *out, const char *data, size_t data_size) {
+    if (data_size > out->capacity - out->length) {
+        flush_output(out);
+
+        if (data_size >= out->capacity) {
+            double start = start_timer(out->context);
+            size_t written_size = fwrite(data, sizeof(char), data_size, out->file);
+            if (out->context->verbose) {
+                fwrite(data, sizeof(char), data_size, stdout);
+            }
+            stop_timer(out->context, &out->context->stats.write_seconds, start);
+            out->context->stats.bytes_written += written_size;
+            return;
+        }
+    }
+
+    memcpy(out->buffer + out->length, data, data_size);
+    out->length += data_size;
+}
+
+/*
+ * Write the contents of the output buffer to the output file (and the screen in verbose mode) and empty it.
+ * Params:
+ *      out: output buffer that will be flushed
+ */
+static void flush_output(struct output_buffer *out) {
+    if (out->length == 0) {
+        return;
+    }
+
+    double start = start_timer(out->context);
+    size_t written_size = fwrite(out->buffer, sizeof(char), out->length, out->file);
+    // Verbose mode will print the resultant text to the screen
+    if (out->context->verbose) {
+        fwrite(out->buffer, sizeof(char), out->length, stdout);
+    }
+    stop_timer(out->context, &out->context->stats.write_seconds, start);
+    out->context->stats.bytes_written += written_size;
+    out->length = 0;
+}
+
+/*
+ * Resize a buffer, freeing it if memory could not be allocated.
+ * Params:
+ *      buffer: buffer that will be resized
+ *      new_size: new size of the buffer in bytes
+ * Returns:
+ *      pointer to the resized buffer, or NULL if out of memory (the buffer is freed)
+ */
+static char *grow_buffer(char *buffer, size_t new_size) {
+    char *new_buffer = realloc(buffer, new_size);
+    if (new_buffer == NULL) {
+        free(buffer);
+    }
+
+    return new_buffer;
+}
+
+/*
+ * Start timing a stage, if the context collects timings.
+ * Returns:
+ *      the current time in seconds, or 0 if timings are not collected
+ */
+static double start_timer(const struct kh_context *context) {
+    if (!context->collect_timings) {
+        return 0.0;
+    }
+
+    struct timespec time;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &time);
+#else
+    timespec_get(&time, TIME_UTC);
+#endif
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/*
+ * Add the time since start_timer() to the total of a stage, if the context collects timings.
+ * Params:
+ *      context: context whose options are checked
+ *      total_seconds: total time of the stage
+ *      start: time returned by start_timer()
+ */
+static void stop_timer(const struct kh_context *context, double *total_seconds, double start) {
+    if (context->collect_timings) {
+        *total_seconds += start_timer(context) - start;
+    }
+}
+
+/*
+ * Count the bytes written by a fprintf() call.
+ * Params:
+ *      context: context whose counters are updated
+ *      written_size: value returned by fprintf(), which is negative on failure
+ */
+static void count_written(struct kh_context *context, int written_size) {
+    if (written_size > 0) {
+        context->stats.bytes_written += (uint64_t)written_size;
+    }
+}
+
+/*
+ * Choose the delimiter of a raw string literal holding a kernel: RAW_DELIMITER_PREFIX, then the prefix followed by
+ * 1, 2 and so on, taking the first whose closing sequence )delimiter" does not occur in the kernel.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      delimiter: buffer of RAW_DELIMITER_SIZE bytes where the null-terminated delimiter is written
+ * Returns:
+ *      TRUE if a delimiter was found, FALSE if the kernel contains every candidate
+ */
+static int find_raw_delimiter(const char *source, size_t size, char *delimiter) {
+    const size_t prefix_size = sizeof(RAW_DELIMITER_PREFIX) - 1;
+    uint64_t taken = 0; // Bit N is set once the closing sequence of candidate N is found
+    const char *end = source + size;
+    const char *quote = source;
+
+    // Quotes are rare in kernels, so closing sequences are matched backwards from each one
+    while ((quote = memchr(quote, '"', end - quote)) != NULL) {
+        const char *digits = quote;
+        unsigned int number = 0;
+        while (digits > source && quote - digits < 2 && digits[-1] >= '0' && digits[-1] <= '9') {
+            digits--;
+        }
+        for (const char *digit = digits; digit < quote; digit++) {
+            number = number * 10 + (unsigned int)(*digit - '0');
+        }
+
+        // Candidates are numbered without leading zeros, so )kh0" or )kh01" never close one
+        if ((size_t)(digits - source) > prefix_size && *(digits - prefix_size - 1) == ')' &&
+            memcmp(digits - prefix_size, RAW_DELIMITER_PREFIX, prefix_size) == 0 &&
+            (digits == quote || (*digits != '0' && number < RAW_DELIMITER_COUNT))) {
+            taken |= (uint64_t)1 << number;
+        }
+        quote++;
+    }
+
+    for (unsigned int number = 0; number < RAW_DELIMITER_COUNT; number++) {
+        if (!(taken & (uint64_t)1 << number)) {
+            if (number == 0) {
+                strcpy(delimiter, RAW_DELIMITER_PREFIX);
+            } else {
+                snprintf(delimiter, RAW_DELIMITER_SIZE, "%s%u", RAW_DELIMITER_PREFIX, number);
+            }
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Copy the start of a kernel file to an output file without passing it through user space, using
+ * copy_file_range(), or sendfile() when the files are on different file systems or the output is not a regular
+ * file. Only available on Linux; elsewhere nothing is copied.
+ * Params:
+ *      kernel: kernel file, which is copied from its start and whose position is left unchanged
+ *      size: number of bytes to copy
+ *      kernel_out: output file, which is flushed and then written at its current position
+ * Returns:
+ *      number of bytes copied, which may fall short of `size` if the copy fails part way
+ */
+static size_t copy_kernel_file(FILE *kernel, size_t size, FILE *kernel_out) {
+#ifdef KERNEL_HELPER_HAVE_SENDFILE
+    int in_descriptor = fileno(kernel);
+    int out_descriptor = fileno(kernel_out);
+    if (in_descriptor < 0 || out_descriptor < 0 || fflush(kernel_out) != 0) {
+        return 0;
+    }
+
+    off_t offset = 0;
+    int use_sendfile = FALSE;
+    while ((size_t)offset < size) {
+        ssize_t copied = -1;
+        if (!use_sendfile) {
+            copied = copy_file_range(in_descriptor, &offset, out_descriptor, NULL, size - (size_t)offset, 0);
+            use_sendfile = copied < 0;
+        }
+        if (use_sendfile) {
+            copied = sendfile(out_descriptor, in_descriptor, &offset, size - (size_t)offset);
+        }
+        if (copied <= 0) {
+            break;
+        }
+    }
+
+    // The stream's idea of its position must follow the descriptor, which moved behind its back, unless the
+    // output is a pipe that has no position
+    off_t position = lseek(out_descriptor, 0, SEEK_CUR);
+    if (position >= 0) {
+        fseeko(kernel_out, position, SEEK_SET);
+    }
+    return (size_t)offset;
+#else
+    (void)kernel;
+    (void)size;
+    (void)kernel_out;
+    return 0;
+#endif
+}
+
+/*
+ * Process one line to the propre format by wrapping it in the necessary prefix and suffixes, and escaping
+ * any '"' or '\' characters inside it.
  * Params:
  *      in_string_buffer: pointer to the buffer containing the string that will be processed
  *      buffer_size: length of the string that will be processed
  * Returns:
- *      pointer to the buffer of the reformatted output string
+ *      pointer to the buffer of the reformatted output string, or NULL if out of memory
  */
 char* process_line(const char* in_string_buffer, size_t in_string_size) {
-    // Allocate a buffer for the output string of size prefix + input + suffix characters
-    // The buffer is created and destroyed every iteration of the loop instead of being created once and
-    // using realloc() because using realloc() was experimentally more prone to memory issues
-    char *out_string_buffer = malloc(sizeof(char) * (in_string_size + strlen(string_prefix) + strlen(string_suffix)));
+    // Count the characters that need to be escaped, as each one grows the output by one character
+    size_t escape_count = 0;
+    for (size_t i = scan_escape(in_string_buffer, in_string_size); i < in_string_size;
+         i += 1 + scan_escape(in_string_buffer + i + 1, in_string_size - i - 1)) {
+        escape_count++;
+    }
+
+    // Allocate a buffer for the output string of size prefix + input + escapes + suffix characters
+    char *out_string_buffer = malloc(sizeof(char) * (in_string_size + escape_count + sizeof(string_prefix) + sizeof(string_suffix)));
+    if (out_string_buffer == NULL) {
+        return NULL;
+    }
 
     // Output string is first constructed by adding the initial `"` character.
     out_string_buffer[0] = string_prefix[0];
-    // Next, append the string from the input buffer into the output buffer
-    for (int i = 0; i < in_string_size; i++) {
-        out_string_buffer[i + 1] = in_string_buffer[i];
-    }
-    // Finally, append the suffix characters to the output buffer
-    for (int i = 1; i <= strlen(string_suffix); i++) {
-        out_string_buffer[in_string_size + i] = string_suffix[i - 1];
+    // Next, append the string from the input buffer into the output buffer, escaping where necessary
+    size_t out_index = 1;
+    for (size_t i = 0; i < in_string_size; i++) {
+        if (in_string_buffer[i] == '"' || in_string_buffer[i] == '\\') {
+            out_string_buffer[out_index++] = escape_prefix[0];
+        }
+        out_string_buffer[out_index++] = in_string_buffer[i];
     }
+    // Finally, append the suffix characters (and terminator) to the output buffer
+    memcpy(out_string_buffer + out_index, string_suffix, sizeof(string_suffix));
 
     return out_string_buffer;
 }
 
 /*
- * Return the length of a string buffer by sequentially checking if a character is the newline character which
- * indicates the end of the line, and returning the index of the newline character.
- * Known Issue: Undefined behaviour when newline character is absent.
+ * Return the length of a string buffer by finding the newline character which indicates the end of the line,
+ * and returning the index of the newline character.
  * Params:
  *      string: string in which the length will be evaluated.
  *      max_length: maximum buffer size
  * Returns:
- *      a size_t that indicates the length of the string
- * Errors:
- *      exits if the indicated length is greater than max_length
+ *      a size_t that indicates the length of the string, or max_length if no newline is found within max_length
  */
 size_t get_length(const char *string, size_t max_length) {
-    for (int i = 0; i < max_length; i++) {
-        if (string[i] == '\n' || string[i] == EOF) {
-            return i;
-        }
-    }
-
-    printf("Fatal Error: Maximum string length was exceeded!");
-    exit(1);
+    return scan_newline(string, max_length);
 }
 
 /*
- * Check for blank lines by returning FALSE when a non-whitespace character is encountered, and TRUE
- * if no non-whitespace character is encountered.
+ * Check for blank lines, which consist only of whitespace characters.
  * Params:
  *      string: string that will be evaluated to be blank or not.
  *      buffer_size: size of `string`
@@ -166,11 +1372,5 @@ size_t get_length(const char *string, size_t max_length) {
  *      TRUE if line is blank (all whitespace), and FALSE otherwise
  */
 int is_blank_line(const char *string, size_t buffer_size) {
-    for (int i = 0; i < buffer_size; i++) {
-        if (!isspace(string[i])) {
-            return FALSE;
-        }
-    }
-
-    return TRUE;
-}
\ No newline at end of file
+    return scan_blank(string, buffer_size);
+}
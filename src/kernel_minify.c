@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_minify.c                                                                              //
+//                                                                                                           //
+// Abstract:    Minification pass that shrinks an OpenCL kernel before it is embedded, reducing both the     //
+//              size of the binary and the amount of source the OpenCL runtime has to tokenize.              //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       minify_kernel(const char *source, size_t size, char *minified) - minify a kernel             //
+//                                                                                                           //
+// Note:        Comments are removed, runs of whitespace are collapsed into a single space (or dropped where //
+//              no token boundary depends on them), line splices are joined and blank lines are dropped.     //
+//              String and character literals are copied untouched, and preprocessor directives keep their   //
+//              own line and all of their spacing, so function-like macros keep their meaning.               //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <ctype.h>
+
+#include "../include/kernel_helper.h"
+
+static size_t skip_splice(const char *source, size_t size, size_t i);
+static int is_include_directive(const char *line, size_t size);
+static int is_separator(char character);
+static int is_word_character(char character);
+static int needs_space(char previous, char next);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Minify an OpenCL kernel. The minified kernel is never larger than the original, and builds identically.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      minified: buffer of at least `size` bytes where the minified kernel will be written, which may not
+ *                overlap `source`
+ * Returns:
+ *      size of the minified kernel in bytes
+ */
+size_t minify_kernel(const char *source, size_t size, char *minified) {
+    size_t length = 0;
+    size_t i = 0;
+    int at_line_start = TRUE; // Nothing has been written on the current line yet
+    int in_directive = FALSE;
+    size_t directive_start = 0; // Index of the '#' of the current directive in `minified`
+    int pending_space = FALSE;
+
+    while (i < size) {
+        size_t next = skip_splice(source, size, i);
+        if (next != i) {
+            i = next;
+            continue;
+        }
+
+        char character = source[i];
+        size_t after = i + 1 < size ? skip_splice(source, size, i + 1) : size;
+
+        // Newlines end the line, unless nothing was written on it
+        if (character == '\n') {
+            if (!at_line_start) {
+                minified[length++] = '\n';
+            }
+            at_line_start = TRUE;
+            in_directive = FALSE;
+            pending_space = FALSE;
+            i++;
+            continue;
+        }
+
+        // Whitespace is only written once the next token shows whether it is needed
+        if (character == ' ' || character == '\t' || character == '\r' || character == '\v' || character == '\f') {
+            pending_space = TRUE;
+            i++;
+            continue;
+        }
+
+        // Line comments run up to (but not including) the newline, and may be continued by a splice
+        if (character == '/' && after < size && source[after] == '/') {
+            while (i < size && source[i] != '\n') {
+                next = skip_splice(source, size, i);
+                i = next != i ? next : i + 1;
+            }
+            pending_space = TRUE;
+            continue;
+        }
+
+        // Block comments are replaced by a single space, even when they span lines
+        if (character == '/' && after < size && source[after] == '*') {
+            i = after + 1;
+            while (i < size) {
+                size_t close = source[i] == '*' ? skip_splice(source, size, i + 1) : size;
+                if (close < size && source[close] == '/') {
+                    i = close + 1;
+                    break;
+                }
+                i++;
+            }
+            pending_space = TRUE;
+            continue;
+        }
+
+        if (pending_space && !at_line_start && (in_directive || needs_space(minified[length - 1], character))) {
+            minified[length++] = ' ';
+        }
+        pending_space = FALSE;
+
+        if (at_line_start && character == '#') {
+            in_directive = TRUE;
+            directive_start = length;
+        }
+        at_line_start = FALSE;
+
+        // Header names are copied as they are, as `//` and `/*` in them do not start a comment
+        if (character == '<' && in_directive &&
+            is_include_directive(minified + directive_start, length - directive_start)) {
+            while (i < size && source[i] != '>' && source[i] != '\n') {
+                minified[length++] = source[i++];
+            }
+            if (i < size && source[i] == '>') {
+                minified[length++] = source[i++];
+            }
+            continue;
+        }
+
+        // String and character literals are copied as they are, escapes included
+        if (character == '"' || character == '\'') {
+            minified[length++] = source[i++];
+            while (i < size && source[i] != character && source[i] != '\n') {
+                if (source[i] == '\\' && i + 1 < size) {
+                    minified[length++] = source[i++];
+                }
+                minified[length++] = source[i++];
+            }
+            if (i < size && source[i] == character) {
+                minified[length++] = source[i++];
+            }
+            continue;
+        }
+
+        minified[length++] = source[i++];
+    }
+
+    return length;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Skip a line splice (a backslash directly followed by a newline), which joins two lines into one.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      i: index that may start a line splice
+ * Returns:
+ *      index after the splice, or `i` if there is no splice at `i`
+ */
+static size_t skip_splice(const char *source, size_t size, size_t i) {
+    while (i < size && source[i] == '\\') {
+        if (i + 1 < size && source[i + 1] == '\n') {
+            i += 2;
+        } else if (i + 2 < size && source[i + 1] == '\r' && source[i + 2] == '\n') {
+            i += 3;
+        } else {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Check whether a directive written so far is an #include, whose next token is a header name.
+ * Params:
+ *      line: minified directive, starting at its '#'
+ *      size: size of the directive written so far in bytes
+ * Returns:
+ *      TRUE if the directive is `#include`, FALSE otherwise
+ */
+static int is_include_directive(const char *line, size_t size) {
+    size_t i = 1;
+    if (i < size && line[i] == ' ') {
+        i++;
+    }
+    if (size - i < 7 || memcmp(line + i, "include", 7) != 0) {
+        return FALSE;
+    }
+
+    i += 7;
+    return i == size || (i + 1 == size && line[i] == ' ');
+}
+
+/*
+ * Check whether a character is a bracket or separator, which is a token on its own.
+ */
+static int is_separator(char character) {
+    return character != '\0' && strchr("(){}[];,", character) != NULL;
+}
+
+/*
+ * Check whether a character can be part of an identifier, number or literal, which would merge with a
+ * neighbouring one if the space between them was dropped. Quotes count, so prefixes such as L"" stay apart.
+ */
+static int is_word_character(char character) {
+    return isalnum((unsigned char)character) || character == '_' || character == '.' ||
+           character == '"' || character == '\'';
+}
+
+/*
+ * Check whether the space between two characters is needed to keep the tokens on either side apart.
+ * Params:
+ *      previous: last character written
+ *      next: next character that will be written
+ * Returns:
+ *      TRUE if the space must be kept, FALSE if it can be dropped
+ */
+static int needs_space(char previous, char next) {
+    // Brackets and separators never combine with anything
+    if (is_separator(previous) || is_separator(next)) {
+        return FALSE;
+    }
+
+    // An exponent followed by a sign would merge into one number, such as 1e +2
+    if ((next == '+' || next == '-') && strchr("eEpP", previous) != NULL) {
+        return TRUE;
+    }
+
+    // Two operators could combine into another operator, such as + + or < =
+    return is_word_character(previous) == is_word_character(next);
+}
@@ -0,0 +1,284 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_scan.c                                                                                //
+//                                                                                                           //
+// Abstract:    Vectorized scanning routines used by kernel_helper to split lines, detect blank lines        //
+//              and find characters that must be escaped inside a string literal.                            //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       Call the scan functions directly; the fastest instruction set available on the running CPU   //
+//              (AVX2, SSE2 or portable scalar code) is selected the first time one is called.               //
+//                                                                                                           //
+// Note:        Every scanner must return exactly the same results, only 16 (SSE2) or 32 (AVX2) bytes        //
+//              are examined at a time instead of one. Whitespace is ' ', '\t', '\n', '\v', '\f' and '\r',   //
+//              which matches isspace() in the "C" locale.                                                   //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "../include/kernel_scan.h"
+#include "../include/kernel_helper.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KERNEL_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t scalar_find_newline(const char *string, size_t size);
+static size_t scalar_find_escape(const char *string, size_t size);
+static int scalar_is_blank(const char *string, size_t size);
+
+static const struct scanner scalar_scanner = {
+        SCAN_ISA_SCALAR, "scalar", scalar_find_newline, scalar_find_escape, scalar_is_blank
+};
+
+#ifdef KERNEL_SCAN_X86
+static size_t sse2_find_newline(const char *string, size_t size);
+static size_t sse2_find_escape(const char *string, size_t size);
+static int sse2_is_blank(const char *string, size_t size);
+static size_t avx2_find_newline(const char *string, size_t size);
+static size_t avx2_find_escape(const char *string, size_t size);
+static int avx2_is_blank(const char *string, size_t size);
+
+static const struct scanner sse2_scanner = {
+        SCAN_ISA_SSE2, "sse2", sse2_find_newline, sse2_find_escape, sse2_is_blank
+};
+static const struct scanner avx2_scanner = {
+        SCAN_ISA_AVX2, "avx2", avx2_find_newline, avx2_find_escape, avx2_is_blank
+};
+#endif
+
+// Scanner picked for the running CPU, selected on first use by whichever thread gets there first
+static _Atomic(const struct scanner *) active_scanner = NULL;
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Get the scanner implemented with a specific instruction set.
+ * Params:
+ *      isa: instruction set of the scanner
+ * Returns:
+ *      pointer to the scanner, or NULL if the instruction set is not supported by the build or the running CPU
+ */
+const struct scanner *get_scanner(enum scan_isa isa) {
+    switch (isa) {
+        case SCAN_ISA_SCALAR:
+            return &scalar_scanner;
+#ifdef KERNEL_SCAN_X86
+        case SCAN_ISA_SSE2:
+            return __builtin_cpu_supports("sse2") ? &sse2_scanner : NULL;
+        case SCAN_ISA_AVX2:
+            return __builtin_cpu_supports("avx2") ? &avx2_scanner : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Get the fastest scanner supported by the running CPU.
+ * Returns:
+ *      pointer to the active scanner
+ */
+const struct scanner *get_active_scanner(void) {
+    const struct scanner *scanner = atomic_load_explicit(&active_scanner, memory_order_acquire);
+    if (scanner != NULL) {
+        return scanner;
+    }
+
+    if ((scanner = get_scanner(SCAN_ISA_AVX2)) == NULL && (scanner = get_scanner(SCAN_ISA_SSE2)) == NULL) {
+        scanner = &scalar_scanner;
+    }
+
+    atomic_store_explicit(&active_scanner, scanner, memory_order_release);
+    return scanner;
+}
+
+/*
+ * Find the first newline character.
+ * Params:
+ *      string: characters that will be scanned
+ *      size: number of characters in `string`
+ * Returns:
+ *      index of the first '\n', or `size` if there is none
+ */
+size_t scan_newline(const char *string, size_t size) {
+    return get_active_scanner()->find_newline(string, size);
+}
+
+/*
+ * Find the first character that must be escaped inside a C string literal, which is either '"' or '\'.
+ * Params:
+ *      string: characters that will be scanned
+ *      size: number of characters in `string`
+ * Returns:
+ *      index of the first character to escape, or `size` if there is none
+ */
+size_t scan_escape(const char *string, size_t size) {
+    return get_active_scanner()->find_escape(string, size);
+}
+
+/*
+ * Check whether a string consists only of whitespace.
+ * Params:
+ *      string: characters that will be scanned
+ *      size: number of characters in `string`
+ * Returns:
+ *      TRUE if every character is whitespace (or the string is empty), and FALSE otherwise
+ */
+int scan_blank(const char *string, size_t size) {
+    return get_active_scanner()->is_blank(string, size);
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Portable scanners, which are also used to finish the tail of a string shorter than one vector.
+ */
+static size_t scalar_find_newline(const char *string, size_t size) {
+    const char *newline = memchr(string, '\n', size);
+    return newline != NULL ? (size_t)(newline - string) : size;
+}
+
+static size_t scalar_find_escape(const char *string, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (string[i] == '"' || string[i] == '\\') {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+static int scalar_is_blank(const char *string, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        unsigned char character = (unsigned char)string[i];
+        if (character != ' ' && (character < '\t' || character > '\r')) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+#ifdef KERNEL_SCAN_X86
+
+/*
+ * SSE2 scanners, examining 16 characters at a time.
+ */
+__attribute__((target("sse2")))
+static size_t sse2_find_newline(const char *string, size_t size) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+
+    return i + scalar_find_newline(string + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_find_escape(const char *string, size_t size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash));
+        int mask = _mm_movemask_epi8(matches);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+
+    return i + scalar_find_escape(string + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static int sse2_is_blank(const char *string, size_t size) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i control_range = _mm_set1_epi8('\r' - '\t');
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        // '\t' to '\r' are contiguous, so subtracting '\t' maps them onto 0..4 (unsigned)
+        __m128i offset = _mm_sub_epi8(block, tab);
+        __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(offset, control_range), offset);
+        __m128i is_space = _mm_or_si128(is_control, _mm_cmpeq_epi8(block, space));
+        if (_mm_movemask_epi8(is_space) != 0xFFFF) {
+            return FALSE;
+        }
+    }
+
+    return scalar_is_blank(string + i, size - i);
+}
+
+/*
+ * AVX2 scanners, examining 32 characters at a time.
+ */
+__attribute__((target("avx2")))
+static size_t avx2_find_newline(const char *string, size_t size) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(string + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+
+    return i + sse2_find_newline(string + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_escape(const char *string, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(string + i));
+        __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(matches);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+
+    return i + sse2_find_escape(string + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int avx2_is_blank(const char *string, size_t size) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i control_range = _mm256_set1_epi8('\r' - '\t');
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(string + i));
+        __m256i offset = _mm256_sub_epi8(block, tab);
+        __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, control_range), offset);
+        __m256i is_space = _mm256_or_si256(is_control, _mm256_cmpeq_epi8(block, space));
+        if ((unsigned)_mm256_movemask_epi8(is_space) != 0xFFFFFFFFu) {
+            return FALSE;
+        }
+    }
+
+    return sse2_is_blank(string + i, size - i);
+}
+
+#endif
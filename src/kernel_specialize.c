@@ -0,0 +1,691 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                                                                           //
+// File:        kernel_specialize.c                                                                          //
+//                                                                                                           //
+// Abstract:    Specialization pass that bakes macro parameters, such as the work-group size or the data     //
+//              type, into an OpenCL kernel, so each variant can be embedded ahead of time instead of being  //
+//              assembled from -D build options at runtime.                                                  //
+//                                                                                                           //
+// Version:     <1.0>                                                                                        //
+//                                                                                                           //
+// Usage:       specialize_kernel(const char *, size_t, const struct kernel_parameter *, size_t, char *)     //
+//                  - specialize a kernel for one set of parameter values                                    //
+//              specialize_bound(const struct kernel_parameter *, size_t, size_t) - size of the output       //
+//                                                                                                           //
+// Note:        The parameters are defined with #define at the top of the kernel. Every #if, #ifdef,         //
+//              #ifndef and #elif whose condition only depends on the parameters is then resolved: the       //
+//              directives and the dead branches are blanked out, leaving their newlines so line numbers in  //
+//              build logs still match the original kernel. Conditions on anything else are kept as they     //
+//              are, which stays correct as the parameters are still defined.                                //
+//                                                                                                           //
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <ctype.h>
+#include <limits.h>
+
+#include "../include/kernel_helper.h"
+
+// Preprocessor directives that specialization follows
+enum directive {
+    DIRECTIVE_OTHER,
+    DIRECTIVE_IF,
+    DIRECTIVE_IFDEF,
+    DIRECTIVE_IFNDEF,
+    DIRECTIVE_ELIF,
+    DIRECTIVE_ELSE,
+    DIRECTIVE_ENDIF,
+    DIRECTIVE_DEFINE,
+    DIRECTIVE_UNDEF,
+    DIRECTIVE_COUNT
+};
+
+static const char *const directive_names[DIRECTIVE_COUNT] = {
+    "", "if", "ifdef", "ifndef", "elif", "else", "endif", "define", "undef"
+};
+
+// Conditional group that a directive opened
+struct condition_frame {
+    int kept; // The group's directives are kept, as a condition could not be resolved
+    int active; // Lines of the current branch are written
+    int taken; // A branch of the group has been taken, or none can be
+};
+
+// Value of a #if expression, which may depend on macros that are not known
+struct expression_value {
+    long long number;
+    int known;
+    int is_unsigned; // The value has the type uintmax_t rather than intmax_t
+};
+
+// Cursor over a #if expression
+struct expression {
+    const char *cursor;
+    const char *end;
+    const struct kernel_parameter *parameters;
+    size_t parameter_count;
+    const int *known; // Parameters that were not redefined or undefined by the kernel
+    int depth; // Nesting of parameter values being expanded
+    int failed;
+};
+
+static const char *find_line_end(const char *line, const char *end);
+static int scan_comments(const char *line, const char *end, int in_comment);
+static const char *skip_blanks(const char *cursor, const char *end);
+static size_t read_identifier(const char *cursor, const char *end);
+static int find_parameter(const struct kernel_parameter *parameters, size_t parameter_count, const char *name,
+                          size_t name_size);
+static struct expression_value evaluate_condition(const char *condition, const char *end,
+                                                  const struct kernel_parameter *parameters, size_t parameter_count,
+                                                  const int *known);
+static struct expression_value parse_conditional(struct expression *expression);
+static struct expression_value parse_binary(struct expression *expression, int min_precedence);
+static struct expression_value parse_unary(struct expression *expression);
+static struct expression_value parse_primary(struct expression *expression);
+static int read_operator(struct expression *expression, int *precedence);
+static struct expression_value apply_operator(int operator, struct expression_value left,
+                                              struct expression_value right);
+static enum directive get_directive(const char *name, size_t name_size);
+static char *write_text(char *specialized, const char *text, const char *text_end);
+static char *write_blank(char *specialized, const char *line, const char *next);
+
+////////////////////////////////////////////  PUBLIC INTERFACES  //////////////////////////////////////////////
+
+/*
+ * Get the size of the buffer that specialize_kernel() needs.
+ * Params:
+ *      parameters: names and values of the parameters
+ *      parameter_count: number of parameters
+ *      size: size of the kernel in bytes
+ * Returns:
+ *      maximum size of the specialized kernel in bytes
+ */
+size_t specialize_bound(const struct kernel_parameter *parameters, size_t parameter_count, size_t size) {
+    size_t bound = size + sizeof(SPECIALIZE_LINE_RESET) - 1;
+    for (size_t i = 0; i < parameter_count; i++) {
+        bound += sizeof("#define  \n") - 1 + strlen(parameters[i].name) + strlen(parameters[i].value);
+    }
+
+    return bound;
+}
+
+/*
+ * Specialize an OpenCL kernel for one set of parameter values, defining each parameter as a macro and resolving
+ * the conditional directives that only depend on the parameters. Redefining or undefining a parameter in the
+ * kernel makes it unknown from then on. At most SPECIALIZE_MAX_PARAMETERS parameters are supported.
+ * Params:
+ *      source: contents of the kernel
+ *      size: size of the kernel in bytes
+ *      parameters: names and values of the parameters, where values are single-line macro bodies
+ *      parameter_count: number of parameters
+ *      specialized: buffer of at least specialize_bound() bytes where the specialized kernel will be written,
+ *                   which may not overlap `source`
+ * Returns:
+ *      size of the specialized kernel in bytes
+ */
+size_t specialize_kernel(const char *source, size_t size, const struct kernel_parameter *parameters,
+                         size_t parameter_count, char *specialized) {
+    struct condition_frame frames[SPECIALIZE_MAX_DEPTH];
+    int known[SPECIALIZE_MAX_PARAMETERS];
+    size_t depth = 0;
+    size_t overflow = 0; // Groups nested deeper than SPECIALIZE_MAX_DEPTH, whose directives are kept
+    int in_comment = FALSE;
+    char *output = specialized;
+
+    if (parameter_count > SPECIALIZE_MAX_PARAMETERS) {
+        parameter_count = SPECIALIZE_MAX_PARAMETERS;
+    }
+    for (size_t i = 0; i < parameter_count; i++) {
+        output += sprintf(output, "#define %s %s\n", parameters[i].name, parameters[i].value);
+        known[i] = TRUE;
+    }
+    memcpy(output, SPECIALIZE_LINE_RESET, sizeof(SPECIALIZE_LINE_RESET) - 1);
+    output += sizeof(SPECIALIZE_LINE_RESET) - 1;
+
+    const char *end = source + size;
+    const char *line = source;
+    while (line < end) {
+        const char *line_end = find_line_end(line, end);
+        const char *next = line_end < end ? line_end + 1 : end;
+        int active = depth == 0 || frames[depth - 1].active;
+        int started_in_comment = in_comment;
+        in_comment = scan_comments(line, line_end, in_comment);
+
+        const char *cursor = skip_blanks(line, line_end);
+        if (started_in_comment || cursor == line_end || *cursor != '#') {
+            output = active ? write_text(output, line, next) : write_blank(output, line, next);
+            line = next;
+            continue;
+        }
+
+        cursor = skip_blanks(cursor + 1, line_end);
+        size_t name_size = read_identifier(cursor, line_end);
+        enum directive directive = get_directive(cursor, name_size);
+        const char *condition = cursor + name_size;
+        int keep = active;
+
+        if (directive == DIRECTIVE_IF || directive == DIRECTIVE_IFDEF || directive == DIRECTIVE_IFNDEF) {
+            struct expression_value value = { 0, FALSE, FALSE };
+            if (active && directive == DIRECTIVE_IF) {
+                value = evaluate_condition(condition, line_end, parameters, parameter_count, known);
+            } else if (active) {
+                const char *name = skip_blanks(condition, line_end);
+                size_t size = read_identifier(name, line_end);
+                int parameter = find_parameter(parameters, parameter_count, name, size);
+                value.known = parameter >= 0 && known[parameter] && skip_blanks(name + size, line_end) == line_end;
+                value.number = directive == DIRECTIVE_IFDEF;
+            }
+
+            if (depth == SPECIALIZE_MAX_DEPTH) {
+                overflow++;
+            } else {
+                struct condition_frame *frame = &frames[depth++];
+                frame->kept = active && !value.known;
+                frame->active = active && (frame->kept || value.number != 0);
+                frame->taken = !active || frame->kept || value.number != 0;
+                keep = frame->kept;
+            }
+        } else if ((directive == DIRECTIVE_ELIF || directive == DIRECTIVE_ELSE) && depth > 0 && overflow == 0) {
+            struct condition_frame *frame = &frames[depth - 1];
+            keep = frame->kept;
+            if (!frame->kept && directive == DIRECTIVE_ELSE) {
+                frame->active = !frame->taken;
+                frame->taken = TRUE;
+            } else if (!frame->kept && frame->taken) {
+                frame->active = FALSE;
+            } else if (!frame->kept) {
+                struct expression_value value = evaluate_condition(condition, line_end, parameters, parameter_count,
+                                                                   known);
+                frame->active = !value.known || value.number != 0;
+                frame->taken = frame->active;
+
+                // Every earlier branch was dead, so an unresolved #elif opens what is left of the group as a #if
+                if (!value.known) {
+                    frame->kept = TRUE;
+                    output = write_text(output, "#if", "#if" + 3);
+                    output = write_text(output, condition, next);
+                    line = next;
+                    continue;
+                }
+            }
+        } else if (directive == DIRECTIVE_ENDIF && overflow > 0) {
+            overflow--;
+        } else if (directive == DIRECTIVE_ENDIF && depth > 0) {
+            keep = frames[--depth].kept;
+        } else if (active && (directive == DIRECTIVE_DEFINE || directive == DIRECTIVE_UNDEF)) {
+            const char *name = skip_blanks(condition, line_end);
+            int parameter = find_parameter(parameters, parameter_count, name, read_identifier(name, line_end));
+            if (parameter >= 0) {
+                known[parameter] = FALSE;
+            }
+        }
+
+        output = keep ? write_text(output, line, next) : write_blank(output, line, next);
+        line = next;
+    }
+
+    return output - specialized;
+}
+
+//////////////////////////////////////////  PRIVATE FUNCTIONS  ////////////////////////////////////////////////
+
+/*
+ * Find the end of a logical line, which line splices continue onto the next physical line.
+ * Returns:
+ *      pointer to the newline that ends the line, or `end`
+ */
+static const char *find_line_end(const char *line, const char *end) {
+    for (;;) {
+        const char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL) {
+            return end;
+        }
+
+        const char *splice = newline > line && newline[-1] == '\r' ? newline - 1 : newline;
+        if (splice == line || splice[-1] != '\\') {
+            return newline;
+        }
+        line = newline + 1;
+    }
+}
+
+/*
+ * Follow block comments through a line, so directives inside comments are not mistaken for real ones.
+ * Params:
+ *      line: start of the line
+ *      end: end of the line
+ *      in_comment: TRUE if the line starts inside a block comment
+ * Returns:
+ *      TRUE if the line ends inside a block comment
+ */
+static int scan_comments(const char *line, const char *end, int in_comment) {
+    while (line < end) {
+        if (in_comment) {
+            if (line[0] == '*' && line + 1 < end && line[1] == '/') {
+                in_comment = FALSE;
+                line++;
+            }
+        } else if (line[0] == '/' && line + 1 < end && line[1] == '*') {
+            in_comment = TRUE;
+            line++;
+        } else if (line[0] == '/' && line + 1 < end && line[1] == '/') {
+            return FALSE;
+        } else if (line[0] == '"' || line[0] == '\'') {
+            // Literals may hold comment markers, so they are skipped along with their escapes
+            char quote = *line++;
+            while (line < end && *line != quote) {
+                line += *line == '\\' && line + 1 < end ? 2 : 1;
+            }
+        }
+        line++;
+    }
+
+    return in_comment;
+}
+
+/*
+ * Skip spaces, tabs, line splices and comments.
+ * Returns:
+ *      pointer to the next character of a token, or `end`
+ */
+static const char *skip_blanks(const char *cursor, const char *end) {
+    while (cursor < end) {
+        if (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\v' || *cursor == '\f' ||
+            *cursor == '\n' || (*cursor == '\\' && cursor + 1 < end && (cursor[1] == '\n' || cursor[1] == '\r'))) {
+            cursor++;
+        } else if (*cursor == '/' && cursor + 1 < end && cursor[1] == '/') {
+            return end;
+        } else if (*cursor == '/' && cursor + 1 < end && cursor[1] == '*') {
+            cursor += 2;
+            while (cursor < end && !(cursor[0] == '*' && cursor + 1 < end && cursor[1] == '/')) {
+                cursor++;
+            }
+            cursor = cursor < end ? cursor + 2 : end;
+        } else {
+            break;
+        }
+    }
+
+    return cursor;
+}
+
+/*
+ * Get the size of the identifier that starts at a cursor.
+ * Returns:
+ *      size of the identifier in bytes, or 0 if none starts there
+ */
+static size_t read_identifier(const char *cursor, const char *end) {
+    size_t size = 0;
+    if (cursor < end && (isalpha((unsigned char)*cursor) || *cursor == '_')) {
+        while (cursor + size < end && (isalnum((unsigned char)cursor[size]) || cursor[size] == '_')) {
+            size++;
+        }
+    }
+
+    return size;
+}
+
+/*
+ * Find a parameter by name.
+ * Returns:
+ *      index of the parameter, or -1 if no parameter has this name
+ */
+static int find_parameter(const struct kernel_parameter *parameters, size_t parameter_count, const char *name,
+                          size_t name_size) {
+    for (size_t i = 0; i < parameter_count && name_size > 0; i++) {
+        if (strlen(parameters[i].name) == name_size && memcmp(parameters[i].name, name, name_size) == 0) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Evaluate the condition of a #if or #elif directive with the values of the parameters.
+ * Params:
+ *      condition: text of the condition, after the directive's name
+ *      end: end of the condition
+ *      parameters: names and values of the parameters
+ *      parameter_count: number of parameters
+ *      known: flags of the parameters that still hold their value
+ * Returns:
+ *      value of the condition, which is unknown if it depends on anything other than known parameters, or if it
+ *      could not be parsed
+ */
+static struct expression_value evaluate_condition(const char *condition, const char *end,
+                                                  const struct kernel_parameter *parameters, size_t parameter_count,
+                                                  const int *known) {
+    struct expression expression = { condition, end, parameters, parameter_count, known, 0, FALSE };
+
+    struct expression_value value = parse_conditional(&expression);
+    if (expression.failed || skip_blanks(expression.cursor, end) != end) {
+        value.known = FALSE;
+    }
+    return value;
+}
+
+/*
+ * Parse a conditional expression, `condition ? a : b`, or any expression of a higher precedence.
+ */
+static struct expression_value parse_conditional(struct expression *expression) {
+    struct expression_value condition = parse_binary(expression, 1);
+
+    expression->cursor = skip_blanks(expression->cursor, expression->end);
+    if (expression->cursor == expression->end || *expression->cursor != '?') {
+        return condition;
+    }
+    expression->cursor++;
+    struct expression_value if_true = parse_conditional(expression);
+
+    expression->cursor = skip_blanks(expression->cursor, expression->end);
+    if (expression->cursor == expression->end || *expression->cursor != ':') {
+        expression->failed = TRUE;
+        return condition;
+    }
+    expression->cursor++;
+    struct expression_value if_false = parse_conditional(expression);
+
+    struct expression_value value = condition.number != 0 ? if_true : if_false;
+    value.known = value.known && condition.known;
+    // Like any other operator, the branches are brought to a common type
+    value.is_unsigned = if_true.is_unsigned || if_false.is_unsigned;
+    return value;
+}
+
+/*
+ * Parse binary operators of at least a given precedence, from || (1) up to * / % (10), left to right.
+ */
+static struct expression_value parse_binary(struct expression *expression, int min_precedence) {
+    struct expression_value left = parse_unary(expression);
+
+    for (;;) {
+        const char *start = expression->cursor;
+        int precedence;
+        int operator = read_operator(expression, &precedence);
+        if (operator == 0 || precedence < min_precedence) {
+            expression->cursor = start;
+            return left;
+        }
+
+        struct expression_value right = parse_binary(expression, precedence + 1);
+        left = apply_operator(operator, left, right);
+    }
+}
+
+/*
+ * Parse a unary operator, ! ~ - or +, followed by its operand.
+ */
+static struct expression_value parse_unary(struct expression *expression) {
+    expression->cursor = skip_blanks(expression->cursor, expression->end);
+    if (expression->cursor == expression->end) {
+        expression->failed = TRUE;
+        return (struct expression_value){ 0, FALSE, FALSE };
+    }
+
+    char operator = *expression->cursor;
+    if (operator != '!' && operator != '~' && operator != '-' && operator != '+') {
+        return parse_primary(expression);
+    }
+    expression->cursor++;
+
+    struct expression_value value = parse_unary(expression);
+    if (operator == '!') {
+        value.number = !value.number;
+        value.is_unsigned = FALSE;
+    } else if (operator == '~') {
+        value.number = ~value.number;
+    } else if (operator == '-') {
+        value.number = (long long)(0ULL - (unsigned long long)value.number);
+    }
+    return value;
+}
+
+/*
+ * Parse a number, a parenthesized expression, defined(NAME) or an identifier. Parameters are replaced by the
+ * value of their own expression, and any other identifier makes the expression unknown.
+ */
+static struct expression_value parse_primary(struct expression *expression) {
+    struct expression_value value = { 0, TRUE, FALSE };
+    const char *cursor = expression->cursor;
+    const char *end = expression->end;
+
+    if (*cursor == '(') {
+        expression->cursor++;
+        value = parse_conditional(expression);
+        expression->cursor = skip_blanks(expression->cursor, end);
+        if (expression->cursor == end || *expression->cursor != ')') {
+            expression->failed = TRUE;
+            return value;
+        }
+        expression->cursor++;
+        return value;
+    }
+
+    if (isdigit((unsigned char)*cursor)) {
+        // The expression is not null-terminated, so the literal is read by hand rather than with strtoull()
+        unsigned base = 10;
+        if (*cursor == '0' && cursor + 1 < end && (cursor[1] == 'x' || cursor[1] == 'X')) {
+            base = 16;
+            cursor += 2;
+        } else if (*cursor == '0') {
+            base = 8;
+        }
+
+        const char *digits = cursor;
+        unsigned long long number = 0;
+        while (cursor < end && isxdigit((unsigned char)*cursor)) {
+            unsigned digit = isdigit((unsigned char)*cursor) ? (unsigned)(*cursor - '0')
+                                                             : (unsigned)(tolower((unsigned char)*cursor) - 'a' + 10);
+            if (digit >= base) {
+                break;
+            }
+            // Literals too large for the preprocessor's integers are left to the compiler
+            if (number > (ULLONG_MAX - digit) / base) {
+                value.known = FALSE;
+            }
+            number = number * base + digit;
+            cursor++;
+        }
+        value.number = (long long)number;
+        value.is_unsigned = number > LLONG_MAX;
+        if (cursor == digits) {
+            expression->failed = TRUE;
+        }
+        while (cursor < end && (*cursor == 'u' || *cursor == 'U' || *cursor == 'l' || *cursor == 'L')) {
+            value.is_unsigned = value.is_unsigned || *cursor == 'u' || *cursor == 'U';
+            cursor++;
+        }
+        // Anything else glued to the number, such as a floating-point part, is not a valid #if operand
+        if (cursor < end && (isalnum((unsigned char)*cursor) || *cursor == '_' || *cursor == '.')) {
+            expression->failed = TRUE;
+        }
+        expression->cursor = cursor;
+        return value;
+    }
+
+    size_t name_size = read_identifier(cursor, end);
+    if (name_size == 0) {
+        expression->failed = TRUE;
+        return value;
+    }
+    expression->cursor = cursor + name_size;
+
+    if (name_size == 7 && memcmp(cursor, "defined", 7) == 0) {
+        const char *name = skip_blanks(expression->cursor, end);
+        int parenthesized = name < end && *name == '(';
+        name = parenthesized ? skip_blanks(name + 1, end) : name;
+        size_t size = read_identifier(name, end);
+        const char *after = skip_blanks(name + size, end);
+        if (size == 0 || (parenthesized && (after == end || *after != ')'))) {
+            expression->failed = TRUE;
+            return value;
+        }
+        expression->cursor = parenthesized ? after + 1 : name + size;
+
+        int parameter = find_parameter(expression->parameters, expression->parameter_count, name, size);
+        value.number = 1;
+        value.known = parameter >= 0 && expression->known[parameter];
+        return value;
+    }
+
+    int parameter = find_parameter(expression->parameters, expression->parameter_count, cursor, name_size);
+    if (parameter >= 0 && expression->known[parameter] && expression->depth < SPECIALIZE_MAX_EXPANSION) {
+        const char *parameter_value = expression->parameters[parameter].value;
+        struct expression nested = { parameter_value, parameter_value + strlen(parameter_value),
+                                     expression->parameters, expression->parameter_count, expression->known,
+                                     expression->depth + 1, FALSE };
+        value = parse_conditional(&nested);
+        if (nested.failed || skip_blanks(nested.cursor, nested.end) != nested.end) {
+            value.known = FALSE;
+        }
+        return value;
+    }
+
+    // Calls of function-like macros could only be parsed by knowing the macro, so the whole directive is kept
+    const char *after = skip_blanks(expression->cursor, end);
+    expression->failed = after < end && *after == '(';
+    value.known = FALSE;
+    return value;
+}
+
+/*
+ * Read a binary operator.
+ * Params:
+ *      expression: expression whose cursor is advanced past the operator
+ *      precedence: set to the precedence of the operator
+ * Returns:
+ *      the operator's characters packed into an int, such as '<' << 8 | '=' for <=, or 0 if there is none
+ */
+static int read_operator(struct expression *expression, int *precedence) {
+    static const struct {
+        const char *text;
+        int precedence;
+    } operators[] = {
+        { "||", 1 }, { "&&", 2 }, { "==", 6 }, { "!=", 6 }, { "<=", 7 }, { ">=", 7 }, { "<<", 8 }, { ">>", 8 },
+        { "|", 3 }, { "^", 4 }, { "&", 5 }, { "<", 7 }, { ">", 7 }, { "+", 9 }, { "-", 9 }, { "*", 10 },
+        { "/", 10 }, { "%", 10 }
+    };
+
+    const char *cursor = skip_blanks(expression->cursor, expression->end);
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        size_t size = strlen(operators[i].text);
+        if ((size_t)(expression->end - cursor) >= size && memcmp(cursor, operators[i].text, size) == 0) {
+            expression->cursor = cursor + size;
+            *precedence = operators[i].precedence;
+            return size == 2 ? operators[i].text[0] << 8 | operators[i].text[1] : operators[i].text[0];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Apply a binary operator. && and || are known as soon as either side decides them, like their short circuit.
+ * When either operand is unsigned, both are converted to uintmax_t first, as C's usual arithmetic conversions
+ * require, so `-1 < 0u` is false.
+ */
+static struct expression_value apply_operator(int operator, struct expression_value left,
+                                              struct expression_value right) {
+    int is_unsigned = left.is_unsigned || right.is_unsigned;
+    struct expression_value value = { 0, left.known && right.known, is_unsigned };
+    unsigned long long a = (unsigned long long)left.number;
+    unsigned long long b = (unsigned long long)right.number;
+    // Flipping the sign bit of signed operands orders them correctly as unsigned values
+    unsigned long long bias = is_unsigned ? 0 : 1ULL << 63;
+
+    switch (operator) {
+        case '|' << 8 | '|':
+            value.number = left.number != 0 || right.number != 0;
+            value.is_unsigned = FALSE;
+            value.known = value.known || (left.known && left.number != 0) || (right.known && right.number != 0);
+            return value;
+        case '&' << 8 | '&':
+            value.number = left.number != 0 && right.number != 0;
+            value.is_unsigned = FALSE;
+            value.known = value.known || (left.known && left.number == 0) || (right.known && right.number == 0);
+            return value;
+        // Comparisons give an int whatever the type of their operands
+        case '=' << 8 | '=': value.number = a == b; value.is_unsigned = FALSE; break;
+        case '!' << 8 | '=': value.number = a != b; value.is_unsigned = FALSE; break;
+        case '<' << 8 | '=': value.number = (a ^ bias) <= (b ^ bias); value.is_unsigned = FALSE; break;
+        case '>' << 8 | '=': value.number = (a ^ bias) >= (b ^ bias); value.is_unsigned = FALSE; break;
+        case '<': value.number = (a ^ bias) < (b ^ bias); value.is_unsigned = FALSE; break;
+        case '>': value.number = (a ^ bias) > (b ^ bias); value.is_unsigned = FALSE; break;
+        case '|': value.number = (long long)(a | b); break;
+        case '^': value.number = (long long)(a ^ b); break;
+        case '&': value.number = (long long)(a & b); break;
+        case '+': value.number = (long long)(a + b); break;
+        case '-': value.number = (long long)(a - b); break;
+        case '*': value.number = (long long)(a * b); break;
+        case '<' << 8 | '<':
+        case '>' << 8 | '>':
+            // A shift has the type of its left operand. Shifts past its width are undefined, so they are left to
+            // the compiler
+            value.is_unsigned = left.is_unsigned;
+            if ((!right.is_unsigned && right.number < 0) || b >= 64) {
+                value.known = FALSE;
+            } else if (operator == ('<' << 8 | '<')) {
+                value.number = (long long)(a << b);
+            } else {
+                value.number = left.is_unsigned ? (long long)(a >> b) : left.number >> b;
+            }
+            break;
+        case '/':
+        case '%':
+            if (is_unsigned && b != 0) {
+                value.number = (long long)(operator == '/' ? a / b : a % b);
+            } else if (b == 0 || (left.number == LLONG_MIN && right.number == -1)) {
+                value.known = FALSE;
+            } else {
+                value.number = operator == '/' ? left.number / right.number : left.number % right.number;
+            }
+            break;
+        default:
+            value.known = FALSE;
+            break;
+    }
+
+    return value;
+}
+
+/*
+ * Get the directive that a name read with read_identifier() after a '#' refers to.
+ */
+static enum directive get_directive(const char *name, size_t name_size) {
+    for (int i = DIRECTIVE_OTHER + 1; i < DIRECTIVE_COUNT; i++) {
+        if (strlen(directive_names[i]) == name_size && memcmp(name, directive_names[i], name_size) == 0) {
+            return (enum directive)i;
+        }
+    }
+
+    return DIRECTIVE_OTHER;
+}
+
+/*
+ * Copy text to the specialized kernel.
+ * Returns:
+ *      pointer past the copied text
+ */
+static char *write_text(char *specialized, const char *text, const char *text_end) {
+    memcpy(specialized, text, text_end - text);
+    return specialized + (text_end - text);
+}
+
+/*
+ * Blank out a line, keeping only its newlines.
+ * Params:
+ *      specialized: where the newlines are written
+ *      line: start of the line
+ *      next: start of the next line
+ * Returns:
+ *      pointer past the written newlines
+ */
+static char *write_blank(char *specialized, const char *line, const char *next) {
+    for (; line < next; line++) {
+        if (*line == '\n') {
+            *specialized++ = '\n';
+        }
+    }
+
+    return specialized;
+}
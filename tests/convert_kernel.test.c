@@ -0,0 +1,371 @@
+//
+// Tests of the convert_kernel executable, whose path is given as the first argument. Every test works in its own
+// temporary directory, where it writes kernels and runs the executable.
+//
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/kernel_helper.h"
+
+#define TEST_COMMAND_SIZE 4096
+#define TEST_OUTPUT_SIZE 65536
+#define TEST_CHUNK_SIZE (4 * 1024 * 1024) // CHUNK_SIZE of convert_kernel
+#define TEST_CHUNKED_SIZE (4 * TEST_CHUNK_SIZE + 4096) // Past CHUNK_MIN_KERNEL_SIZE, so the kernel is chunked
+
+static const char *converter;
+static char directory[] = "/tmp/convert_kernel_test_XXXXXX";
+
+/*
+ * Write a file in the test directory.
+ */
+static void write_file(const char *name, const char *contents, size_t size) {
+    char path[TEST_COMMAND_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "wb");
+    assert(file != NULL);
+    assert(fwrite(contents, sizeof(char), size, file) == size);
+    assert(fclose(file) == 0);
+}
+
+/*
+ * Read a file of the test directory into a newly allocated, NUL-terminated buffer.
+ */
+static char *read_file(const char *name, size_t *size) {
+    char path[TEST_COMMAND_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "rb");
+    assert(file != NULL);
+    struct kernel_view view;
+    assert(map_kernel(file, &view));
+    fclose(file);
+
+    char *contents = malloc(view.size + 1);
+    memcpy(contents, view.source, view.size);
+    contents[view.size] = '\0';
+    *size = view.size;
+    release_kernel(&view);
+    return contents;
+}
+
+/*
+ * Count the occurrences of a string in another.
+ */
+static size_t count_occurrences(const char *string, const char *pattern) {
+    size_t count = 0;
+    for (const char *match = strstr(string, pattern); match != NULL; match = strstr(match + 1, pattern)) {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Check that two files of the test directory hold the same bytes.
+ */
+static void assert_same_files(const char *first_name, const char *second_name) {
+    size_t first_size;
+    size_t second_size;
+    char *first = read_file(first_name, &first_size);
+    char *second = read_file(second_name, &second_size);
+
+    assert(first_size == second_size);
+    assert(memcmp(first, second, first_size) == 0);
+    free(first);
+    free(second);
+}
+
+/*
+ * Check whether a file exists in the test directory.
+ */
+static int file_exists(const char *name) {
+    char path[TEST_COMMAND_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    return access(path, F_OK) == 0;
+}
+
+/*
+ * Run the executable from the test directory, with arguments given as a printf() format.
+ * Returns:
+ *      the printed output, in a static buffer overwritten by the next run
+ */
+static const char *run_converter(const char *format, ...) {
+    static char output[TEST_OUTPUT_SIZE];
+    char arguments[TEST_COMMAND_SIZE];
+    char command[TEST_COMMAND_SIZE * 2];
+
+    va_list list;
+    va_start(list, format);
+    vsnprintf(arguments, sizeof(arguments), format, list);
+    va_end(list);
+    snprintf(command, sizeof(command), "cd '%s' && '%s' %s 2>&1", directory, converter, arguments);
+
+    FILE *pipe = popen(command, "r");
+    assert(pipe != NULL);
+    size_t size = fread(output, sizeof(char), sizeof(output) - 1, pipe);
+    output[size] = '\0';
+    pclose(pipe);
+    return output;
+}
+
+/*
+ * Check that no temporary file is left behind in a directory of the test directory.
+ */
+static void assert_no_temporary_files(const char *name) {
+    char path[TEST_COMMAND_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    DIR *stream = opendir(path);
+    assert(stream != NULL);
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        assert(length < 4 || strcmp(entry->d_name + length - 4, ".tmp") != STRINGS_ARE_EQUAL);
+    }
+    closedir(stream);
+}
+
+/*
+ * Incremental mode must skip unchanged kernels, whatever the order of the batch, and convert them again once their
+ * contents or the options change. Outputs in different directories are recorded in their own directory's cache.
+ */
+static void test_incremental(void) {
+    static const char first_kernel[] = "__kernel void first(__global int *a) {\n\n    a[0] = 1;\n}\n";
+    static const char second_kernel[] = "__kernel void second(__global int *a) {\n    a[0] = 2;\n}\n";
+    static const char changed_kernel[] = "__kernel void first(__global int *a) {\n\n    a[0] = 3;\n}\n";
+    static const char manifest[] = "first.cl incremental_a/first.txt\nsecond.cl incremental_b/second.txt\n";
+    static const char reordered_manifest[] = "second.cl incremental_b/second.txt\nfirst.cl incremental_a/first.txt\n";
+
+    write_file("first.cl", first_kernel, sizeof(first_kernel) - 1);
+    write_file("second.cl", second_kernel, sizeof(second_kernel) - 1);
+    write_file("incremental.manifest", manifest, sizeof(manifest) - 1);
+    write_file("reordered.manifest", reordered_manifest, sizeof(reordered_manifest) - 1);
+    assert(mkdir("incremental_a", 0755) == 0 || file_exists("incremental_a"));
+    assert(mkdir("incremental_b", 0755) == 0 || file_exists("incremental_b"));
+
+    assert(strstr(run_converter("-a -i -m incremental.manifest"), "2 kernels converted, 0 up to date") != NULL);
+    assert(file_exists("incremental_a/.kernel_helper_cache"));
+    assert(file_exists("incremental_b/.kernel_helper_cache"));
+    assert_no_temporary_files("incremental_a");
+    assert_no_temporary_files("incremental_b");
+
+    assert(strstr(run_converter("-a -i -m incremental.manifest"), "0 kernels converted, 2 up to date") != NULL);
+    assert(strstr(run_converter("-a -i -m reordered.manifest"), "0 kernels converted, 2 up to date") != NULL);
+
+    write_file("first.cl", changed_kernel, sizeof(changed_kernel) - 1);
+    assert(strstr(run_converter("-a -i -m incremental.manifest"), "1 kernels converted, 1 up to date") != NULL);
+
+    // Outputs that are converted again to the same bytes are reported as up to date, as they are left untouched
+    assert(strstr(run_converter("-a -i -b -m incremental.manifest"), "1 kernels converted, 1 up to date") != NULL);
+    assert(strstr(run_converter("-a -i -b -F bytes -m incremental.manifest"), "2 kernels converted, 0 up to date") != NULL);
+    assert(strstr(run_converter("-a -i -b -F bytes -m incremental.manifest"), "0 kernels converted, 2 up to date") != NULL);
+}
+
+/*
+ * Headers with an include guard or #pragma once must be inlined once, inside #line markers, while includes in block
+ * comments and #if 0 blocks, and headers that are not found, are left as they are. The depfile lists every header.
+ */
+static void test_include_inlining(void) {
+    static const char guarded_header[] = "#ifndef GUARDED_H\n#define GUARDED_H\nint guarded_value;\n#endif\n";
+    static const char once_header[] = "#pragma once\nint once_value;";
+    static const char kernel[] = "#include \"headers/guarded.h\"\n"
+                                 "/* #include \"commented.h\"\n"
+                                 "   #include \"commented.h\" */\n"
+                                 "#if 0\n"
+                                 "#include \"disabled.h\"\n"
+                                 "#endif\n"
+                                 "#include \"once.h\"\n"
+                                 "#include \"headers/guarded.h\"\n"
+                                 "#include \"once.h\"\n"
+                                 "#include \"missing.h\"\n"
+                                 "\n"
+                                 "__kernel void inlined(void) {}\n";
+
+    assert(mkdir("headers", 0755) == 0 || file_exists("headers"));
+    write_file("headers/guarded.h", guarded_header, sizeof(guarded_header) - 1);
+    write_file("once.h", once_header, sizeof(once_header) - 1);
+    write_file("inlined.cl", kernel, sizeof(kernel) - 1);
+
+    const char *output = run_converter("-a -x -MD -f inlined.cl -o inlined.txt");
+    assert(strstr(output, "Warning: inlined.cl: header \"missing.h\" was not found") != NULL);
+
+    size_t size;
+    char *converted = read_file("inlined.txt", &size);
+    assert(count_occurrences(converted, "int guarded_value;") == 1);
+    assert(count_occurrences(converted, "int once_value;") == 1);
+    assert(count_occurrences(converted, "#pragma once") == 0);
+    assert(count_occurrences(converted, "#include \\\"commented.h\\\"") == 2);
+    assert(count_occurrences(converted, "#include \\\"disabled.h\\\"") == 1);
+    assert(count_occurrences(converted, "#include \\\"missing.h\\\"") == 1);
+
+    // Every line after a header has its own number again, and blank lines are kept so the numbers hold
+    assert(strstr(converted, "#line 1 \\\"headers/guarded.h\\\"") != NULL);
+    assert(strstr(converted, "#line 2 \\\"inlined.cl\\\"") != NULL);
+    assert(strstr(converted, "#line 1 \\\"once.h\\\"") != NULL);
+    assert(strstr(converted, "#line 8 \\\"inlined.cl\\\"") != NULL);
+    const char *kernel_line = strstr(converted, "#line 8 \\\"inlined.cl\\\"");
+    assert(count_occurrences(kernel_line, "\\n\"") == 6);
+    free(converted);
+
+    static const char depfile_target[] = "inlined.txt: inlined.cl \\\n";
+    char *depfile = read_file("inlined.txt.d", &size);
+    assert(strncmp(depfile, depfile_target, sizeof(depfile_target) - 1) == STRINGS_ARE_EQUAL);
+    assert(count_occurrences(depfile, "/headers/guarded.h") == 1);
+    assert(count_occurrences(depfile, "/once.h") == 1);
+    assert(count_occurrences(depfile, "missing.h") == 0);
+    free(depfile);
+}
+
+/*
+ * Variants keep the blank lines left by resolved directives, even without -b, so every line keeps its number.
+ */
+static void test_specialized_lines(void) {
+    static const char kernel[] = "#if WG == 64\n"
+                                 "#define SIZE 1\n"
+                                 "#else\n"
+                                 "#define SIZE 2\n"
+                                 "#endif\n"
+                                 "\n"
+                                 "__kernel void specialized(__global int *a) { a[0] = SIZE; }\n";
+    write_file("specialized.cl", kernel, sizeof(kernel) - 1);
+
+    const char *output = run_converter("-a -P WG=64,128 -f specialized.cl -o specialized.txt");
+    assert(strstr(output, "2 kernels converted") != NULL);
+
+    size_t size;
+    char *converted = read_file("specialized_WG_64.txt", &size);
+    const char *kernel_start = strstr(converted, "#line 1");
+    assert(kernel_start != NULL);
+    assert(count_occurrences(kernel_start, "\\n\"") == 1 + 7);
+    assert(strstr(kernel_start, "#define SIZE 1") != NULL && strstr(kernel_start, "#define SIZE 2") == NULL);
+    free(converted);
+}
+
+/*
+ * Minification reports the size of the kernel before and after it, and embeds the minified kernel.
+ */
+static void test_minify_report(void) {
+    static const char kernel[] = "// Comment\n__kernel void minified(__global int *a) {\n\n    a[0] = 1; /* one */\n}\n";
+    static const char minified[] = "__kernel void minified(__global int*a){\na[0]=1;\n}\n";
+    write_file("minified.cl", kernel, sizeof(kernel) - 1);
+
+    char report[TEST_COMMAND_SIZE];
+    snprintf(report, sizeof(report), "Minified minified.cl: %zu -> %zu bytes", sizeof(kernel) - 1,
+             sizeof(minified) - 1);
+    assert(strstr(run_converter("-a -M -F raw -f minified.cl -o minified.txt"), report) != NULL);
+
+    size_t size;
+    char *converted = read_file("minified.txt", &size);
+    assert(strstr(converted, minified) != NULL);
+    free(converted);
+}
+
+/*
+ * --stats=json reports the counters of the conversion as one JSON object, where the bytes written are the output's.
+ */
+static void test_stats_json(void) {
+    static const char kernel[] = "a\n\n  \nb = \"q\";\n";
+    write_file("stats.cl", kernel, sizeof(kernel) - 1);
+    const char *output = run_converter("-a --stats=json -f stats.cl -o stats.txt");
+
+    size_t size;
+    free(read_file("stats.txt", &size));
+    char expected[TEST_COMMAND_SIZE];
+    snprintf(expected, sizeof(expected), "{\"kernels\": 1, \"bytes_read\": %zu, \"bytes_written\": %zu, "
+             "\"lines_processed\": 4, \"blank_lines_skipped\": 2, \"context_allocations\": 2, ",
+             sizeof(kernel) - 1, size);
+    assert(strstr(output, expected) != NULL);
+    assert(strstr(output, "\"total_seconds\": ") != NULL && strstr(output, "}\n") != NULL);
+}
+
+/*
+ * Write a kernel past CHUNK_MIN_KERNEL_SIZE made of lines of every kind, with a line ending at the last byte of
+ * every chunk but the last, followed by a blank line, a CRLF blank line, a whitespace-only line and a CRLF line
+ * ending that straddles the boundary.
+ */
+static void write_chunked_kernel(const char *name, int use_crlf, int ends_with_newline) {
+    static const char *const lines[] = {
+        "__kernel void chunked(__global float *a) {", "", "    a[0] = \"quoted \\\" and \\\\ escaped\";",
+        " \t ", "    // comment", "}"
+    };
+    char *kernel = malloc(TEST_CHUNKED_SIZE);
+    size_t size = 0;
+
+    for (size_t i = 0; size < TEST_CHUNKED_SIZE; i = (i + 1) % (sizeof(lines) / sizeof(lines[0]))) {
+        size_t line_size = strlen(lines[i]);
+        size_t copied = line_size < TEST_CHUNKED_SIZE - size ? line_size : TEST_CHUNKED_SIZE - size;
+        memcpy(kernel + size, lines[i], copied);
+        size += copied;
+        if (use_crlf && size < TEST_CHUNKED_SIZE) {
+            kernel[size++] = '\r';
+        }
+        if (size < TEST_CHUNKED_SIZE) {
+            kernel[size++] = '\n';
+        }
+    }
+
+    static const char *const boundaries[] = { "\n\n", "\r\n\r\n", "\n \t \n", "\r\n" };
+    for (size_t i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]); i++) {
+        // The newline that ends the chunk lands on its last byte
+        size_t newline = (i + 1) * TEST_CHUNK_SIZE - 1;
+        size_t offset = boundaries[i][0] == '\r' ? newline - 1 : newline;
+        memcpy(kernel + offset, boundaries[i], strlen(boundaries[i]));
+    }
+
+    kernel[TEST_CHUNKED_SIZE - 1] = ends_with_newline ? '\n' : ';';
+    write_file(name, kernel, TEST_CHUNKED_SIZE);
+    free(kernel);
+}
+
+/*
+ * A kernel split into chunks between threads must be converted to the same bytes as by a single thread, with and
+ * without blank lines.
+ */
+static void test_chunked(void) {
+    static const struct {
+        const char *name;
+        int use_crlf;
+        int ends_with_newline;
+    } kernels[] = {
+        { "chunked_lf.cl", FALSE, FALSE }, { "chunked_crlf.cl", TRUE, TRUE }, { "chunked_crlf_open.cl", TRUE, FALSE }
+    };
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        write_chunked_kernel(kernels[i].name, kernels[i].use_crlf, kernels[i].ends_with_newline);
+
+        for (int use_blank_lines = FALSE; use_blank_lines <= TRUE; use_blank_lines++) {
+            const char *flags = use_blank_lines ? "-b" : "";
+            run_converter("-a %s -j 1 -f %s -o single.txt", flags, kernels[i].name);
+            run_converter("-a %s -j 4 -f %s -o chunked.txt", flags, kernels[i].name);
+            assert(file_exists("single.txt") && file_exists("chunked.txt"));
+            assert_same_files("single.txt", "chunked.txt");
+            remove("single.txt");
+            remove("chunked.txt");
+        }
+        remove(kernels[i].name);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    assert(argc == 2);
+    converter = argv[1];
+    assert(mkdtemp(directory) != NULL);
+    assert(chdir(directory) == 0);
+
+    test_incremental();
+    test_include_inlining();
+    test_specialized_lines();
+    test_minify_report();
+    test_stats_json();
+    test_chunked();
+
+    char command[TEST_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "rm -rf '%s'", directory);
+    assert(system(command) == 0);
+    return 0;
+}
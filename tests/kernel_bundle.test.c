@@ -0,0 +1,260 @@
+//
+// Tests of kernel bundles: writing, reopening and looking kernels up, and rejecting damaged bundles. Offsets follow
+// the layout described in kernel_bundle.c.
+//
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+
+#include "../include/kernel_helper.h"
+
+#define TEST_KERNEL_COUNT 100
+#define TEST_NAME_SIZE 32
+#define TEST_HEADER_SIZE 32
+#define TEST_SLOT_SIZE 4
+#define TEST_ENTRY_SIZE 40
+
+static char names[TEST_KERNEL_COUNT][TEST_NAME_SIZE];
+static char *sources[TEST_KERNEL_COUNT];
+static struct kernel_view kernels[TEST_KERNEL_COUNT];
+
+/*
+ * Read a little-endian 32-bit field of a bundle.
+ */
+static uint32_t read_u32(const unsigned char *source) {
+    return source[0] | (uint32_t)source[1] << 8 | (uint32_t)source[2] << 16 | (uint32_t)source[3] << 24;
+}
+
+/*
+ * Read a little-endian 64-bit field of a bundle.
+ */
+static uint64_t read_u64(const unsigned char *source) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = value << 8 | source[i];
+    }
+    return value;
+}
+
+/*
+ * Write a bundle of the first `kernel_count` test kernels into a newly allocated buffer.
+ */
+static unsigned char *write_bundle(size_t kernel_count, size_t *size) {
+    const char *kernel_names[TEST_KERNEL_COUNT];
+    for (size_t i = 0; i < kernel_count; i++) {
+        kernel_names[i] = names[i];
+    }
+
+    FILE *bundle_out = tmpfile();
+    assert(bundle_out != NULL);
+    assert(write_kernel_bundle(bundle_out, kernel_names, kernels, kernel_count));
+
+    *size = (size_t)ftell(bundle_out);
+    unsigned char *bundle = malloc(*size);
+    rewind(bundle_out);
+    assert(fread(bundle, sizeof(unsigned char), *size, bundle_out) == *size);
+    fclose(bundle_out);
+    return bundle;
+}
+
+/*
+ * Open a bundle held in memory, through a temporary file.
+ * Returns:
+ *      TRUE if the bundle was opened, FALSE otherwise
+ */
+static int open_bundle(const unsigned char *data, size_t size, struct kernel_bundle *bundle) {
+    FILE *bundle_file = tmpfile();
+    assert(bundle_file != NULL);
+    assert(fwrite(data, sizeof(unsigned char), size, bundle_file) == size);
+    rewind(bundle_file);
+
+    int opened = open_kernel_bundle(bundle_file, bundle);
+    fclose(bundle_file);
+    return opened;
+}
+
+/*
+ * Check that a copy of a bundle with one 32-bit field replaced is rejected.
+ */
+static void check_corrupt_u32(const unsigned char *data, size_t size, size_t offset, uint32_t value) {
+    unsigned char *corrupted = malloc(size);
+    memcpy(corrupted, data, size);
+    for (int i = 0; i < 4; i++) {
+        corrupted[offset + i] = (unsigned char)(value >> (8 * i));
+    }
+
+    struct kernel_bundle bundle;
+    assert(!open_bundle(corrupted, size, &bundle));
+    free(corrupted);
+}
+
+/*
+ * Check that a copy of a bundle with one 64-bit field replaced is rejected.
+ */
+static void check_corrupt_u64(const unsigned char *data, size_t size, size_t offset, uint64_t value) {
+    unsigned char *corrupted = malloc(size);
+    memcpy(corrupted, data, size);
+    for (int i = 0; i < 8; i++) {
+        corrupted[offset + i] = (unsigned char)(value >> (8 * i));
+    }
+
+    struct kernel_bundle bundle;
+    assert(!open_bundle(corrupted, size, &bundle));
+    free(corrupted);
+}
+
+/*
+ * Every kernel of a reopened bundle must be found by name, aligned, null-terminated and unchanged, while names that
+ * are not in the bundle are not found.
+ */
+static void test_round_trip(void) {
+    for (size_t kernel_count = 0; kernel_count <= TEST_KERNEL_COUNT; kernel_count += kernel_count < 4 ? 1 : 32) {
+        size_t size;
+        unsigned char *data = write_bundle(kernel_count, &size);
+        struct kernel_bundle bundle;
+        assert(open_bundle(data, size, &bundle));
+        assert(bundle.entry_count == kernel_count);
+        assert(check_kernel_bundle(&bundle));
+
+        for (size_t i = 0; i < kernel_count; i++) {
+            struct kernel_view view;
+            assert(find_bundle_kernel(&bundle, names[i], &view));
+            assert(view.size == kernels[i].size);
+            assert(memcmp(view.source, kernels[i].source, view.size) == 0);
+            assert(view.source[view.size] == '\0');
+            assert((size_t)(view.source - bundle.view.source) % KERNEL_ALIGNMENT == 0);
+        }
+
+        struct kernel_view view;
+        assert(!find_bundle_kernel(&bundle, "missing.cl", &view));
+        assert(!find_bundle_kernel(&bundle, "", &view));
+        assert(!find_bundle_kernel(&bundle, "kernel_1", &view));
+        assert(!find_bundle_kernel(&bundle, "kernel_1.cl.cl", &view));
+
+        close_kernel_bundle(&bundle);
+        free(data);
+    }
+
+    // Names must be unique
+    const char *duplicate_names[] = { names[0], names[1], names[0] };
+    FILE *bundle_out = tmpfile();
+    assert(!write_kernel_bundle(bundle_out, duplicate_names, kernels, 3));
+    fclose(bundle_out);
+}
+
+/*
+ * Truncated bundles, and bundles with a damaged header, slot or entry, must be rejected. A damaged kernel is only
+ * found by check_kernel_bundle().
+ */
+static void test_corrupt(void) {
+    const size_t kernel_count = 5;
+    size_t size;
+    unsigned char *data = write_bundle(kernel_count, &size);
+    struct kernel_bundle bundle;
+
+    for (size_t truncated_size = 0; truncated_size < size; truncated_size++) {
+        assert(!open_bundle(data, truncated_size, &bundle));
+    }
+
+    // Header: magic, version, entry count, slot count and bundle size
+    check_corrupt_u32(data, size, 0, 0x4B484B48);
+    check_corrupt_u32(data, size, 8, 2);
+    check_corrupt_u32(data, size, 12, (uint32_t)kernel_count + 1);
+    check_corrupt_u32(data, size, 12, UINT32_MAX);
+    check_corrupt_u32(data, size, 16, 8);
+    check_corrupt_u32(data, size, 16, UINT32_MAX);
+    check_corrupt_u64(data, size, 24, size + 1);
+
+    // Slots: an entry number out of range, an extra filled slot and an emptied slot
+    size_t slot_count = 16;
+    size_t filled_slot = 0;
+    size_t empty_slot = 0;
+    for (size_t i = 0; i < slot_count; i++) {
+        uint32_t value = read_u32(data + TEST_HEADER_SIZE + i * TEST_SLOT_SIZE);
+        *(value != 0 ? &filled_slot : &empty_slot) = i;
+    }
+    check_corrupt_u32(data, size, TEST_HEADER_SIZE + filled_slot * TEST_SLOT_SIZE, (uint32_t)kernel_count + 1);
+    check_corrupt_u32(data, size, TEST_HEADER_SIZE + empty_slot * TEST_SLOT_SIZE, 1);
+    check_corrupt_u32(data, size, TEST_HEADER_SIZE + filled_slot * TEST_SLOT_SIZE, 0);
+
+    // Entries: kernels and names that run past the bundle or lose their terminator
+    size_t entries_offset = TEST_HEADER_SIZE + slot_count * TEST_SLOT_SIZE;
+    for (size_t i = 0; i < kernel_count; i++) {
+        size_t entry = entries_offset + i * TEST_ENTRY_SIZE;
+        check_corrupt_u64(data, size, entry + 8, size);
+        check_corrupt_u64(data, size, entry + 8, UINT64_MAX - 4);
+        check_corrupt_u64(data, size, entry + 16, size);
+        check_corrupt_u64(data, size, entry + 16, UINT64_MAX);
+        check_corrupt_u32(data, size, entry + 32, (uint32_t)size);
+        check_corrupt_u32(data, size, entry + 32, UINT32_MAX);
+        check_corrupt_u32(data, size, entry + 36, (uint32_t)strlen(names[i]) - 1);
+        check_corrupt_u32(data, size, entry + 36, UINT32_MAX);
+    }
+
+    // Kernels and names must keep their terminators
+    unsigned char *corrupted = malloc(size);
+    for (size_t i = 0; i < kernel_count; i++) {
+        size_t entry = entries_offset + i * TEST_ENTRY_SIZE;
+        size_t terminators[] = { read_u64(data + entry + 8) + kernels[i].size,
+                                 read_u32(data + entry + 32) + strlen(names[i]) };
+        for (size_t j = 0; j < 2; j++) {
+            memcpy(corrupted, data, size);
+            assert(corrupted[terminators[j]] == '\0');
+            corrupted[terminators[j]] = 'x';
+            assert(!open_bundle(corrupted, size, &bundle));
+        }
+    }
+
+    // A damaged kernel still opens, but fails its checksum
+    assert(kernels[1].size > 0);
+    memcpy(corrupted, data, size);
+    corrupted[read_u64(data + entries_offset + TEST_ENTRY_SIZE + 8)] ^= 1;
+    assert(open_bundle(corrupted, size, &bundle));
+    assert(!check_kernel_bundle(&bundle));
+    close_kernel_bundle(&bundle);
+
+    // Any flipped bit in the index either is rejected or leaves lookups inside the bundle
+    for (size_t i = 0; i < entries_offset + kernel_count * TEST_ENTRY_SIZE; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            memcpy(corrupted, data, size);
+            corrupted[i] ^= (unsigned char)(1 << bit);
+            if (open_bundle(corrupted, size, &bundle)) {
+                struct kernel_view view;
+                for (size_t j = 0; j < kernel_count; j++) {
+                    find_bundle_kernel(&bundle, names[j], &view);
+                }
+                check_kernel_bundle(&bundle);
+                close_kernel_bundle(&bundle);
+            }
+        }
+    }
+
+    free(corrupted);
+    free(data);
+}
+
+int main(void) {
+    srand(1);
+
+    // Kernels of every size around the alignment, including empty ones
+    for (size_t i = 0; i < TEST_KERNEL_COUNT; i++) {
+        snprintf(names[i], TEST_NAME_SIZE, "kernel_%zu.cl", i);
+        size_t size = i % 3 == 0 ? i % (KERNEL_ALIGNMENT * 2) : (size_t)(rand() % 4096);
+        sources[i] = malloc(size + 1);
+        for (size_t j = 0; j < size; j++) {
+            sources[i][j] = (char)('a' + rand() % 26);
+        }
+        sources[i][size] = '\0';
+        kernels[i].source = sources[i];
+        kernels[i].size = size;
+        kernels[i].is_mapped = FALSE;
+    }
+
+    test_round_trip();
+    test_corrupt();
+
+    for (size_t i = 0; i < TEST_KERNEL_COUNT; i++) {
+        free(sources[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+//
+// Tests of compress_kernel() and decompress_kernel(). Buffers are allocated at their exact sizes, so reads or writes
+// out of bounds are caught when running under AddressSanitizer.
+//
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+
+#include "../include/kernel_helper.h"
+
+#define TEST_RANDOM_SIZE 100000
+#define TEST_RUN_SIZE 1000000
+#define TEST_SMALL_SIZE 600
+
+/*
+ * Compress a kernel into a buffer of exactly COMPRESS_BOUND(size) bytes, then check that it decompresses back into
+ * a buffer of exactly its size, and not into a buffer of any other size.
+ * Returns:
+ *      the size of the compressed kernel in bytes
+ */
+static size_t check_round_trip(const char *source, size_t size) {
+    unsigned char *compressed = malloc(COMPRESS_BOUND(size));
+    size_t compressed_size = compress_kernel(source, size, compressed);
+    assert(compressed_size > 0 && compressed_size <= COMPRESS_BOUND(size));
+
+    char *kernel = malloc(size > 0 ? size : 1);
+    assert(decompress_kernel(compressed, compressed_size, kernel, size));
+    assert(memcmp(kernel, source, size) == 0);
+    assert(!decompress_kernel(compressed, compressed_size, kernel, size + 1));
+    if (size > 0) {
+        assert(!decompress_kernel(compressed, compressed_size, kernel, size - 1));
+    }
+
+    free(kernel);
+    free(compressed);
+    return compressed_size;
+}
+
+/*
+ * Check that a hand-written compressed kernel is decompressed as expected, or rejected if `expected` is NULL.
+ */
+static void check_decompress(const unsigned char *compressed, size_t compressed_size, const char *expected,
+                             size_t kernel_size) {
+    // Copied to the heap so a read past the end is caught
+    unsigned char *input = malloc(compressed_size > 0 ? compressed_size : 1);
+    memcpy(input, compressed, compressed_size);
+    char *kernel = malloc(kernel_size > 0 ? kernel_size : 1);
+
+    int decompressed = decompress_kernel(input, compressed_size, kernel, kernel_size);
+    assert(decompressed == (expected != NULL));
+    assert(expected == NULL || memcmp(kernel, expected, kernel_size) == 0);
+
+    free(kernel);
+    free(input);
+}
+
+/*
+ * Empty kernels, kernels that do not compress and kernels of every small size must come back unchanged, within
+ * COMPRESS_BOUND even when nothing compresses.
+ */
+static void test_round_trip(void) {
+    char *source = malloc(TEST_RANDOM_SIZE);
+    for (size_t i = 0; i < TEST_RANDOM_SIZE; i++) {
+        source[i] = (char)(rand() & 0xFF);
+    }
+
+    check_round_trip("", 0);
+    check_round_trip(source, TEST_RANDOM_SIZE);
+    for (size_t size = 1; size < TEST_SMALL_SIZE; size++) {
+        check_round_trip(source + size, size);
+    }
+
+    const char kernel[] = "__kernel void add(__global const float *a, __global const float *b, __global float *c) {\n"
+                          "    int i = get_global_id(0);\n"
+                          "    c[i] = a[i] + b[i];\n"
+                          "}\n";
+    assert(check_round_trip(kernel, sizeof(kernel) - 1) < sizeof(kernel) - 1);
+    free(source);
+}
+
+/*
+ * Long runs and short repeating patterns exercise long lengths and matches that overlap their own output, with
+ * offsets below, at and above the copy block sizes.
+ */
+static void test_runs(void) {
+    char *source = malloc(TEST_RUN_SIZE);
+
+    memset(source, 'a', TEST_RUN_SIZE);
+    assert(check_round_trip(source, TEST_RUN_SIZE) < TEST_RUN_SIZE / 100);
+
+    for (size_t period = 1; period <= 20; period++) {
+        for (size_t i = 0; i < TEST_RUN_SIZE; i++) {
+            source[i] = (char)('a' + i % period);
+        }
+        check_round_trip(source, TEST_RUN_SIZE);
+        // Lengths around the 255-byte continuations
+        for (size_t size = 250; size < 275; size++) {
+            check_round_trip(source, size);
+        }
+    }
+
+    free(source);
+}
+
+/*
+ * Truncated, corrupted and malformed compressed kernels must be rejected, without reading or writing out of bounds.
+ */
+static void test_corrupt(void) {
+    static const unsigned char empty[] = { 0x00 };
+    static const unsigned char literal[] = { 0x10, 'a' };
+    static const unsigned char run[] = { 0x10, 'a', 0x01, 0x00, 0x00 };
+
+    check_decompress(empty, sizeof(empty), "", 0);
+    check_decompress(literal, sizeof(literal), "a", 1);
+    check_decompress(run, sizeof(run), "aaaaa", 5);
+
+    // Missing sequences, or a final sequence cut right after a match
+    check_decompress(empty, 0, NULL, 0);
+    check_decompress(run, sizeof(run) - 1, NULL, 5);
+
+    static const unsigned char long_literal[] = { 0x20, 'a' };
+    static const unsigned char zero_offset[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    static const unsigned char far_offset[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+    static const unsigned char cut_offset[] = { 0x10, 'a', 0x01 };
+    static const unsigned char cut_length[] = { 0xF0 };
+    static const unsigned char cut_continuation[] = { 0xF0, 0xFF };
+    static const unsigned char long_match[] = { 0x1F, 'a', 0x01, 0x00, 0xFF, 0xFF, 0x00, 0x00 };
+    check_decompress(long_literal, sizeof(long_literal), NULL, 2);
+    check_decompress(zero_offset, sizeof(zero_offset), NULL, 5);
+    check_decompress(far_offset, sizeof(far_offset), NULL, 5);
+    check_decompress(cut_offset, sizeof(cut_offset), NULL, 5);
+    check_decompress(cut_length, sizeof(cut_length), NULL, 15);
+    check_decompress(cut_continuation, sizeof(cut_continuation), NULL, 270);
+    check_decompress(long_match, sizeof(long_match), NULL, 64);
+    check_decompress(run, sizeof(run), NULL, 4);
+
+    // Every prefix of a real compressed kernel is rejected, and flipped bytes never break out of the buffers
+    char source[TEST_SMALL_SIZE];
+    for (size_t i = 0; i < sizeof(source); i++) {
+        source[i] = "__kernel void k() { int i = get_global_id(0); }\n"[i % 49];
+    }
+    unsigned char compressed[COMPRESS_BOUND(TEST_SMALL_SIZE)];
+    size_t compressed_size = compress_kernel(source, sizeof(source), compressed);
+    for (size_t size = 0; size < compressed_size; size++) {
+        check_decompress(compressed, size, NULL, sizeof(source));
+    }
+
+    unsigned char *corrupted = malloc(compressed_size);
+    char *kernel = malloc(sizeof(source));
+    for (size_t i = 0; i < compressed_size; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            memcpy(corrupted, compressed, compressed_size);
+            corrupted[i] ^= (unsigned char)(1 << bit);
+            decompress_kernel(corrupted, compressed_size, kernel, sizeof(source));
+        }
+    }
+    free(kernel);
+    free(corrupted);
+}
+
+int main(void) {
+    srand(1);
+
+    test_round_trip();
+    test_runs();
+    test_corrupt();
+
+    return 0;
+}
@@ -1,3 +1,533 @@
 //
 // Created by Joshua Riefman on 2023-07-22.
 //
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+
+#include <unistd.h>
+
+#include "../include/kernel_helper.h"
+#include "../include/kernel_scan.h"
+
+#define TEST_BUFFER_SIZE 256
+#define TEST_ITERATIONS 20000
+#define TEST_CONVERT_ITERATIONS 500
+#define TEST_CANARY_SIZE 64
+#define TEST_CANARY 0x5a
+
+/*
+ * Fill a buffer with characters that are interesting to the scanners, so matches land at every position.
+ */
+static void fill_random(char *buffer, size_t size) {
+    static const char alphabet[] = { ' ', '\t', '\n', '\v', '\f', '\r', '"', '\\', 'a', '{', '\x08', '\x0e', '\xff', '\x89' };
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = alphabet[rand() % sizeof(alphabet)];
+    }
+}
+
+/*
+ * Differential test: every scanner supported by the running CPU must agree with the scalar scanner.
+ */
+static void test_scanners_agree(void) {
+    const struct scanner *scalar = get_scanner(SCAN_ISA_SCALAR);
+    const struct scanner *scanners[] = { get_scanner(SCAN_ISA_SSE2), get_scanner(SCAN_ISA_AVX2) };
+    char buffer[TEST_BUFFER_SIZE];
+
+    for (int iteration = 0; iteration < TEST_ITERATIONS; iteration++) {
+        fill_random(buffer, TEST_BUFFER_SIZE);
+        // Sparse inputs exercise the full-vector loops, dense inputs exercise matches near the start
+        if (iteration % 2 == 0) {
+            memset(buffer, iteration % 4 == 0 ? ' ' : 'a', rand() % TEST_BUFFER_SIZE);
+        }
+
+        size_t offset = rand() % 32;
+        size_t size = rand() % (TEST_BUFFER_SIZE - offset);
+        const char *string = buffer + offset;
+
+        for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+            if (scanners[i] == NULL) {
+                continue;
+            }
+            assert(scanners[i]->find_newline(string, size) == scalar->find_newline(string, size));
+            assert(scanners[i]->find_escape(string, size) == scalar->find_escape(string, size));
+            assert(scanners[i]->is_blank(string, size) == scalar->is_blank(string, size));
+        }
+    }
+}
+
+/*
+ * process_line must wrap the line and escape quotes and backslashes.
+ */
+static void test_process_line(void) {
+    const char line[] = "printf(\"%d\\n\", i);";
+    char *processed = process_line(line, strlen(line));
+
+    assert(strcmp(processed, "\"printf(\\\"%d\\\\n\\\", i); \\n\"\n") == STRINGS_ARE_EQUAL);
+    free(processed);
+}
+
+/*
+ * get_length must find the newline, and report a line without one within max_length instead of exiting.
+ */
+static void test_get_length(void) {
+    const char line[] = "int i;\nint j;";
+
+    assert(get_length(line, sizeof(line) - 1) == 6);
+    assert(get_length(line, 6) == 6);
+    assert(get_length(line + 7, sizeof(line) - 8) == sizeof(line) - 8);
+}
+
+/*
+ * Check that map_kernel() loads a stream with the expected contents, and whether it was mapped.
+ */
+static void check_mapped_kernel(FILE *kernel, const char *expected, size_t expected_size, int expect_mapped) {
+    struct kernel_view view;
+
+    assert(map_kernel(kernel, &view));
+    assert(view.size == expected_size);
+    assert(memcmp(view.source, expected, expected_size) == 0);
+    assert(view.is_mapped == expect_mapped);
+
+    release_kernel(&view);
+    assert(view.source == NULL && view.size == 0 && !view.is_mapped);
+}
+
+/*
+ * map_kernel must map regular files, and fall back to reading streams that cannot be mapped.
+ */
+static void test_map_kernel(void) {
+    static const char kernel[] = "__kernel void example(__global float *output) {\n    output[0] = 1.0f;\n}\n";
+    size_t size = sizeof(kernel) - 1;
+
+    // A regular file is mapped
+    FILE *file = tmpfile();
+    assert(file != NULL && fwrite(kernel, sizeof(char), size, file) == size && fflush(file) == 0);
+    rewind(file);
+    check_mapped_kernel(file, kernel, size, TRUE);
+    fclose(file);
+
+    // An empty file cannot be mapped, and is read as an empty kernel
+    file = tmpfile();
+    assert(file != NULL);
+    check_mapped_kernel(file, "", 0, FALSE);
+    fclose(file);
+
+    // A memory stream has no file descriptor
+    FILE *memory = fmemopen((void *)kernel, size, "r");
+    assert(memory != NULL);
+    check_mapped_kernel(memory, kernel, size, FALSE);
+    fclose(memory);
+
+    // A pipe has no size, and is read until its end
+    int descriptors[2];
+    assert(pipe(descriptors) == 0);
+    assert(write(descriptors[1], kernel, size) == (ssize_t)size);
+    close(descriptors[1]);
+    FILE *pipe_in = fdopen(descriptors[0], "r");
+    assert(pipe_in != NULL);
+    check_mapped_kernel(pipe_in, kernel, size, FALSE);
+    fclose(pipe_in);
+}
+
+/*
+ * Convert a kernel with kh_process_kernel(), through temporary files.
+ */
+static char *process_with_files(struct kh_context *context, const char *source, size_t size, size_t *output_size) {
+    FILE *kernel = tmpfile();
+    FILE *kernel_out = tmpfile();
+    assert(kernel != NULL && kernel_out != NULL);
+    assert(fwrite(source, sizeof(char), size, kernel) == size);
+    rewind(kernel);
+
+    assert(kh_process_kernel(context, kernel, kernel_out));
+    *output_size = (size_t)ftell(kernel_out);
+    char *output = malloc(*output_size + 1);
+    rewind(kernel_out);
+    assert(fread(output, sizeof(char), *output_size, kernel_out) == *output_size);
+
+    fclose(kernel);
+    fclose(kernel_out);
+    return output;
+}
+
+/*
+ * kh_convert_buffer() into a buffer that is too small must fail, report the size needed and leave every byte past
+ * output_capacity untouched.
+ */
+static void check_too_small(struct kh_context *context, const char *source, size_t size, size_t converted_size,
+                            size_t output_capacity) {
+    char *output = malloc(output_capacity + TEST_CANARY_SIZE);
+    memset(output, TEST_CANARY, output_capacity + TEST_CANARY_SIZE);
+    size_t output_size = 0;
+
+    assert(!kh_convert_buffer(context, source, size, output, output_capacity, &output_size));
+    assert(kh_get_error(context) != NULL);
+    assert(output_size == converted_size);
+    for (size_t i = output_capacity; i < output_capacity + TEST_CANARY_SIZE; i++) {
+        assert(output[i] == TEST_CANARY);
+    }
+    free(output);
+}
+
+/*
+ * Check the in-memory conversion of one kernel against kh_process_kernel(): kh_converted_size() must be the number
+ * of bytes kh_convert_buffer() writes, and both in-memory interfaces must produce the same bytes as the file one.
+ */
+static void check_convert_buffer(struct kh_context *context, const char *source, size_t size) {
+    size_t expected_size;
+    char *expected = process_with_files(context, source, size, &expected_size);
+    size_t converted_size = kh_converted_size(context, source, size);
+    assert(converted_size == expected_size);
+
+    char *output = malloc(converted_size + TEST_CANARY_SIZE);
+    memset(output, TEST_CANARY, converted_size + TEST_CANARY_SIZE);
+    size_t output_size = 0;
+    assert(kh_convert_buffer(context, source, size, output, converted_size, &output_size));
+    assert(output_size == converted_size);
+    assert(memcmp(output, expected, expected_size) == 0);
+    assert(output[converted_size] == TEST_CANARY);
+    free(output);
+
+    char *allocated = kh_convert_alloc(context, source, size, &output_size);
+    assert(allocated != NULL);
+    assert(output_size == converted_size);
+    assert(memcmp(allocated, expected, expected_size) == 0);
+    assert(allocated[output_size] == '\0');
+    free(allocated);
+
+    // Every capacity is tried on small kernels, and a few around the needed size on larger ones
+    if (converted_size < TEST_BUFFER_SIZE) {
+        for (size_t capacity = 0; capacity < converted_size; capacity++) {
+            check_too_small(context, source, size, converted_size, capacity);
+        }
+    } else {
+        check_too_small(context, source, size, converted_size, 0);
+        check_too_small(context, source, size, converted_size, converted_size / 2);
+        check_too_small(context, source, size, converted_size, converted_size - 1);
+    }
+    free(expected);
+}
+
+/*
+ * The in-memory interfaces must agree with kh_process_kernel(), with and without blank lines, on edge cases (empty
+ * kernels, missing final newlines, CRLF line endings, escapes) and on random kernels.
+ */
+static void test_convert_buffer(void) {
+    static const char *const kernels[] = {
+        "", "a", "a\n", "\n", "\n\n\n", " \t \n", "\"\\\"\\\\\n", "x = \"\\n\";\r\n\r\ny = 1;\r\n",
+        "__kernel void k(__global int *a) {\n\n    a[0] = 1; // \"quoted\"\n}",
+    };
+    char buffer[TEST_BUFFER_SIZE * 8];
+    struct kh_context context;
+    kh_init_context(&context);
+
+    for (int use_blank_lines = FALSE; use_blank_lines <= TRUE; use_blank_lines++) {
+        context.use_blank_lines = use_blank_lines;
+
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+            check_convert_buffer(&context, kernels[i], strlen(kernels[i]));
+        }
+        for (int iteration = 0; iteration < TEST_CONVERT_ITERATIONS; iteration++) {
+            size_t size = rand() % sizeof(buffer);
+            fill_random(buffer, size);
+            check_convert_buffer(&context, buffer, size);
+        }
+    }
+
+    kh_free_context(&context);
+}
+
+/*
+ * Convert a kernel with kh_process_kernel_raw() after a line of other output, and return everything written. A
+ * temporary file as the input is copied inside the kernel (with copy_file_range() into a file, or sendfile() into a
+ * pipe), while a memory stream has no file descriptor and is written from user space.
+ */
+static char *process_raw(const char *source, size_t size, int use_file, int use_pipe, size_t *output_size) {
+    static const char preamble[] = "// Preamble\n";
+    FILE *kernel = use_file ? tmpfile() : fmemopen((void *)source, size, "r");
+    assert(kernel != NULL);
+    if (use_file) {
+        assert(fwrite(source, sizeof(char), size, kernel) == size && fflush(kernel) == 0);
+        rewind(kernel);
+    }
+    int descriptors[2];
+    FILE *kernel_out = tmpfile();
+    if (use_pipe) {
+        fclose(kernel_out);
+        assert(pipe(descriptors) == 0);
+        kernel_out = fdopen(descriptors[1], "w");
+    }
+    assert(kernel_out != NULL);
+    fputs(preamble, kernel_out);
+
+    struct kh_context context;
+    kh_init_context(&context);
+    int converted = kh_process_kernel_raw(&context, kernel, kernel_out);
+    assert(converted == (kh_get_error(&context) == NULL));
+    kh_free_context(&context);
+
+    // The pipe is small, so the kernels given with use_pipe must fit in it
+    char *output = malloc(size + TEST_BUFFER_SIZE);
+    if (use_pipe) {
+        fclose(kernel_out);
+        ssize_t read_size;
+        *output_size = 0;
+        while ((read_size = read(descriptors[0], output + *output_size, size + TEST_BUFFER_SIZE - *output_size)) > 0) {
+            *output_size += (size_t)read_size;
+        }
+        close(descriptors[0]);
+    } else {
+        *output_size = (size_t)ftello(kernel_out);
+        rewind(kernel_out);
+        assert(fread(output, sizeof(char), *output_size, kernel_out) == *output_size);
+        fclose(kernel_out);
+    }
+    fclose(kernel);
+
+    assert(*output_size >= sizeof(preamble) - 1 && memcmp(output, preamble, sizeof(preamble) - 1) == 0);
+    if (!converted) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+/*
+ * Check that a kernel is converted into a raw literal closed by `delimiter`, through every path, or that it is
+ * rejected if `delimiter` is NULL.
+ */
+static void check_raw(const char *source, const char *delimiter) {
+    size_t size = strlen(source);
+    char expected[TEST_BUFFER_SIZE * 2];
+    if (delimiter != NULL) {
+        snprintf(expected, sizeof(expected), "// Preamble\nR\"%s(%s)%s\"\n", delimiter, source, delimiter);
+    }
+
+    for (int use_file = FALSE; use_file <= TRUE; use_file++) {
+        for (int use_pipe = FALSE; use_pipe <= TRUE; use_pipe++) {
+            size_t output_size;
+            char *output = process_raw(source, size, use_file, use_pipe, &output_size);
+            assert((output == NULL) == (delimiter == NULL));
+            if (output != NULL) {
+                assert(output_size == strlen(expected) && memcmp(output, expected, output_size) == 0);
+            }
+            free(output);
+        }
+    }
+}
+
+/*
+ * Raw literals take the lowest free delimiter, where candidates with leading zeros or past RAW_DELIMITER_COUNT
+ * never count as taken, and kernels that take every delimiter or hold a carriage return are rejected.
+ */
+static void test_raw(void) {
+    check_raw("__kernel void k(__global int *a) {\n\n    a[0] = 1;\n}\n", "kh");
+    check_raw("x = \")kh\";", "kh1");
+    check_raw(")kh\")kh1\")kh3\"", "kh2");
+    check_raw(")kh\" )kh2\"", "kh1");
+    check_raw(")kh0\" )kh01\" )kh64\" )kh100\" )kh\n\" )kh", "kh");
+    check_raw("a)kh\"", "kh1");
+    check_raw("a\r\nb\n", NULL);
+    check_raw("a\rb", NULL);
+
+    // Every delimiter but the last, then every one
+    char kernel[TEST_BUFFER_SIZE * 2] = ")kh\"";
+    for (int number = 1; number < RAW_DELIMITER_COUNT - 1; number++) {
+        snprintf(kernel + strlen(kernel), sizeof(kernel) - strlen(kernel), ")kh%d\"", number);
+    }
+    check_raw(kernel, "kh63");
+    strcat(kernel, ")kh63\"");
+    check_raw(kernel, NULL);
+
+    // A large kernel is copied whole
+    size_t size = 1 << 20;
+    char *large = malloc(size + 1);
+    for (size_t i = 0; i < size; i++) {
+        large[i] = (char)('a' + i % 26);
+    }
+    large[size] = '\0';
+    size_t output_size;
+    char *output = process_raw(large, size, TRUE, FALSE, &output_size);
+    assert(output_size == sizeof("// Preamble\nR\"kh()kh\"\n") - 1 + size);
+    assert(memcmp(output + sizeof("// Preamble\nR\"kh(") - 1, large, size) == 0);
+    free(output);
+    free(large);
+}
+
+/*
+ * Read everything written to a temporary file, as a null-terminated string, and close it.
+ */
+static char *read_and_close(FILE *file) {
+    size_t size = (size_t)ftello(file);
+    char *contents = malloc(size + 1);
+    rewind(file);
+    assert(fread(contents, sizeof(char), size, file) == size);
+    contents[size] = '\0';
+    fclose(file);
+    return contents;
+}
+
+/*
+ * The bytes format writes every byte of the kernel in hex, BYTES_PER_LINE to a line, followed by a terminator that
+ * the size leaves out.
+ */
+static void test_bytes(void) {
+    static const char kernel[] = "abcdefghijklmnopqrstuvwxyz012345\xff\n";
+    static const char expected[] =
+        "// Generated by kernel_helper, do not edit\n"
+        "#include <stddef.h>\n"
+        "static const unsigned char example[] = {\n"
+        "0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,0x70,"
+        "0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x30,0x31,0x32,0x33,0x34,0x35,\n"
+        "0xff,0x0a,0x00\n"
+        "};\n"
+        "static const size_t example_size = 34;\n";
+    FILE *kernel_in = fmemopen((void *)kernel, sizeof(kernel) - 1, "r");
+    FILE *kernel_out = tmpfile();
+    assert(kernel_in != NULL && kernel_out != NULL);
+
+    process_kernel_bytes(kernel_in, kernel_out, "example");
+    fclose(kernel_in);
+    char *output = read_and_close(kernel_out);
+    assert(strcmp(output, expected) == STRINGS_ARE_EQUAL);
+    free(output);
+
+    // An empty kernel is only its terminator
+    kernel_in = tmpfile();
+    kernel_out = tmpfile();
+    assert(kernel_in != NULL && kernel_out != NULL);
+    process_kernel_bytes(kernel_in, kernel_out, "empty");
+    fclose(kernel_in);
+    output = read_and_close(kernel_out);
+    assert(strstr(output, "static const unsigned char empty[] = {\n0x00\n};\n") != NULL);
+    assert(strstr(output, "static const size_t empty_size = 0;\n") != NULL);
+    free(output);
+}
+
+/*
+ * The incbin format exports the kernel as an aligned, null-terminated symbol and its size as another, and escapes
+ * the path the assembler reads the kernel from.
+ */
+static void test_incbin(void) {
+    FILE *kernel_out = tmpfile();
+    assert(kernel_out != NULL);
+    process_kernel_incbin("/kernels/a \"quoted\" \\ path.cl", kernel_out, "example");
+    char *output = read_and_close(kernel_out);
+
+    char alignment[TEST_BUFFER_SIZE];
+    snprintf(alignment, sizeof(alignment), "    .globl KERNEL_SYMBOL(example)\n"
+                                           "    .balign %d\n"
+                                           "KERNEL_SYMBOL(example):\n"
+                                           "    .incbin \"/kernels/a \\\"quoted\\\" \\\\ path.cl\"\n"
+                                           "KERNEL_SYMBOL(example_end):\n"
+                                           "    .byte 0\n", KERNEL_ALIGNMENT);
+    assert(strstr(output, alignment) != NULL);
+    assert(strstr(output, "    .globl KERNEL_SYMBOL(example_size)\n"
+                          "    .balign __SIZEOF_POINTER__\n"
+                          "KERNEL_SYMBOL(example_size):\n"
+                          "    KERNEL_SIZE KERNEL_SYMBOL(example_end) - KERNEL_SYMBOL(example)\n") != NULL);
+    free(output);
+}
+
+// Allocator that counts the blocks it hands out and takes back
+struct counting_allocator {
+    uint64_t allocations;
+    uint64_t releases;
+};
+
+static void *count_allocate(void *user_data, size_t size) {
+    ((struct counting_allocator *)user_data)->allocations++;
+    return malloc(size);
+}
+
+static void count_release(void *user_data, void *pointer, size_t size) {
+    (void)size;
+    ((struct counting_allocator *)user_data)->releases++;
+    free(pointer);
+}
+
+/*
+ * Check the counters of a context after converting a kernel through temporary files with one of the formats.
+ */
+static void check_stats(struct kh_context *context, int format, const char *kernel, uint64_t lines,
+                        uint64_t blank_lines) {
+    size_t size = strlen(kernel);
+    FILE *kernel_in = tmpfile();
+    FILE *kernel_out = tmpfile();
+    assert(kernel_in != NULL && kernel_out != NULL);
+    assert(fwrite(kernel, sizeof(char), size, kernel_in) == size && fflush(kernel_in) == 0);
+    rewind(kernel_in);
+
+    kh_reset_stats(context);
+    int converted = format == 's' ? kh_process_kernel(context, kernel_in, kernel_out)
+                  : format == 'b' ? kh_process_kernel_bytes(context, kernel_in, kernel_out, "example")
+                                  : kh_process_kernel_raw(context, kernel_in, kernel_out);
+    assert(converted);
+    const struct kh_stats *stats = kh_get_stats(context);
+    assert(stats->bytes_read == size);
+    assert(stats->bytes_written == (uint64_t)ftello(kernel_out));
+    assert(stats->lines_processed == lines);
+    assert(stats->blank_lines_skipped == blank_lines);
+
+    fclose(kernel_in);
+    fclose(kernel_out);
+}
+
+/*
+ * The stats count the bytes read and written, the lines and skipped blank lines of the string format, and the
+ * allocations made through the context's allocator, which the buffers reused by every call only add once.
+ */
+static void test_stats(void) {
+    static const char kernel[] = "a\n\n  \nb = \"q\";\n";
+    struct counting_allocator counter = { 0, 0 };
+    struct kh_context context;
+    kh_init_context(&context);
+    context.allocator.allocate = count_allocate;
+    context.allocator.release = count_release;
+    context.allocator.user_data = &counter;
+
+    // The read and write buffers are allocated by the first call, and reused by the next ones
+    check_stats(&context, 's', kernel, 4, 2);
+    assert(kh_get_stats(&context)->allocations == 2 && counter.allocations == 2);
+    context.use_blank_lines = TRUE;
+    check_stats(&context, 's', kernel, 4, 0);
+    check_stats(&context, 'b', kernel, 0, 0);
+    check_stats(&context, 'r', kernel, 0, 0);
+    assert(kh_get_stats(&context)->allocations == 0 && counter.allocations == 2);
+
+    // The in-memory interface counts its output allocation, and nothing is written to a file
+    kh_reset_stats(&context);
+    size_t output_size;
+    char *output = kh_convert_alloc(&context, kernel, sizeof(kernel) - 1, &output_size);
+    assert(output != NULL);
+    const struct kh_stats *stats = kh_get_stats(&context);
+    assert(stats->bytes_read == sizeof(kernel) - 1 && stats->bytes_written == output_size);
+    assert(stats->lines_processed == 4 && stats->allocations == 1);
+    count_release(&counter, output, output_size + 1);
+
+    kh_reset_stats(&context);
+    stats = kh_get_stats(&context);
+    assert(stats->bytes_read == 0 && stats->bytes_written == 0 && stats->lines_processed == 0 &&
+           stats->blank_lines_skipped == 0 && stats->allocations == 0);
+
+    kh_free_context(&context);
+    assert(counter.releases == counter.allocations);
+}
+
+int main(void) {
+    srand(1);
+
+    test_scanners_agree();
+    test_process_line();
+    test_get_length();
+    test_convert_buffer();
+    test_map_kernel();
+    test_raw();
+    test_bytes();
+    test_incbin();
+    test_stats();
+
+    printf("Active scanner: %s\n", get_active_scanner()->name);
+    return 0;
+}
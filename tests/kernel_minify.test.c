@@ -0,0 +1,86 @@
+//
+// Tests of minify_kernel(). The minified kernel is written into a buffer of exactly the size of the original, so
+// writes out of bounds are caught when running under AddressSanitizer.
+//
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+
+#include "../include/kernel_helper.h"
+
+/*
+ * Minify a kernel and check both the minified kernel and the size reported for it.
+ */
+static void check_minified(const char *kernel, const char *expected) {
+    size_t size = strlen(kernel);
+    char *source = malloc(size > 0 ? size : 1);
+    char *minified = malloc(size > 0 ? size : 1);
+    memcpy(source, kernel, size);
+
+    size_t minified_size = minify_kernel(source, size, minified);
+    assert(minified_size <= size);
+    assert(minified_size == strlen(expected));
+    assert(memcmp(minified, expected, minified_size) == 0);
+
+    free(minified);
+    free(source);
+}
+
+/*
+ * Spaces are dropped between tokens, unless dropping them would merge two tokens into another.
+ */
+static void test_spaces(void) {
+    check_minified("int   a = b ;\n", "int a=b;\n");
+    check_minified("x = a - -b;\n", "x=a- -b;\n");
+    check_minified("x = a+ +b;\n", "x=a+ +b;\n");
+    check_minified("x = a/ *p;\n", "x=a/ *p;\n");
+    check_minified("x = a - - b;\n", "x=a- -b;\n");
+    check_minified("x = 0x1p +3;\n", "x=0x1p +3;\n");
+    check_minified("x = 1e -2 + L 'a';\n", "x=1e -2+L 'a';\n");
+    check_minified("\tf ( a , b ) ;\r\n", "f(a,b);\n");
+}
+
+/*
+ * Comments are removed, except inside string and character literals, which are copied as they are.
+ */
+static void test_comments(void) {
+    check_minified("a; // comment\nb;\n", "a;\nb;\n");
+    check_minified("a /* one\ntwo */ b;\n", "a b;\n");
+    check_minified("a/**/b;\n", "a b;\n");
+    check_minified("s = \"// not a comment /* nor this */\";\n", "s=\"// not a comment /* nor this */\";\n");
+    check_minified("c = '/' + '*'; d = \"\\\"//\";\n", "c='/'+'*';d=\"\\\"//\";\n");
+    check_minified("a; /* unterminated", "a;");
+}
+
+/*
+ * Line splices join two lines into one, including inside a line comment, which then continues on the next line.
+ */
+static void test_splices(void) {
+    check_minified("int ab\\\nc;\n", "int abc;\n");
+    check_minified("int a\\\r\nb;\n", "int ab;\n");
+    check_minified("a; // comment \\\ncontinued\nb;\n", "a;\nb;\n");
+    check_minified("a /\\\n* comment *\\\n/ b;\n", "a b;\n");
+}
+
+/*
+ * Directives keep their own line and their spacing, blank lines are dropped, and header names are not comments.
+ */
+static void test_directives(void) {
+    check_minified("int a;\n#define A 1\nint b;", "int a;\n#define A 1\nint b;");
+    check_minified("a;\n\n\n   \nb;\n", "a;\nb;\n");
+    check_minified("#define F(a) (a)\n", "#define F(a) (a)\n");
+    check_minified("#define F(a) \\\n    ((a) + 1)\nx = F(1);\n", "#define F(a) ((a) + 1)\nx=F(1);\n");
+    check_minified("#include <a//b.h>\n#include <c/*d.h>\nint x;\n", "#include <a//b.h>\n#include <c/*d.h>\nint x;\n");
+    check_minified("#  include   <a//b.h> // comment\n", "# include <a//b.h>\n");
+    check_minified("#if A < B // comment\n#endif\n", "#if A < B\n#endif\n");
+    check_minified("x = a < b; // comment\n", "x=a<b;\n");
+}
+
+int main(void) {
+    test_spaces();
+    test_comments();
+    test_splices();
+    test_directives();
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+//
+// Tests of specialize_kernel(). Kernels are copied into buffers of their exact size, which are not null-terminated,
+// so reads past the end of a kernel are caught when running under AddressSanitizer.
+//
+
+#undef NDEBUG // The tests rely on assert(), whatever the build type
+#include <assert.h>
+
+#include "../include/kernel_helper.h"
+
+static const struct kernel_parameter parameters[] = {
+    { "WG", "64" }, { "TILE", "(WG / 16)" }, { "HALF", "0" }, { "LOOP_A", "LOOP_B" }, { "LOOP_B", "LOOP_A" }
+};
+
+/*
+ * Count the newlines of a string.
+ */
+static size_t count_lines(const char *string, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) {
+        count += string[i] == '\n';
+    }
+    return count;
+}
+
+/*
+ * Specialize a kernel with the test parameters, and check that it becomes the expected kernel after the #define of
+ * every parameter and the line reset. Every line of the kernel must keep its number.
+ */
+static void check_specialized(const char *kernel, const char *expected) {
+    const size_t parameter_count = sizeof(parameters) / sizeof(parameters[0]);
+    size_t size = strlen(kernel);
+    char *source = malloc(size > 0 ? size : 1);
+    memcpy(source, kernel, size);
+
+    char *specialized = malloc(specialize_bound(parameters, parameter_count, size));
+    size_t specialized_size = specialize_kernel(source, size, parameters, parameter_count, specialized);
+    assert(specialized_size <= specialize_bound(parameters, parameter_count, size));
+
+    static const char prefix[] = "#define WG 64\n#define TILE (WG / 16)\n#define HALF 0\n#define LOOP_A LOOP_B\n"
+                                 "#define LOOP_B LOOP_A\n" SPECIALIZE_LINE_RESET;
+    assert(specialized_size == sizeof(prefix) - 1 + strlen(expected));
+    assert(memcmp(specialized, prefix, sizeof(prefix) - 1) == 0);
+    assert(memcmp(specialized + sizeof(prefix) - 1, expected, strlen(expected)) == 0);
+    assert(count_lines(expected, strlen(expected)) == count_lines(kernel, size));
+
+    free(specialized);
+    free(source);
+}
+
+/*
+ * Nested groups are resolved branch by branch, and only the branches taken are kept.
+ */
+static void test_nested(void) {
+    check_specialized("#if WG == 64\n"
+                      "a\n"
+                      "#if HALF\n"
+                      "b\n"
+                      "#elif WG > 32\n"
+                      "c\n"
+                      "#else\n"
+                      "d\n"
+                      "#endif\n"
+                      "#elif WG == 128\n"
+                      "e\n"
+                      "#else\n"
+                      "f\n"
+                      "#endif\n",
+                      "\na\n\n\n\nc\n\n\n\n\n\n\n\n\n");
+
+    check_specialized("#if WG == 32\n"
+                      "a\n"
+                      "#elif WG == 64\n"
+                      "#ifndef HALF\n"
+                      "b\n"
+                      "#else\n"
+                      "c\n"
+                      "#endif\n"
+                      "#endif\n",
+                      "\n\n\n\n\n\nc\n\n\n");
+}
+
+/*
+ * defined() and #ifdef are known for parameters only, and && and || are known as soon as either side decides them.
+ */
+static void test_defined(void) {
+    check_specialized("#if defined(WG) && defined TILE\na\n#endif\n", "\na\n\n");
+    check_specialized("#if defined(OTHER) || WG == 64\na\n#endif\n", "\na\n\n");
+    check_specialized("#if defined(OTHER) && WG == 32\na\n#endif\n", "\n\n\n");
+    check_specialized("#ifdef WG\na\n#else\nb\n#endif\n", "\na\n\n\n\n");
+
+    // Conditions on other macros are kept, along with the rest of their group
+    check_specialized("#if defined(OTHER) && WG == 64\na\n#else\nb\n#endif\n",
+                      "#if defined(OTHER) && WG == 64\na\n#else\nb\n#endif\n");
+    check_specialized("#ifdef OTHER\na\n#endif\n", "#ifdef OTHER\na\n#endif\n");
+    check_specialized("#if WG == 32\na\n#elif OTHER\nb\n#else\nc\n#endif\n", "\n\n#if OTHER\nb\n#else\nc\n#endif\n");
+}
+
+/*
+ * Arithmetic follows the preprocessor's rules, and anything it leaves undefined is left to the compiler.
+ */
+static void test_arithmetic(void) {
+    check_specialized("#if (WG * 2 + 1) % 3 == 0 && (WG << 1) == 128 && -WG < 0 && ~0 == -1\na\n#endif\n", "\na\n\n");
+    check_specialized("#if 0x40 == WG && 0100 == WG && 64u == WG && 64UL == WG\na\n#endif\n", "\na\n\n");
+    check_specialized("#if WG > 32 ? WG / 2 == 32 : 0\na\n#endif\n", "\na\n\n");
+    check_specialized("#if WG / 0\na\n#endif\n", "#if WG / 0\na\n#endif\n");
+    check_specialized("#if 1 << 64\na\n#endif\n", "#if 1 << 64\na\n#endif\n");
+    check_specialized("#if 99999999999999999999 > WG\na\n#endif\n", "#if 99999999999999999999 > WG\na\n#endif\n");
+    check_specialized("#if 08 == 8\na\n#endif\n", "#if 08 == 8\na\n#endif\n");
+    check_specialized("#if 0x == 0\na\n#endif\n", "#if 0x == 0\na\n#endif\n");
+    check_specialized("#if 1.5 > WG\na\n#endif\n", "#if 1.5 > WG\na\n#endif\n");
+
+    // Unsigned operands convert the other side to unsigned, and literals too large to be signed are unsigned
+    check_specialized("#if -1 < 0u\na\n#endif\n", "\n\n\n");
+    check_specialized("#if 0xFFFFFFFFFFFFFFFF > 0\na\n#endif\n", "\na\n\n");
+    check_specialized("#if -1 / 2u > WG && -2 >> 1u == -1 && (1 ? -1 : 0u) > 0 && (-WG < 0) == 1\na\n#endif\n",
+                      "\na\n\n");
+}
+
+/*
+ * Parameters whose values refer to other parameters are expanded, up to SPECIALIZE_MAX_EXPANSION levels, and a
+ * parameter the kernel redefines is no longer known.
+ */
+static void test_parameter_references(void) {
+    check_specialized("#if TILE == 4\na\n#else\nb\n#endif\n", "\na\n\n\n\n");
+    check_specialized("#if TILE * TILE == WG / 4\na\n#endif\n", "\na\n\n");
+    check_specialized("#if LOOP_A\na\n#endif\n", "#if LOOP_A\na\n#endif\n");
+    check_specialized("#define WG 32\n#if TILE == 4\na\n#endif\n", "#define WG 32\n#if TILE == 4\na\n#endif\n");
+    check_specialized("#undef HALF\n#ifdef HALF\na\n#endif\n", "#undef HALF\n#ifdef HALF\na\n#endif\n");
+}
+
+/*
+ * Directives at the very end of a kernel without a newline, or inside comments, must be handled within bounds.
+ */
+static void test_edges(void) {
+    check_specialized("", "");
+    check_specialized("#if 1", "");
+    check_specialized("#if 12", "");
+    check_specialized("#if WG", "");
+    check_specialized("#if 0x1f", "");
+    check_specialized("#if 1\na\n#endif", "\na\n");
+    check_specialized("#if 0\na\n#else\nb", "\n\n\nb");
+    check_specialized("/*\n#if WG == 32\n*/\na\n", "/*\n#if WG == 32\n*/\na\n");
+    check_specialized("#if WG == \\\n64\na\n#endif\n", "\n\na\n\n");
+}
+
+int main(void) {
+    test_nested();
+    test_defined();
+    test_arithmetic();
+    test_parameter_references();
+    test_edges();
+
+    return 0;
+}